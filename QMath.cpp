@@ -5,9 +5,42 @@
 #include <iostream>
 #include <cctype>
 #include <typeinfo>
+#include <cstring>
+#include <limits>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <cstdio>
+#include <deque>
+#include <condition_variable>
+#include <exception>
 #ifndef M_E
 #define M_E 2.7182818284590452353602874
 #endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define QMATH_X86_DISPATCH
+#include <immintrin.h>
+#endif
+#if defined(__GNUC__) && defined(__x86_64__) && !defined(_WIN32)
+#define QMATH_JIT
+#include <sys/mman.h>
+#endif
+#if !defined(_WIN32)
+#define QMATH_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#define QMATH_BATCH_BLOCK 128
+
+#if defined(__GNUC__)
+#define QMATH_KERNEL __attribute__((always_inline)) static inline
+#else
+#define QMATH_KERNEL static inline
+#endif
 
 
 using namespace QMath;
@@ -22,1233 +55,6450 @@ bool QMath::isNumber(const std::string& numString)
     else { return true; }
 }
 
-bool Expression::operator!= (const Expression &b) { return !(*this == b); }
-
-Expression::~Expression() {}
-
-bool Expression::isAtomic() { return false; }
+Bindings::Bindings(const std::string& variables)
+{
+	variableNames = variables;
+	std::sort(variableNames.begin(), variableNames.end());
+	variableNames.erase(std::unique(variableNames.begin(), variableNames.end()), variableNames.end());
+	values.assign(variableNames.size(), 0);
+	std::fill_n(slots, 256, -1);
+	for (size_t i = 0; i < variableNames.size(); ++i) { slots[(unsigned char)variableNames[i]] = (short)i; }
+}
 
-Expression* Expression::simplify() { return copyTree(); }
+Bindings::Bindings(const std::map<char, double>& varMap)
+{
+	std::string variables;
+	for (const std::pair<const char, double>& binding : varMap) { variables += binding.first; }
+	*this = Bindings(variables);
+	for (const std::pair<const char, double>& binding : varMap) { set(binding.first, binding.second); }
+}
 
-bool Expression::isCommutative() { return true; }
+void Bindings::set(char var, double value)
+{
+	int index = slot(var);
+	if (index < 0) { throw "Unbound variable"; }
+	values[index] = value;
+}
 
-void Expression::substitute(char var, double value)
+const double* Bindings::data() const { return values.data(); }
+
+const std::string& Bindings::variables() const { return variableNames; }
+
+// Fast precision kernels. Apart from the libm fallback for huge trigonometric arguments they are free of calls and
+// branches, the special cases being selects, so loops over them vectorise. Arguments are reduced by Cody-Waite
+// splits of ln 2 and pi / 2, exact over the ranges handled, and the remainder goes through a polynomial or rational
+// approximation
+static const double roundingShift = 6755399441055744.0;
+static const double ln2High = 6.93147180369123816490e-01;
+static const double ln2Low = 1.90821492927058770002e-10;
+static const double inverseLn2 = 1.44269504088896338700e+00;
+static const double inverseLn10 = 4.34294481903251827651e-01;
+static const double inversePiOver2 = 6.36619772367581382433e-01;
+static const double piOver2High = 1.57079632679489655800e+00;
+static const double piOver2Low = 6.12323399573676603587e-17;
+static const double piOver2Part1 = 1.57079632673412561417e+00;
+static const double piOver2Tail1 = 6.07710050650619224932e-11;
+static const double piOver2Part2 = 6.07710050630396597660e-11;
+static const double piOver2Tail2 = 2.02226624879595063154e-21;
+static const double piOver2Part3 = 2.02226624871116645580e-21;
+static const double piOver2Tail3 = 8.47842766036889956997e-32;
+
+// Beyond this the multiple of pi / 2 no longer fits the exact part of the split
+static const double fastReductionLimit = 1647099.0;
+
+QMATH_KERNEL unsigned long long bitsOf(double value)
 {
-	std::map<char, double> varMap = std::map<char, double>();
-	varMap.emplace(var, value);
-	substitute(varMap);
+	unsigned long long bits;
+	std::memcpy(&bits, &value, sizeof(double));
+	return bits;
 }
 
-double Expression::evaluate(const std::map<char, double>& varMap)
+QMATH_KERNEL double fromBits(unsigned long long bits)
 {
-	substitute(varMap);
-	return evaluate();
+	double value;
+	std::memcpy(&value, &bits, sizeof(double));
+	return value;
 }
 
-double Expression::evaluate(char var, double value)
+// 2^k for integral k in [-1022, 1023], built from the low bits that the rounding shift leaves in the mantissa
+QMATH_KERNEL double powerOfTwo(double k) { return fromBits((bitsOf(k + roundingShift) + 1023) << 52); }
+
+QMATH_KERNEL double fastExp(double x)
 {
-	substitute(var, value);
-	return evaluate();
+	double clamped = x > 709.8 ? 709.8 : x < -745.2 ? -745.2 : x;
+	double k = (clamped * inverseLn2 + roundingShift) - roundingShift;
+	double r = (clamped - k * ln2High) - k * ln2Low;
+
+	double p = 1.0 / 6227020800.0;
+	p = p * r + 1.0 / 479001600.0;
+	p = p * r + 1.0 / 39916800.0;
+	p = p * r + 1.0 / 3628800.0;
+	p = p * r + 1.0 / 362880.0;
+	p = p * r + 1.0 / 40320.0;
+	p = p * r + 1.0 / 5040.0;
+	p = p * r + 1.0 / 720.0;
+	p = p * r + 1.0 / 120.0;
+	p = p * r + 1.0 / 24.0;
+	p = p * r + 1.0 / 6.0;
+	p = p * r + 0.5;
+	p = p * r * r + r + 1;
+
+	// Scaling in two halves keeps both factors normal at the ends of the range
+	double half = (k * 0.5 + roundingShift) - roundingShift;
+	double result = p * powerOfTwo(half) * powerOfTwo(k - half);
+	return x > 709.782712893384 ? std::numeric_limits<double>::infinity() : x < -745.1332191019412 ? 0 : result;
 }
 
-Expression* Expression::parse(const std::string& input, bool validateAndRectify)
+// ln x = e ln 2 + 2 atanh(f), with x = m 2^e, m in [sqrt(1/2), sqrt(2)) and f = (m - 1) / (m + 1)
+QMATH_KERNEL double fastLn(double x)
 {
-    std::string parseInput = cleanseParseInput(input);
-    if (parseInput.size() > 1 && !isNumber(parseInput))
-    {
-        const ExpressionData table[] = { ExpressionData("+", ExpressionData::Type::Operator),
-										 ExpressionData("-", ExpressionData::Type::Operator),
-										 ExpressionData("*", ExpressionData::Type::Operator),
-										 ExpressionData("/", ExpressionData::Type::Operator),
-										 ExpressionData("^", ExpressionData::Type::Operator),
-										 ExpressionData("invsqrt", ExpressionData::Type::Function),
-										 ExpressionData("sqrt", ExpressionData::Type::Function),
-										 ExpressionData("arcsin", ExpressionData::Type::Function),
-										 ExpressionData("arccos", ExpressionData::Type::Function),
-										 ExpressionData("sinh", ExpressionData::Type::Function),
-										 ExpressionData("cosh", ExpressionData::Type::Function),
-										 ExpressionData("tanh", ExpressionData::Type::Function),
-										 ExpressionData("sinc", ExpressionData::Type::Function),
-										 ExpressionData("cosech", ExpressionData::Type::Function),
-										 ExpressionData("cosec", ExpressionData::Type::Function),
-										 ExpressionData("sech", ExpressionData::Type::Function),
-										 ExpressionData("sec", ExpressionData::Type::Function),
-										 ExpressionData("csc", ExpressionData::Type::Function),
-										 ExpressionData("cotanh", ExpressionData::Type::Function),
-										 ExpressionData("cotan", ExpressionData::Type::Function),
-									     ExpressionData("coth", ExpressionData::Type::Function),
-										 ExpressionData("cot", ExpressionData::Type::Function),
-										 ExpressionData("sin", ExpressionData::Type::Function),
-										 ExpressionData("cos", ExpressionData::Type::Function),
-										 ExpressionData("tan", ExpressionData::Type::Function),
-										 ExpressionData("ln", ExpressionData::Type::Function),
-										 ExpressionData("log", ExpressionData::Type::Function)};
-            
-		if (validateAndRectify)
-		{
-			for (int i = parseInput.size() - 1; i >= 0; --i)
-			{
-				if (parseInput[i] == '(' && i > 0)
-				{
-					if (parseInput[i - 1] != '(')
-					{
-						bool operatorFound = false;
-						int offset = 0;
-						for (int j = 0; j < sizeof(table) / sizeof(table[0]); ++j)
-						{
-							int searchSize = table[j].name.size();
-							int searchOffset = i - searchSize;
-							if (searchOffset >= 0)
-							{
-								if (parseInput.substr(searchOffset, searchSize) == table[j].name)
-								{
-									bool isSubFunction = false;
-									for (int k = 0; k < sizeof(table) / sizeof(table[0]); ++k)
-									{
-										int subSearchSize = table[k].name.size();
-										int subSearchOffset = i - subSearchSize;
-										if (subSearchSize > searchSize)
-										{
-											if (subSearchOffset >= 0)
-											{
-												if (j != k && parseInput.substr(subSearchOffset, subSearchSize) == table[k].name)
-												{
-													k = sizeof(table) / sizeof(table[0]);
-													isSubFunction = true;
-													break;
-												}
-											}
-										}
-									}
-
-									if (!isSubFunction)
-									{
-										if (table[j].type == ExpressionData::Operator)
-										{
-											operatorFound = true;
-											offset = 0;
-											j = sizeof(table) / sizeof(table[0]);
-											break;
-										}
-										else
-										{
-											offset = -searchSize;
-											for (int k = 0; k < sizeof(table) / sizeof(table[0]); ++k)
-											{
-												int searchIndex = i - searchSize - 1;
-												bool validSearch = searchIndex >= 0 && searchIndex < parseInput.size();
-												if (validSearch && table[k].type == ExpressionData::Operator && parseInput[searchIndex] == table[k].name[0])
-												{
-													operatorFound = true;
-													k = j = sizeof(table) / sizeof(table[0]);
-													break;
-												}
-											}
-										}
-									}
-								}
-							}
-						}
+	bool subnormal = x < 2.2250738585072014e-308;
+	unsigned long long bits = bitsOf(subnormal ? x * 18014398509481984.0 : x);
+	double m = fromBits((bits & 0x000FFFFFFFFFFFFFULL) | 0x3FF0000000000000ULL);
+	bool high = m > 1.4142135623730951;
+	m = high ? m * 0.5 : m;
+	double e = (fromBits((bits >> 52) | 0x4330000000000000ULL) - 4503599627370496.0) - (subnormal ? 1077 : 1023) + (high ? 1 : 0);
+
+	double f = (m - 1) / (m + 1);
+	double s = f * f;
+	double p = 2.0 / 21;
+	p = p * s + 2.0 / 19;
+	p = p * s + 2.0 / 17;
+	p = p * s + 2.0 / 15;
+	p = p * s + 2.0 / 13;
+	p = p * s + 2.0 / 11;
+	p = p * s + 2.0 / 9;
+	p = p * s + 2.0 / 7;
+	p = p * s + 2.0 / 5;
+	p = p * s + 2.0 / 3;
+	double result = e * ln2High + (e * ln2Low + (f * s * p + 2 * f));
+
+	double infinity = std::numeric_limits<double>::infinity();
+	double special = x == 0 ? -infinity : x == infinity ? infinity : std::numeric_limits<double>::quiet_NaN();
+	return x > 0 && x < infinity ? result : special;
+}
 
-						int insertionIndex = i + offset;
-						if (!operatorFound)
-						{
-							if (insertionIndex > 0 && insertionIndex < parseInput.size())
-							{
-								if (parseInput[insertionIndex - 1] != '(')
-								{
-									parseInput.insert(insertionIndex, "*");
-								}
-							}
-						}
-					}
-				}
-			}
+QMATH_KERNEL double fastLog10(double x) { return fastLn(x) * inverseLn10; }
 
-			for (int i = 0; i < parseInput.size(); ++i)
-			{
-				if (parseInput[i] == ')' && i < input.size() - 1)
-				{
-					if (parseInput[i + 1] != ')')
-					{
-						bool operatorFound = false;
-						for (int j = 0; j < sizeof(table) / sizeof(table[0]); ++j)
-						{
-							if (table[j].type == ExpressionData::Operator && parseInput[i + 1] == table[j].name[0])
-							{
-								operatorFound = true;
-								j = sizeof(table) / sizeof(table[0]);
-								break;
-							}
-						}
-						if (!operatorFound && i + 1 < parseInput.size()) { parseInput.insert(i + 1, "*"); }
-					}
-				}
-			}
-		}
+QMATH_KERNEL double fastLogBase(double base, double x) { return fastLn(x) / fastLn(base); }
 
-        for (int i = 0; i < sizeof(table) / sizeof(table[0]); ++i)
-        {
-            size_t index = -1;
-            do
-            {
-				index = parseInput.rfind(table[i].name, index - 1);
-				if (index != std::string::npos && determineScopeDepth(parseInput, (int)index) == 0)
-				{
-					switch (table[i].type)
-					{
-						case ExpressionData::Type::Operator:
-						{
-							std::string left = parseInput.substr(0, index);
-							std::string right = parseInput.substr(index + table[i].name.size(), parseInput.size() - (index + table[i].name.size()));
-							return parseOperator(left, right, table[i]);
-						}
-                        
-						case ExpressionData::Type::Function:
-						{
-							std::string right = parseInput.substr(index + table[i].name.size(), parseInput.size() - (index + table[i].name.size()));
-							return parseFunction(right, table[i]);
-						}
-					}
-				}
-            } while (index != std::string::npos);
-        }
-        
-        return parseBaseCase(parseInput);
-    }
-    else { return parseBaseCase(parseInput); }
+// exp(y ln |x|), negated for negative x and odd y
+QMATH_KERNEL double fastPow(double x, double y)
+{
+	double result = fastExp(y * fastLn(std::fabs(x)));
+	bool integral = y == std::floor(y);
+	bool odd = integral && y * 0.5 != std::floor(y * 0.5);
+	double negative = integral ? (odd ? -result : result) : std::numeric_limits<double>::quiet_NaN();
+	return y == 0 || x == 1 ? 1 : x < 0 ? negative : result;
 }
 
-Expression* Expression::parseBaseCase(const std::string &input)
+// Reduces x to y0 + y1 in [-pi / 4, pi / 4], subtracting the multiple of pi / 2 in three exact parts; the low bits
+// of the result give the quadrant
+QMATH_KERNEL unsigned long long reduceQuarterTurns(double x, double& y0, double& y1)
 {
-    if (isNumber(input)) { return new Number(std::stod(input)); }
-    else
-    {
-        if (input.size() == 1)
-        {
-            if (input[0] == 'e') { return new Constant('e'); }
-            else { return new Variable(input[0]); }
-        }
-        else
-        {
-            Expression *leftOperand = parse(input.substr(0, input.size() - 1), false);
-            Expression *rightOperand = parse(input.substr(input.size() - 1, 1), false);
-            return new Multiply(leftOperand, rightOperand);
-        }
-    }
+	double shifted = x * inversePiOver2 + roundingShift;
+	double k = shifted - roundingShift;
+
+	double r = x - k * piOver2Part1;
+	double w = k * piOver2Tail1;
+	double t = r;
+	w = k * piOver2Part2;
+	r = t - w;
+	w = k * piOver2Tail2 - ((t - r) - w);
+	t = r;
+	w = k * piOver2Part3;
+	r = t - w;
+	w = k * piOver2Tail3 - ((t - r) - w);
+	y0 = r - w;
+	y1 = (r - y0) - w;
+	return bitsOf(shifted);
 }
 
-Expression* Expression::parseOperator(const std::string &inputLeft, const std::string &inputRight, const ExpressionData& operatorData)
+// Minimax polynomials for sin and cos on [-pi / 4, pi / 4], correcting for the tail y of the argument
+QMATH_KERNEL double sinPolynomial(double x, double y)
 {
-    Expression* leftOperand = parse(inputLeft, false);
-    Expression* rightOperand = parse(inputRight, false);
-    
-    if (operatorData.name == "+") { return new Add(leftOperand, rightOperand); }
-    else if (operatorData.name == "-") { return new Subtract(leftOperand, rightOperand); }
-    else if (operatorData.name == "*") { return new Multiply(leftOperand, rightOperand); }
-    else if (operatorData.name == "/") { return new Divide(leftOperand, rightOperand); }
-    else if (operatorData.name == "^") { return new Exponent(leftOperand, rightOperand); }
-    else { throw "Not implemented"; }
+	double z = x * x;
+	double w = z * z;
+	double r = 8.33333333332248946124e-03 + z * (-1.98412698298579493134e-04 + z * 2.75573137070700676789e-06) + z * w * (-2.50507602534068634195e-08 + z * 1.58969099521155010221e-10);
+	double v = z * x;
+	return x - ((z * (0.5 * y - v * r) - y) - v * -1.66666666666666324348e-01);
 }
 
-Expression* Expression::parseFunction(const std::string &inputRight, const ExpressionData& operatorData)
+QMATH_KERNEL double cosPolynomial(double x, double y)
 {
-    int scopeDepth = 0;
-    int scopeEnd = 0;
-    do
-    {
-        if (inputRight[scopeEnd] == '(') { scopeDepth++; }
-        else if (inputRight[scopeEnd] == ')') { scopeDepth--; }
-        ++scopeEnd;
-    } while (scopeDepth != 0);
-    
-    Expression *operand = parse(inputRight.substr(0, scopeEnd), false);
-    
-    if (operatorData.name == "sin") { return new Sin(operand); }
-	else if (operatorData.name == "arcsin") { return new Arcsin(operand); }
-    else if (operatorData.name == "cos") { return new Cos(operand); }
-	else if (operatorData.name == "arccos") { return new Arccos(operand); }
-    else if (operatorData.name == "tan") { return new Tan(operand); }
-	else if (operatorData.name == "sinh") { return new Sinh(operand); }
-	else if (operatorData.name == "cosh") { return new Cosh(operand); }
-	else if (operatorData.name == "tanh") { return new Tanh(operand); }
-    else if (operatorData.name == "sec") { return new Exponent(new Cos(operand), new Number(-1)); }
-    else if (operatorData.name == "cosec") { return new Exponent(new Sin(operand), new Number(-1)); }
-	else if (operatorData.name == "csc") { return new Exponent(new Sin(operand), new Number(-1)); }
-    else if (operatorData.name == "cotan") { return new Exponent(new Tan(operand), new Number(-1)); }
-	else if (operatorData.name == "cot") { return new Exponent(new Tan(operand), new Number(-1)); }
-	else if (operatorData.name == "sech") { return new Exponent(new Cosh(operand), new Number(-1)); }
-	else if (operatorData.name == "cosech") { return new Exponent(new Sinh(operand), new Number(-1)); }
-	else if (operatorData.name == "cotanh") { return new Exponent(new Tanh(operand), new Number(-1)); }
-	else if (operatorData.name == "coth") { return new Exponent(new Tanh(operand), new Number(-1)); }
-    else if (operatorData.name == "sinc") { return new Divide(new Sin(operand), operand->copyTree()); }
-    else if (operatorData.name == "ln") { return new Log(new Constant('e'), operand); }
-    else if (operatorData.name == "log") { return new Log(new Number(10), operand); }
-	else if (operatorData.name == "sqrt") { return new Exponent(operand, 0.5f); }
-	else if (operatorData.name == "invsqrt") { return new Exponent(operand, -0.5f); }
-    else { throw "Not implemented"; }
+	double z = x * x;
+	double w = z * z;
+	double r = z * (4.16666666666666019037e-02 + z * (-1.38888888888741095749e-03 + z * 2.48015872894767294178e-05)) + w * w * (-2.75573143513906633035e-07 + z * (2.08757232129817482790e-09 + z * -1.13596475577881948265e-11));
+	double half = 0.5 * z;
+	w = 1 - half;
+	return w + (((1 - w) - half) + (z * r - x * y));
 }
 
-std::string Expression::cleanseParseInput(std::string input)
+QMATH_KERNEL double sinKernel(double x)
 {
-    std::string cleansedInput = input;
-    cleansedInput.erase(std::remove_if(cleansedInput.begin(), cleansedInput.end(), static_cast<int(&)(int)>(std::isspace)), cleansedInput.end());
-    
-    bool reduceScope = false;
-    do
-    {
-        int currentScope = 0;
-        int i = 0;
-        bool reductionPossible = false;
-        do
-        {
-            if (cleansedInput[i] == '(')
-            {
-                reductionPossible = true;
-                currentScope++;
-            }
-            else if (cleansedInput[i] == ')')
-            {
-                reductionPossible = true;
-                currentScope--;
-            }
-            ++i;
-            
-        } while (currentScope != 0 && i < cleansedInput.size());
-        
-        reduceScope = i == cleansedInput.size() && reductionPossible;
-        if (reduceScope) { cleansedInput = cleansedInput.substr(1, cleansedInput.size() - 2); }
-    } while (reduceScope);
-    return cleansedInput;
+	double y0;
+	double y1;
+	unsigned long long quadrant = reduceQuarterTurns(x, y0, y1);
+	double s = sinPolynomial(y0, y1);
+	double c = cosPolynomial(y0, y1);
+	double result = quadrant & 1 ? c : s;
+	return quadrant & 2 ? -result : result;
 }
 
-unsigned char Expression::determineScopeDepth(const std::string &input, int expansionCenter)
+QMATH_KERNEL double cosKernel(double x)
 {
-    int scopeDepth = 0;
-    for (int i = 0; i < expansionCenter; ++i)
-    {
-        if (input[i] == '(') { scopeDepth++; }
-        else if (input[i] == ')') { scopeDepth--; }
-    }
-    return scopeDepth;
+	double y0;
+	double y1;
+	unsigned long long quadrant = reduceQuarterTurns(x, y0, y1);
+	double s = sinPolynomial(y0, y1);
+	double c = cosPolynomial(y0, y1);
+	double result = quadrant & 1 ? -s : c;
+	return quadrant & 2 ? -result : result;
 }
 
-Expression::ExpressionData::ExpressionData(std::string name, Type type)
+QMATH_KERNEL double tanKernel(double x)
 {
-    this->name = name;
-    this->type = type;
+	double y0;
+	double y1;
+	unsigned long long quadrant = reduceQuarterTurns(x, y0, y1);
+	double s = sinPolynomial(y0, y1);
+	double c = cosPolynomial(y0, y1);
+	return quadrant & 1 ? -c / s : s / c;
 }
 
-bool Operator::operator== (const Expression &b)
+// Taylor series of sinh and cosh, for |x| < 1 where the exponential forms cancel
+QMATH_KERNEL double sinhSeries(double x)
 {
-	if (this == &b) { return true; }
-	if (typeid(*this) != typeid(b)) { return false; }
-	else
-	{
-		Operator* bOperator = (Operator*)&b;
-		if (isCommutative()) { return (*leftOperand == *bOperator->leftOperand && *rightOperand == *bOperator->rightOperand) ||
-										(*leftOperand == *bOperator->rightOperand && *rightOperand == *bOperator->leftOperand); }
-		else { return *leftOperand == *bOperator->leftOperand && *rightOperand == *bOperator->rightOperand; }
-	}
+	double z = x * x;
+	double p = 1.0 / 51090942171709440000.0;
+	p = p * z + 1.0 / 121645100408832000.0;
+	p = p * z + 1.0 / 355687428096000.0;
+	p = p * z + 1.0 / 1307674368000.0;
+	p = p * z + 1.0 / 6227020800.0;
+	p = p * z + 1.0 / 39916800.0;
+	p = p * z + 1.0 / 362880.0;
+	p = p * z + 1.0 / 5040.0;
+	p = p * z + 1.0 / 120.0;
+	p = p * z + 1.0 / 6.0;
+	return x + x * z * p;
 }
 
-void Operator::determineParentheses(bool& left, bool& right)
+QMATH_KERNEL double coshSeries(double x)
 {
-	if (leftOperand->precedence() < precedence()) { left = true; }
-	else { left = false; }
-	if (rightOperand->precedence() < precedence()) { right = true; }
-	else if (rightOperand->precedence() == precedence() && !rightOperand->isCommutative()) { right = true; }
-	else { right = false; }
+	double z = x * x;
+	double p = 1.0 / 2432902008176640000.0;
+	p = p * z + 1.0 / 6402373705728000.0;
+	p = p * z + 1.0 / 20922789888000.0;
+	p = p * z + 1.0 / 87178291200.0;
+	p = p * z + 1.0 / 479001600.0;
+	p = p * z + 1.0 / 3628800.0;
+	p = p * z + 1.0 / 40320.0;
+	p = p * z + 1.0 / 720.0;
+	p = p * z + 1.0 / 24.0;
+	return 1 + z * (0.5 + z * p);
 }
 
-void Operator::toStringOperands(std::string& left, std::string& right)
+// Past |x| = 709 e^|x| overflows before sinh and cosh do, so e^(|x| / 2) is squared instead
+QMATH_KERNEL double fastSinh(double x)
 {
-	bool leftParentheses;
-	bool rightParentheses;
-	determineParentheses(leftParentheses, rightParentheses);
-	left = leftOperand->toString(leftParentheses);
-	right = rightOperand->toString(rightParentheses);
+	double a = std::fabs(x);
+	double e = fastExp(a < 709 ? a : a / 2);
+	double large = a < 709 ? 0.5 * (e - 1 / e) : 0.5 * e * e;
+	double result = a < 1 ? sinhSeries(a) : large;
+	return x < 0 ? -result : result;
 }
 
-bool Operator::isConstant() { return leftOperand->isConstant() && rightOperand->isConstant(); }
-
-void Operator::substitute(const std::map<char, double>& varMap)
+QMATH_KERNEL double fastCosh(double x)
 {
-	leftOperand->substitute(varMap);
-	rightOperand->substitute(varMap);
+	double a = std::fabs(x);
+	double e = fastExp(a < 709 ? a : a / 2);
+	return a < 709 ? 0.5 * (e + 1 / e) : 0.5 * e * e;
 }
 
-Operator::Operator(Expression *left, Expression *right)
+QMATH_KERNEL double fastTanh(double x)
 {
-	leftOperand = left;
-	rightOperand = right;
+	double a = std::fabs(x);
+	double small = sinhSeries(a) / coshSeries(a);
+	double large = a > 22 ? 1 : 1 - 2 / (fastExp(2 * a) + 1);
+	double result = a < 1 ? small : large;
+	return x < 0 ? -result : result;
 }
 
-Operator::Operator(double left, Expression *right) : Operator::Operator(new Number(left), right) {}
-Operator::Operator(Expression *left, double right) : Operator::Operator(left, new Number(right)) {}
-Operator::Operator(double left, double right) : Operator::Operator(new Number(left), new Number(right)) {}
-
-Operator::~Operator()
+// asin x = x + x R(x^2) for |x| < 0.5, with R a rational minimax approximation; nearer 1 it is taken as
+// pi / 2 - 2 asin(sqrt((1 - |x|) / 2)). The root is passed in, as vectorising sqrt needs math errno off
+QMATH_KERNEL double arcsinRational(double z)
 {
-	delete leftOperand;
-	delete rightOperand;
+	double p = z * (1.66666666666666657415e-01 + z * (-3.25565818622400915405e-01 + z * (2.01212532134862925881e-01 + z * (-4.00555345006794114027e-02 + z * (7.91534994289814532176e-04 + z * 3.47933107596021167570e-05)))));
+	double q = 1 + z * (-2.40339491173441421878e+00 + z * (2.02094576023350569471e+00 + z * (-6.88283971605453293030e-01 + z * 7.70381505559019352791e-02)));
+	return p / q;
 }
 
-Expression* Operator::getLeftOperand() { return leftOperand; }
-Expression* Operator::getRightOperand() { return rightOperand; }
+QMATH_KERNEL double halfAngle(double x) { return (1 - std::fabs(x)) * 0.5; }
 
-template<typename T>
-Expression* Operator::factoriseLinear(Expression *left, Expression *right)
+QMATH_KERNEL double arcsinKernel(double x, double root)
 {
-	if (typeid(*left) == typeid(Multiply) || typeid(*right) == typeid(Multiply))
-	{
-		Multiply* leftMul = typeid(*left) == typeid(Multiply) ? (Multiply*)left->copyTree() : new Multiply(left->copyTree(), 1);
-		Multiply* rightMul = typeid(*right) == typeid(Multiply) ? (Multiply*)right->copyTree() : new Multiply(right->copyTree(), 1);
-		Expression* leftOperands[2] = { leftMul->getLeftOperand(), leftMul->getRightOperand() };
-		Expression* rightOperands[2] = { rightMul->getLeftOperand(), rightMul->getRightOperand() };
-		for (int i = 0; i < 2; i++)
-		{
-			for (int j = 0; j < 2; j++)
-			{
-				if (*(leftOperands[i]) == *(rightOperands[j]))
-				{
-
-					T* newMul = new T(leftOperands[1 - i]->copyTree(), rightOperands[1 - j]->copyTree());
-					Expression* newMulSim = newMul->simplify();
-
-					Multiply* result = new Multiply(newMulSim, leftOperands[i]->copyTree());
-					Expression* resultSim = result->simplify();
+	double a = std::fabs(x);
+	double small = a + a * arcsinRational(a * a);
+	double large = piOver2High - (2 * (root + root * arcsinRational(halfAngle(x))) - piOver2Low);
+	double result = a < 0.5 ? small : large;
+	return x < 0 ? -result : result;
+}
 
-					delete newMul;
-					delete result;
-					delete leftMul;
-					delete rightMul;
+QMATH_KERNEL double arccosKernel(double x, double root)
+{
+	double small = piOver2High - (x - (piOver2Low - x * arcsinRational(x * x)));
+	double w = root * arcsinRational(halfAngle(x));
+	double positive = 2 * (root + w);
+	double negative = 2 * (piOver2High - (root + (w - piOver2Low)));
+	return std::fabs(x) < 0.5 ? small : x > 0 ? positive : negative;
+}
 
-					return resultSim;
-				}
-			}
-		}
+static double fastSin(double x) { return std::fabs(x) < fastReductionLimit ? sinKernel(x) : std::sin(x); }
+static double fastCos(double x) { return std::fabs(x) < fastReductionLimit ? cosKernel(x) : std::cos(x); }
+static double fastTan(double x) { return std::fabs(x) < fastReductionLimit ? tanKernel(x) : std::tan(x); }
+static double fastArcsin(double x) { return arcsinKernel(x, std::sqrt(halfAngle(x))); }
+static double fastArccos(double x) { return arccosKernel(x, std::sqrt(halfAngle(x))); }
 
-		delete leftMul;
-		delete rightMul;
+double Program::evaluate(const double* vars) const
+{
+	double localRegisters[64];
+	std::vector<double> heapRegisters;
+	double* registers = localRegisters;
+	if (instructions.size() > 64)
+	{
+		heapRegisters.resize(instructions.size());
+		registers = heapRegisters.data();
 	}
 
-	return new T(left->copyTree(), right->copyTree());
+	execute(vars, registers);
+	return registers[instructions.size() - 1];
 }
 
-template<typename T1, typename T2>
-Expression* Operator::accumulateExponentIndicies(Expression *left, Expression *right)
+void Program::execute(const double* vars, double* registers) const
 {
-	if (typeid(*left) == typeid(Exponent) || typeid(*right) == typeid(Exponent))
+	const Instruction* code = instructions.data();
+	const double* pool = constants.data();
+	// libm's table-driven exp and log beat the polynomial kernels one point at a time, so single points take only the
+	// kernels that are faster there; batches take them all
+	const bool fast = mathPrecision == Precision::Fast;
+	for (size_t i = 0; i < instructions.size(); ++i)
 	{
-		Exponent* leftExp = typeid(*left) == typeid(Exponent) ? (Exponent*)left->copyTree() : new Exponent(left->copyTree(), 1);
-		Exponent* rightExp = typeid(*right) == typeid(Exponent) ? (Exponent*)right->copyTree() : new Exponent(right->copyTree(), 1);
-		if (*(leftExp->getLeftOperand()) == *(rightExp->getLeftOperand()))
+		const Instruction& instruction = code[i];
+		switch (instruction.opcode)
 		{
-
-			T2* newExp = new T2(leftExp->getRightOperand()->copyTree(), rightExp->getRightOperand()->copyTree());
-			Expression* newExpSim = newExp->simplify();
-
-			Exponent* result = new Exponent(leftExp->getLeftOperand()->copyTree(), newExpSim);
-			Expression* resultSim = result->simplify();
-
-			delete newExp;
-			delete result;
-			delete leftExp;
-			delete rightExp;
-
-			return resultSim;
+			case Opcode::Load: registers[i] = vars[instruction.left]; break;
+			case Opcode::Constant: registers[i] = pool[instruction.left]; break;
+			case Opcode::Add: registers[i] = registers[instruction.left] + registers[instruction.right]; break;
+			case Opcode::Subtract: registers[i] = registers[instruction.left] - registers[instruction.right]; break;
+			case Opcode::Multiply: registers[i] = registers[instruction.left] * registers[instruction.right]; break;
+			case Opcode::Divide: registers[i] = registers[instruction.left] / registers[instruction.right]; break;
+			case Opcode::Exponent: registers[i] = std::pow(registers[instruction.left], registers[instruction.right]); break;
+			case Opcode::Sin: registers[i] = fast ? fastSin(registers[instruction.left]) : std::sin(registers[instruction.left]); break;
+			case Opcode::Cos: registers[i] = fast ? fastCos(registers[instruction.left]) : std::cos(registers[instruction.left]); break;
+			case Opcode::Tan: registers[i] = fast ? fastTan(registers[instruction.left]) : std::tan(registers[instruction.left]); break;
+			case Opcode::Sinh: registers[i] = fast ? fastSinh(registers[instruction.left]) : std::sinh(registers[instruction.left]); break;
+			case Opcode::Cosh: registers[i] = std::cosh(registers[instruction.left]); break;
+			case Opcode::Tanh: registers[i] = fast ? fastTanh(registers[instruction.left]) : std::tanh(registers[instruction.left]); break;
+			case Opcode::Arcsin: registers[i] = fast ? fastArcsin(registers[instruction.left]) : std::asin(registers[instruction.left]); break;
+			case Opcode::Arccos: registers[i] = fast ? fastArccos(registers[instruction.left]) : std::acos(registers[instruction.left]); break;
+			case Opcode::Ln: registers[i] = std::log(registers[instruction.left]); break;
+			case Opcode::Log10: registers[i] = std::log10(registers[instruction.left]); break;
+			case Opcode::Log: registers[i] = std::log(registers[instruction.right]) / std::log(registers[instruction.left]); break;
+			case Opcode::Sqrt: registers[i] = std::sqrt(registers[instruction.left]); break;
+			case Opcode::Exp: registers[i] = std::exp(registers[instruction.left]); break;
 		}
-
-		delete leftExp;
-		delete rightExp;
 	}
-
-	return new T1(left->copyTree(), right->copyTree());
 }
 
+Dual Program::evaluateWithDerivative(const double* vars, int slot) const
+{
+	std::vector<double> values(instructions.size());
+	std::vector<double> tangents(instructions.size());
+	std::vector<char> active(instructions.size());
+	return executeDual(vars, slot, values.data(), tangents.data(), active.data());
+}
 
-double Add::evaluate() const { return leftOperand->evaluate() + rightOperand->evaluate(); }
-
-Add* Add::differentiate(char diffOperator) { return new Add(leftOperand->differentiate(diffOperator), rightOperand->differentiate(diffOperator)); }
-
-Add* Add::copyTree() { return new Add(leftOperand->copyTree(), rightOperand->copyTree()); }
-
-std::string Add::toString(bool showParentheses)
+Dual Program::evaluateWithDerivative(const Bindings& bindings, char var) const
 {
-	std::string out = leftOperand->toString() + " + " + rightOperand->toString();
-	if (showParentheses) { out = "(" + out + ")"; }
-	return out;
+	std::vector<double> vars(variableNames.size());
+	gather(bindings, vars.data());
+	return evaluateWithDerivative(vars.data(), variableSlot(var));
 }
 
-Expression* Add::simplify()
+void Program::evaluateWithDerivativeBatch(const double* const* vars, int slot, double* out, double* derivatives, size_t n) const
 {
-	if (isConstant()) { return new Number(evaluate()); }
-	else
+	std::vector<double> values(instructions.size());
+	std::vector<double> tangents(instructions.size());
+	std::vector<char> active(instructions.size());
+	std::vector<double> point(variableNames.size());
+	for (size_t i = 0; i < n; ++i)
 	{
-		Expression* leftSim = leftOperand->simplify();
-		Expression* rightSim = rightOperand->simplify();
+		for (size_t j = 0; j < point.size(); ++j) { point[j] = vars[j][i]; }
+		Dual result = executeDual(point.data(), slot, values.data(), tangents.data(), active.data());
+		out[i] = result.value;
+		derivatives[i] = result.derivative;
+	}
+}
 
-		if (leftSim->isConstant() && leftSim->evaluate() == 0)
+Dual Program::executeDual(const double* vars, int slot, double* values, double* tangents, char* active) const
+{
+	execute(vars, values);
+	for (size_t i = 0; i < instructions.size(); ++i)
+	{
+		const Instruction& instruction = instructions[i];
+		if (instruction.opcode == Opcode::Load || instruction.opcode == Opcode::Constant)
 		{
-			delete leftSim;
-			return rightSim;
+			active[i] = instruction.opcode == Opcode::Load && (int)instruction.left == slot;
+			tangents[i] = active[i] ? 1 : 0;
+			continue;
 		}
-		else if (rightSim->isConstant() && rightSim->evaluate() == 0)
+
+		active[i] = active[instruction.left] || (isBinary(instruction.opcode) && active[instruction.right]);
+		if (!active[i])
 		{
-			delete rightSim;
-			return leftSim;
+			tangents[i] = 0;
+			continue;
 		}
 
-		if (*leftSim == *rightSim)
+		double value = values[i];
+		double left = values[instruction.left];
+		double right = isBinary(instruction.opcode) ? values[instruction.right] : 0;
+		double leftTangent = tangents[instruction.left];
+		double rightTangent = isBinary(instruction.opcode) ? tangents[instruction.right] : 0;
+
+		switch (instruction.opcode)
 		{
-			delete rightSim;
-			Multiply* mul = new Multiply(2, leftSim);
-			Expression* mulSimplified = mul->simplify();
-			delete mul;
-			return mulSimplified;
+			case Opcode::Load:
+			case Opcode::Constant:
+				break;
+			case Opcode::Add: tangents[i] = leftTangent + rightTangent; break;
+			case Opcode::Subtract: tangents[i] = leftTangent - rightTangent; break;
+			case Opcode::Multiply: tangents[i] = left * rightTangent + leftTangent * right; break;
+			case Opcode::Divide: tangents[i] = (leftTangent * right - left * rightTangent) / (right * right); break;
+			case Opcode::Exponent:
+				if (!active[instruction.right]) { tangents[i] = right * leftTangent * std::pow(left, right - 1); }
+				else if (!active[instruction.left]) { tangents[i] = std::log(left) * rightTangent * value; }
+				else { tangents[i] = value * (right * leftTangent / left + rightTangent * std::log(left)); }
+				break;
+			case Opcode::Sin: tangents[i] = leftTangent * std::cos(left); break;
+			case Opcode::Cos: tangents[i] = -leftTangent * std::sin(left); break;
+			case Opcode::Tan: tangents[i] = leftTangent / (std::cos(left) * std::cos(left)); break;
+			case Opcode::Sinh: tangents[i] = leftTangent * std::cosh(left); break;
+			case Opcode::Cosh: tangents[i] = leftTangent * std::sinh(left); break;
+			case Opcode::Tanh: tangents[i] = leftTangent / (std::cosh(left) * std::cosh(left)); break;
+			case Opcode::Arcsin: tangents[i] = leftTangent / std::sqrt(1 - left * left); break;
+			case Opcode::Arccos: tangents[i] = -leftTangent / std::sqrt(1 - left * left); break;
+			case Opcode::Ln: tangents[i] = leftTangent / left; break;
+			case Opcode::Log10: tangents[i] = leftTangent / (left * std::log(10.0)); break;
+			case Opcode::Log:
+				if (!active[instruction.left]) { tangents[i] = rightTangent / (right * std::log(left)); }
+				else { tangents[i] = (rightTangent / right - value * leftTangent / left) / std::log(left); }
+				break;
+			case Opcode::Sqrt: tangents[i] = leftTangent / (2 * value); break;
+			case Opcode::Exp: tangents[i] = leftTangent * value; break;
 		}
-
-		Expression* result = factoriseLinear<Add>(leftSim, rightSim);
-		delete leftSim;
-		delete rightSim;
-		return result;
 	}
+
+	Dual result;
+	result.value = values[instructions.size() - 1];
+	result.derivative = tangents[instructions.size() - 1];
+	return result;
 }
 
-unsigned char Add::precedence() { return 1; }
+double Program::gradient(const double* vars, double* out) const
+{
+	const size_t count = instructions.size();
+	std::vector<double> registers(count);
+	execute(vars, registers.data());
 
-Subtract* Subtract::copyTree() { return new Subtract(leftOperand->copyTree(), rightOperand->copyTree()); }
+	std::vector<bool> active(count, false);
+	for (size_t i = 0; i < count; ++i)
+	{
+		const Instruction& instruction = instructions[i];
+		if (instruction.opcode == Opcode::Load) { active[i] = true; }
+		else if (instruction.opcode != Opcode::Constant) { active[i] = active[instruction.left] || (isBinary(instruction.opcode) && active[instruction.right]); }
+	}
 
-double Subtract::evaluate() const { return leftOperand->evaluate() - rightOperand->evaluate(); }
+	std::fill_n(out, variableNames.size(), 0.0);
+	std::vector<double> adjoints(count, 0.0);
+	adjoints[count - 1] = 1;
+	for (size_t i = count; i-- > 0;)
+	{
+		const Instruction& instruction = instructions[i];
+		double adjoint = adjoints[i];
+		if (!active[i] || adjoint == 0) { continue; }
+
+		double value = registers[i];
+		double left = registers[instruction.left];
+		double right = isBinary(instruction.opcode) ? registers[instruction.right] : 0;
+		double leftAdjoint = 0;
+		double rightAdjoint = 0;
+		switch (instruction.opcode)
+		{
+			case Opcode::Load: out[instruction.left] += adjoint; continue;
+			case Opcode::Constant: continue;
+			case Opcode::Add: leftAdjoint = adjoint; rightAdjoint = adjoint; break;
+			case Opcode::Subtract: leftAdjoint = adjoint; rightAdjoint = -adjoint; break;
+			case Opcode::Multiply: leftAdjoint = adjoint * right; rightAdjoint = adjoint * left; break;
+			case Opcode::Divide: leftAdjoint = adjoint / right; rightAdjoint = -adjoint * value / right; break;
+			case Opcode::Exponent:
+				if (active[instruction.left]) { leftAdjoint = adjoint * right * std::pow(left, right - 1); }
+				if (active[instruction.right]) { rightAdjoint = adjoint * value * std::log(left); }
+				break;
+			case Opcode::Sin: leftAdjoint = adjoint * std::cos(left); break;
+			case Opcode::Cos: leftAdjoint = -adjoint * std::sin(left); break;
+			case Opcode::Tan: leftAdjoint = adjoint / (std::cos(left) * std::cos(left)); break;
+			case Opcode::Sinh: leftAdjoint = adjoint * std::cosh(left); break;
+			case Opcode::Cosh: leftAdjoint = adjoint * std::sinh(left); break;
+			case Opcode::Tanh: leftAdjoint = adjoint / (std::cosh(left) * std::cosh(left)); break;
+			case Opcode::Arcsin: leftAdjoint = adjoint / std::sqrt(1 - left * left); break;
+			case Opcode::Arccos: leftAdjoint = -adjoint / std::sqrt(1 - left * left); break;
+			case Opcode::Ln: leftAdjoint = adjoint / left; break;
+			case Opcode::Log10: leftAdjoint = adjoint / (left * std::log(10.0)); break;
+			case Opcode::Log:
+				if (active[instruction.left]) { leftAdjoint = -adjoint * value / (left * std::log(left)); }
+				if (active[instruction.right]) { rightAdjoint = adjoint / (right * std::log(left)); }
+				break;
+			case Opcode::Sqrt: leftAdjoint = adjoint / (2 * value); break;
+			case Opcode::Exp: leftAdjoint = adjoint * value; break;
+		}
 
-Subtract* Subtract::differentiate(char diffOperator) { return new Subtract(leftOperand->differentiate(diffOperator), rightOperand->differentiate(diffOperator)); }
+		if (active[instruction.left]) { adjoints[instruction.left] += leftAdjoint; }
+		if (isBinary(instruction.opcode) && active[instruction.right]) { adjoints[instruction.right] += rightAdjoint; }
+	}
 
-std::string Subtract::toString(bool showParentheses)
-{
-	std::string left, right;
-	toStringOperands(left, right);
-	std::string out = left + " - " + right;
-	if (showParentheses) { out = "(" + out + ")"; }
-	return out;
+	return registers[count - 1];
 }
 
-Expression* Subtract::simplify()
+double Program::gradient(const Bindings& bindings, double* out) const
 {
-	if (isConstant()) { return new Number(evaluate()); }
-	else
-	{
-		Expression* leftSim = leftOperand->simplify();
-		Expression* rightSim = rightOperand->simplify();
+	std::vector<double> vars(variableNames.size());
+	gather(bindings, vars.data());
+
+	std::vector<double> partials(variableNames.size());
+	double value = gradient(vars.data(), partials.data());
+	std::fill_n(out, bindings.variables().size(), 0.0);
+	for (size_t i = 0; i < variableNames.size(); ++i) { out[bindings.slot(variableNames[i])] = partials[i]; }
+	return value;
+}
 
-		if (leftSim->isConstant() && leftSim->evaluate() == 0)
-		{
-			delete leftSim;
-			return new Multiply(-1, rightSim);
-		}
-		else if (rightSim->isConstant() && rightSim->evaluate() == 0)
-		{
-			delete rightSim;
-			return leftSim;
-		}
+typedef void (*BinaryKernel)(const double* left, const double* right, double* out, size_t n);
 
-		if (*leftSim == *rightSim)
-		{
-			delete leftSim;
-			delete rightSim;
-			return new Number(0);
-		}
+struct BatchKernels
+{
+	BinaryKernel add;
+	BinaryKernel subtract;
+	BinaryKernel multiply;
+	BinaryKernel divide;
+};
+
+static void addScalar(const double* left, const double* right, double* out, size_t n) { for (size_t i = 0; i < n; ++i) { out[i] = left[i] + right[i]; } }
+static void subtractScalar(const double* left, const double* right, double* out, size_t n) { for (size_t i = 0; i < n; ++i) { out[i] = left[i] - right[i]; } }
+static void multiplyScalar(const double* left, const double* right, double* out, size_t n) { for (size_t i = 0; i < n; ++i) { out[i] = left[i] * right[i]; } }
+static void divideScalar(const double* left, const double* right, double* out, size_t n) { for (size_t i = 0; i < n; ++i) { out[i] = left[i] / right[i]; } }
+
+#ifdef QMATH_X86_DISPATCH
+#define QMATH_AVX2_KERNEL(name, intrinsic, op) \
+	__attribute__((target("avx2"))) static void name(const double* left, const double* right, double* out, size_t n) \
+	{ \
+		size_t i = 0; \
+		for (; i + 4 <= n; i += 4) { _mm256_storeu_pd(out + i, intrinsic(_mm256_loadu_pd(left + i), _mm256_loadu_pd(right + i))); } \
+		for (; i < n; ++i) { out[i] = left[i] op right[i]; } \
+	}
 
-		Expression* result = factoriseLinear<Subtract>(leftSim, rightSim);
-		delete leftSim;
-		delete rightSim;
-		return result;
+#define QMATH_AVX512_KERNEL(name, intrinsic, op) \
+	__attribute__((target("avx512f"))) static void name(const double* left, const double* right, double* out, size_t n) \
+	{ \
+		size_t i = 0; \
+		for (; i + 8 <= n; i += 8) { _mm512_storeu_pd(out + i, intrinsic(_mm512_loadu_pd(left + i), _mm512_loadu_pd(right + i))); } \
+		for (; i < n; ++i) { out[i] = left[i] op right[i]; } \
 	}
+
+QMATH_AVX2_KERNEL(addAVX2, _mm256_add_pd, +)
+QMATH_AVX2_KERNEL(subtractAVX2, _mm256_sub_pd, -)
+QMATH_AVX2_KERNEL(multiplyAVX2, _mm256_mul_pd, *)
+QMATH_AVX2_KERNEL(divideAVX2, _mm256_div_pd, /)
+QMATH_AVX512_KERNEL(addAVX512, _mm512_add_pd, +)
+QMATH_AVX512_KERNEL(subtractAVX512, _mm512_sub_pd, -)
+QMATH_AVX512_KERNEL(multiplyAVX512, _mm512_mul_pd, *)
+QMATH_AVX512_KERNEL(divideAVX512, _mm512_div_pd, /)
+#endif
+
+static BatchKernels selectBatchKernels()
+{
+	BatchKernels kernels = { addScalar, subtractScalar, multiplyScalar, divideScalar };
+#ifdef QMATH_X86_DISPATCH
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f")) { kernels = { addAVX512, subtractAVX512, multiplyAVX512, divideAVX512 }; }
+	else if (__builtin_cpu_supports("avx2")) { kernels = { addAVX2, subtractAVX2, multiplyAVX2, divideAVX2 }; }
+#endif
+	return kernels;
 }
 
-unsigned char Subtract::precedence() { return 1; }
+static const BatchKernels& batchKernels()
+{
+	static const BatchKernels kernels = selectBatchKernels();
+	return kernels;
+}
+
+template<double (*F)(double)>
+static void applyUnary(const double* operand, double* out, size_t n) { for (size_t i = 0; i < n; ++i) { out[i] = F(operand[i]); } }
 
-bool Subtract::isCommutative() { return false; }
+typedef void (*UnaryKernel)(const double* operand, double* out, size_t n);
 
+// Fast precision kernels over a block. The approximations inline into these loops, which the compiler vectorises
+// once trapping math is off and the selects in them can be if-converted. Contraction stays off, so every lane
+// rounds exactly as a single point does
+struct FastKernels
+{
+	UnaryKernel sin;
+	UnaryKernel cos;
+	UnaryKernel tan;
+	UnaryKernel sinh;
+	UnaryKernel cosh;
+	UnaryKernel tanh;
+	UnaryKernel ln;
+	UnaryKernel log10;
+	UnaryKernel halfAngle;
+	UnaryKernel arcsin;
+	UnaryKernel arccos;
+	UnaryKernel exp;
+	BinaryKernel pow;
+	BinaryKernel log;
+};
+
+#if defined(__GNUC__) && !defined(__clang__)
+#define QMATH_VECTORISE __attribute__((optimize("O3", "no-trapping-math", "fp-contract=off")))
+#else
+#define QMATH_VECTORISE
+#endif
 
-Multiply* Multiply::copyTree() { return new Multiply(leftOperand->copyTree(), rightOperand->copyTree()); }
+// Arcsine and arccosine read the root of the half angle already in out
+#define QMATH_FAST_KERNELS(suffix, attributes) \
+	template<double (*F)(double)> \
+	attributes static void unary##suffix(const double* operand, double* out, size_t n) { for (size_t i = 0; i < n; ++i) { out[i] = F(operand[i]); } } \
+	template<double (*F)(double, double)> \
+	attributes static void withRoot##suffix(const double* operand, double* out, size_t n) { for (size_t i = 0; i < n; ++i) { out[i] = F(operand[i], out[i]); } } \
+	template<double (*F)(double, double)> \
+	attributes static void binary##suffix(const double* left, const double* right, double* out, size_t n) { for (size_t i = 0; i < n; ++i) { out[i] = F(left[i], right[i]); } } \
+	static FastKernels fastKernels##suffix() \
+	{ \
+		FastKernels kernels = { unary##suffix<sinKernel>, unary##suffix<cosKernel>, unary##suffix<tanKernel>, unary##suffix<fastSinh>, unary##suffix<fastCosh>, unary##suffix<fastTanh>, \
+			unary##suffix<fastLn>, unary##suffix<fastLog10>, unary##suffix<halfAngle>, withRoot##suffix<arcsinKernel>, withRoot##suffix<arccosKernel>, unary##suffix<fastExp>, \
+			binary##suffix<fastPow>, binary##suffix<fastLogBase> }; \
+		return kernels; \
+	}
 
-double Multiply::evaluate() const { return leftOperand->evaluate() * rightOperand->evaluate(); }
+QMATH_FAST_KERNELS(Scalar, QMATH_VECTORISE)
+#ifdef QMATH_X86_DISPATCH
+QMATH_FAST_KERNELS(AVX2, __attribute__((target("avx2"))) QMATH_VECTORISE)
+QMATH_FAST_KERNELS(AVX512, __attribute__((target("avx512f"))) QMATH_VECTORISE)
+#endif
 
-Add* Multiply::differentiate(char diffOperator)
+static FastKernels selectFastKernels()
 {
-	Multiply *left = new Multiply(leftOperand->copyTree(), rightOperand->differentiate(diffOperator));
-	Multiply *right = new Multiply(leftOperand->differentiate(diffOperator), rightOperand->copyTree());
-	return new Add(left, right);
+#ifdef QMATH_X86_DISPATCH
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f")) { return fastKernelsAVX512(); }
+	if (__builtin_cpu_supports("avx2")) { return fastKernelsAVX2(); }
+#endif
+	return fastKernelsScalar();
 }
 
-bool Multiply::isAtomic()
+static const FastKernels& fastKernels()
 {
-    if (leftOperand->isAtomic() && rightOperand->isAtomic())
-    {
-        if (leftOperand->isConstant()) { return false; }
-        else { return true; }
-    }
-    else { return false; }
+	static const FastKernels kernels = selectFastKernels();
+	return kernels;
 }
 
-std::string Multiply::toString(bool showParentheses)
+// The kernels reduce trigonometric arguments only below fastReductionLimit; larger ones are redone by libm
+template<double (*F)(double)>
+static void reduceLarge(const double* operand, double* out, size_t n)
 {
-	std::string left, right;
-	toStringOperands(left, right);
-	if (leftOperand->isAtomic() && rightOperand->isAtomic())
+	for (size_t i = 0; i < n; ++i)
 	{
-		if (!leftOperand->isConstant() && rightOperand->isConstant())
-		{
-			Expression* tmp = leftOperand;
-			leftOperand = rightOperand;
-			rightOperand = tmp;
-			return right + left;
-		}
-		else if (leftOperand->isConstant() && rightOperand->isConstant()) { return left + " * " + right; }
-		else { return left + right; }
+		if (!(std::fabs(operand[i]) < fastReductionLimit)) { out[i] = F(operand[i]); }
 	}
-	if (showParentheses) { return "(" + left + " * " + right + ")"; }
-	else { return left + " * " + right; }
 }
 
-Expression* Multiply::simplify()
+static bool applyFast(Program::Opcode opcode, const double* left, const double* right, double* out, size_t n)
 {
-	if (isConstant()) { return new Number(evaluate()); }
-	else
+	const FastKernels& kernels = fastKernels();
+	switch (opcode)
 	{
-		Expression* leftSim = leftOperand->simplify();
-		Expression* rightSim = rightOperand->simplify();
-		if (leftSim->isConstant())
-		{
-			if (leftSim->evaluate() == 0)
-            {
-                delete leftSim;
-                delete rightSim;
-                return new Number(0);
-            }
-			else if (leftSim->evaluate() == 1)
-            {
-                delete leftSim;
-                return rightSim;
-            }
-		}
-        if (rightSim->isConstant())
-        {
-            if (rightSim->evaluate() == 0)
-            {
-                delete leftSim;
-                delete rightSim;
-                return new Number(0);
-            }
-            else if (rightSim->evaluate() == 1)
-            {
-                delete rightSim;
-                return leftSim;
-            }
-        }
-		
-		if (*leftSim == *rightSim)
-		{
-			delete rightSim;
-			Exponent* result = new Exponent(leftSim, 2);
-			Expression* resultSim = result->simplify();
-			delete result;
-			return resultSim;
-		}
-
-		Expression* result = accumulateExponentIndicies<Multiply, Add>(leftSim, rightSim);
-		delete leftSim;
-		delete rightSim;
-		return result;
+		case Program::Opcode::Exponent: kernels.pow(left, right, out, n); break;
+		case Program::Opcode::Sin: kernels.sin(left, out, n); reduceLarge<std::sin>(left, out, n); break;
+		case Program::Opcode::Cos: kernels.cos(left, out, n); reduceLarge<std::cos>(left, out, n); break;
+		case Program::Opcode::Tan: kernels.tan(left, out, n); reduceLarge<std::tan>(left, out, n); break;
+		case Program::Opcode::Sinh: kernels.sinh(left, out, n); break;
+		case Program::Opcode::Cosh: kernels.cosh(left, out, n); break;
+		case Program::Opcode::Tanh: kernels.tanh(left, out, n); break;
+		case Program::Opcode::Arcsin:
+		case Program::Opcode::Arccos:
+			kernels.halfAngle(left, out, n);
+			applyUnary<std::sqrt>(out, out, n);
+			(opcode == Program::Opcode::Arcsin ? kernels.arcsin : kernels.arccos)(left, out, n);
+			break;
+		case Program::Opcode::Ln: kernels.ln(left, out, n); break;
+		case Program::Opcode::Log10: kernels.log10(left, out, n); break;
+		case Program::Opcode::Log: kernels.log(left, right, out, n); break;
+		case Program::Opcode::Exp: kernels.exp(left, out, n); break;
+		default: return false;
 	}
+	return true;
 }
 
-unsigned char Multiply::precedence() { return 2; }
-
-
-Divide* Divide::copyTree() { return new Divide(leftOperand->copyTree(), rightOperand->copyTree()); }
-
-double Divide::evaluate() const { return leftOperand->evaluate() / rightOperand->evaluate(); }
+static double naturalLog(double x) { return std::log(x); }
 
-Divide* Divide::differentiate(char diffOperator)
+void Program::evaluateBatch(const double* const* vars, double* out, size_t n) const
 {
-	Multiply *left = new Multiply(leftOperand->differentiate(diffOperator), rightOperand->copyTree());
-	Multiply *right = new Multiply(leftOperand->copyTree(), rightOperand->differentiate(diffOperator));
-	Subtract *numerator = new Subtract(left, right);
-	Exponent *denominator = new Exponent(rightOperand->copyTree(), new Number(2));
-	return new Divide(numerator, denominator);
-}
+	const BatchKernels& kernels = batchKernels();
+	const bool fast = mathPrecision == Precision::Fast;
+	const size_t count = instructions.size();
 
-std::string Divide::toString(bool showParentheses)
-{
-	std::string left, right;
-	toStringOperands(left, right);
-	if (showParentheses) { return "(" + left + " / " + right + ")"; }
-	else { return left + " / " + right; }
-}
+	std::vector<size_t> lastUse(count, 0);
+	for (size_t i = 0; i < count; ++i)
+	{
+		const Instruction& instruction = instructions[i];
+		if (instruction.opcode == Opcode::Load || instruction.opcode == Opcode::Constant) { continue; }
+		lastUse[instruction.left] = i;
+		if (isBinary(instruction.opcode)) { lastUse[instruction.right] = i; }
+	}
 
-Expression* Divide::simplify()
-{
-	if (isConstant()) { return new Number(evaluate()); }
-	else
+	std::vector<double> constantBlocks(constants.size() * QMATH_BATCH_BLOCK);
+	for (size_t i = 0; i < constants.size(); ++i) { std::fill_n(constantBlocks.begin() + i * QMATH_BATCH_BLOCK, QMATH_BATCH_BLOCK, constants[i]); }
+
+	std::vector<int> block(count, -1);
+	std::vector<int> freeBlocks;
+	int blockCount = 0;
+	for (size_t i = 0; i + 1 < count; ++i)
 	{
-		Expression* leftSim = leftOperand->simplify();
-		Expression* rightSim = rightOperand->simplify();
+		const Instruction& instruction = instructions[i];
+		if (instruction.opcode == Opcode::Load || instruction.opcode == Opcode::Constant) { continue; }
 
-		if (leftSim->isConstant() && rightSim->evaluate() == 0)
-		{
-			delete leftSim;
-			delete rightSim;
-			return new Number(0);
-		}
-		if (rightSim->isConstant() && rightSim->evaluate() == 1)
+		if (freeBlocks.empty()) { block[i] = blockCount++; }
+		else
 		{
-			delete rightSim;
-			return leftSim;
+			block[i] = freeBlocks.back();
+			freeBlocks.pop_back();
 		}
-		else if (*leftSim == *rightSim)
+
+		if (lastUse[instruction.left] == i && block[instruction.left] >= 0) { freeBlocks.push_back(block[instruction.left]); }
+		if (isBinary(instruction.opcode) && instruction.right != instruction.left && lastUse[instruction.right] == i && block[instruction.right] >= 0) { freeBlocks.push_back(block[instruction.right]); }
+	}
+	std::vector<double> scratch(blockCount * QMATH_BATCH_BLOCK);
+	std::vector<const double*> sources(count);
+
+	for (size_t base = 0; base < n; base += QMATH_BATCH_BLOCK)
+	{
+		size_t m = std::min((size_t)QMATH_BATCH_BLOCK, n - base);
+		for (size_t i = 0; i < count; ++i)
 		{
-			delete leftSim;
-			delete rightSim;
-			return new Number(1);
+			const Instruction& instruction = instructions[i];
+			if (instruction.opcode == Opcode::Load || instruction.opcode == Opcode::Constant)
+			{
+				if (instruction.opcode == Opcode::Load) { sources[i] = vars[instruction.left] + base; }
+				else { sources[i] = constantBlocks.data() + instruction.left * QMATH_BATCH_BLOCK; }
+				if (i + 1 == count) { std::copy(sources[i], sources[i] + m, out + base); }
+				continue;
+			}
+
+			double* target = i + 1 == count ? out + base : scratch.data() + block[i] * QMATH_BATCH_BLOCK;
+			const double* left = sources[instruction.left];
+			const double* right = isBinary(instruction.opcode) ? sources[instruction.right] : nullptr;
+			if (fast && applyFast(instruction.opcode, left, right, target, m))
+			{
+				sources[i] = target;
+				continue;
+			}
+			switch (instruction.opcode)
+			{
+				case Opcode::Load:
+				case Opcode::Constant:
+					break;
+				case Opcode::Add: kernels.add(left, right, target, m); break;
+				case Opcode::Subtract: kernels.subtract(left, right, target, m); break;
+				case Opcode::Multiply: kernels.multiply(left, right, target, m); break;
+				case Opcode::Divide: kernels.divide(left, right, target, m); break;
+				case Opcode::Exponent: for (size_t j = 0; j < m; ++j) { target[j] = std::pow(left[j], right[j]); } break;
+				case Opcode::Sin: applyUnary<std::sin>(left, target, m); break;
+				case Opcode::Cos: applyUnary<std::cos>(left, target, m); break;
+				case Opcode::Tan: applyUnary<std::tan>(left, target, m); break;
+				case Opcode::Sinh: applyUnary<std::sinh>(left, target, m); break;
+				case Opcode::Cosh: applyUnary<std::cosh>(left, target, m); break;
+				case Opcode::Tanh: applyUnary<std::tanh>(left, target, m); break;
+				case Opcode::Arcsin: applyUnary<std::asin>(left, target, m); break;
+				case Opcode::Arccos: applyUnary<std::acos>(left, target, m); break;
+				case Opcode::Ln: applyUnary<naturalLog>(left, target, m); break;
+				case Opcode::Log10: applyUnary<std::log10>(left, target, m); break;
+				case Opcode::Sqrt: applyUnary<std::sqrt>(left, target, m); break;
+				case Opcode::Exp: applyUnary<std::exp>(left, target, m); break;
+				case Opcode::Log: for (size_t j = 0; j < m; ++j) { target[j] = std::log(right[j]) / std::log(left[j]); } break;
+			}
+			sources[i] = target;
 		}
-		
-		Expression* result = accumulateExponentIndicies<Divide, Subtract>(leftSim, rightSim);
-		delete leftSim;
-		delete rightSim;
-		return result;
 	}
 }
 
-unsigned char Divide::precedence() { return 2; }
-
-bool Divide::isCommutative() { return false; }
+double Program::evaluate(const Bindings& bindings) const
+{
+	if (bindings.variables() == variableNames) { return evaluate(bindings.data()); }
 
+	std::vector<double> vars(variableNames.size());
+	gather(bindings, vars.data());
+	return evaluate(vars.data());
+}
 
-Exponent* Exponent::copyTree() { return new Exponent(leftOperand->copyTree(), rightOperand->copyTree()); }
-
-double Exponent::evaluate() const { return std::pow(leftOperand->evaluate(), rightOperand->evaluate()); }
-
-Multiply* Exponent::differentiate(char diffOperator)
+void Program::gather(const Bindings& bindings, double* vars) const
 {
-	bool constIndex = true;
-	if (!rightOperand->isConstant())
-	{
-		Expression* tmp = rightOperand->differentiate(diffOperator);
-		constIndex = tmp->isConstant() && tmp->evaluate() == 0;
-		delete tmp;
-	}
-	if (constIndex)
+	for (size_t i = 0; i < variableNames.size(); ++i)
 	{
-		Subtract *index = new Subtract(rightOperand->copyTree(), new Number(1));
-		Exponent *power = new Exponent(leftOperand->copyTree(), index);
-		Multiply *multiplicand = new Multiply(rightOperand->copyTree(), leftOperand->differentiate(diffOperator));
-		return new Multiply(multiplicand, power);
+		int slot = bindings.slot(variableNames[i]);
+		if (slot < 0) { throw "Unbound variable"; }
+		vars[i] = bindings.value(slot);
 	}
-	else
-    {
-        bool constBase = true;
-        if (!leftOperand->isConstant())
-        {
-            Expression* tmp = leftOperand->differentiate(diffOperator);
-            constBase = tmp->isConstant() && tmp->evaluate() == 0;
-            delete tmp;
-        }
-        
-        if (constBase)
-        {
-            Expression* index = rightOperand->copyTree();
-            Expression* power = new Exponent(leftOperand->copyTree(), index);
-            Multiply *multiplicand = new Multiply(new Log(new Constant('e'), leftOperand->copyTree()), rightOperand->differentiate(diffOperator));
-            return new Multiply(multiplicand, power);
-        }
-        else
-        {
-            Multiply* leftTop = new Multiply(rightOperand->copyTree(), leftOperand->differentiate(diffOperator));
-            Divide* left = new Divide(leftTop, leftOperand->copyTree());
-            Multiply* right = new Multiply(rightOperand->differentiate(diffOperator), new Log(new Constant('e'), leftOperand->copyTree()));
-            Add* inner = new Add(left, right);
-            return new Multiply(copyTree(), inner);
-        }
-    }
 }
 
-std::string Exponent::toString(bool showParentheses)
-{
-	std::string left, right;
-	toStringOperands(left, right);
-	if (showParentheses) { return "(" + left + "^" + right + ")"; }
-	else { return left + "^" + right; }
-}
+const std::string& Program::variables() const { return variableNames; }
 
-Expression* Exponent::simplify()
+int Program::variableSlot(char var) const
 {
-	if (isConstant()) { return new Number(evaluate()); }
-	else
-	{
-		if (leftOperand->isConstant())
-		{
-			if (leftOperand->evaluate() == 0) { return new Number(0); }
-			else if (leftOperand->evaluate() == 1) { return new Number(1); }
-		}
-		if (rightOperand->isConstant())
-		{
-			if (rightOperand->evaluate() == 0) { return new Number(1); }
-			else if (rightOperand->evaluate() == 1) { return leftOperand->simplify(); }
-		}
-
-		Expression* leftSim = leftOperand->simplify();
-		Expression* rightSim = rightOperand->simplify();
+	size_t slot = variableNames.find(var);
+	if (slot == std::string::npos) { return -1; }
+	else { return (int)slot; }
+}
 
-		if (typeid(*leftSim) == typeid(Exponent))
-		{
-			Exponent* leftExp = (Exponent*)leftSim;
-			Multiply* newIndex = new Multiply(leftExp->getRightOperand()->copyTree(), rightSim);
-			Expression* newIndexSim = newIndex->simplify();
-			Exponent* result = new Exponent(leftExp->getLeftOperand()->copyTree(), newIndexSim);
-			Expression* resultSim = result->simplify();
+size_t Program::size() const { return instructions.size(); }
 
-			delete leftExp;
-			delete newIndex;
-			delete result;
-			return resultSim;
-		}
+size_t Program::nodeCount() const { return nodes; }
 
-		if (typeid(*rightSim) == typeid(Log))
-		{
-			Log* rightLog = (Log*)rightSim;
-			if (*leftSim == *(rightLog->getLeftOperand()))
-			{
-				Expression* result = rightLog->getRightOperand()->copyTree();
-				Expression* resultSim = result->simplify();
+// A polynomial can expand into more instructions than the nodes of the subtree it replaced were counted as
+size_t Program::eliminatedCount() const { return nodes > instructions.size() ? nodes - instructions.size() : 0; }
 
-				delete leftSim;
-				delete rightSim;
-				delete result;
-				return resultSim;
-			}
-		}
+const Program::Instruction& Program::operator[] (size_t index) const { return instructions[index]; }
 
-		return new Exponent(leftSim, rightSim);
-	}
-}
+double Program::constant(unsigned int index) const { return constants[index]; }
 
-unsigned char Exponent::precedence() { return 3; }
+Precision Program::precision() const { return mathPrecision; }
 
-bool Exponent::isCommutative() { return false; }
+void Program::setPrecision(Precision precision) { mathPrecision = precision; }
 
+bool Program::isBinary(Opcode opcode) { return (opcode >= Opcode::Add && opcode <= Opcode::Exponent) || opcode == Opcode::Log; }
 
-Log::Log(Expression *left, Expression *right) : Operator::Operator(left, right)
+unsigned int Program::emit(Opcode opcode, unsigned int left, unsigned int right)
 {
-    if (left->isConstant() && left->isAtomic() && left->evaluate() == 10) { is10 = true; }
-    else
-    {
-        Expression *tmp = left->differentiate();
-        if (tmp->isConstant() && left->isAtomic() && tmp->evaluate() == 0 && left->evaluate() == M_E) { isNatural = true; }
-        delete tmp;
-    }
+	if ((opcode == Opcode::Add || opcode == Opcode::Multiply) && right < left) { std::swap(left, right); }
+
+	Instruction instruction;
+	instruction.opcode = opcode;
+	instruction.left = left;
+	instruction.right = right;
+	std::unordered_map<Instruction, unsigned int, InstructionHash, InstructionEqual>::iterator found = valueNumbers.find(instruction);
+	if (found != valueNumbers.end()) { return found->second; }
+	valueNumbers.emplace(instruction, (unsigned int)instructions.size());
+
+	instructions.push_back(instruction);
+	return (unsigned int)instructions.size() - 1;
 }
 
-std::string Log::toString(bool showParentheses)
+bool Program::InstructionEqual::operator()(const Instruction& a, const Instruction& b) const
 {
-    std::string base;
-    if (isNatural) { base = "ln"; }
-    else
-    {
-        base = "log";
-        if (!is10) { base += "[" + leftOperand->toString() + "]"; }
-    }
-    
-    return base + "(" + rightOperand->toString() + ")";
+	return a.opcode == b.opcode && a.left == b.left && a.right == b.right;
 }
 
-Log* Log::copyTree() { return new Log(leftOperand->copyTree(), rightOperand->copyTree()); }
+size_t Program::InstructionHash::operator()(const Instruction& instruction) const
+{
+	size_t hash = (size_t)instruction.opcode;
+	hash = hash * 31 + std::hash<unsigned int>()(instruction.left);
+	hash = hash * 31 + std::hash<unsigned int>()(instruction.right);
+	return hash;
+}
 
-double Log::evaluate() const
+unsigned int Program::emitConstant(double value)
 {
-    if (isNatural) { return std::log(rightOperand->evaluate()); }
-    else if (is10) { return std::log10(rightOperand->evaluate()); }
-    else { return std::log(rightOperand->evaluate()) / std::log(leftOperand->evaluate()); }
+	unsigned int index = 0;
+	while (index < constants.size() && std::memcmp(&constants[index], &value, sizeof(double)) != 0) { ++index; }
+	if (index == constants.size()) { constants.push_back(value); }
+	return emit(Opcode::Constant, index);
 }
 
-Expression* Log::differentiate(char diffOperator)
+unsigned int Program::emitVariable(char var)
 {
-    if (isNatural) { return new Divide(rightOperand->differentiate(), rightOperand->copyTree()); }
-    else
-    {
-        Expression* tmp = leftOperand->differentiate();
-        if (tmp->isConstant() && tmp->evaluate() == 0)
-        {
-            delete tmp;
-            Expression* numerator = rightOperand->differentiate(diffOperator);
-            Multiply* denominator = new Multiply(rightOperand->copyTree(), new Log(new Constant('e'), leftOperand->copyTree()));
-            return new Divide(numerator, denominator);
-        }
-        delete tmp;
-        
-        Multiply* right = new Multiply(copyTree(), new Divide(leftOperand->differentiate(diffOperator), leftOperand->copyTree()));
-        Divide* left = new Divide(rightOperand->differentiate(diffOperator), rightOperand->copyTree());
-        Subtract* inner = new Subtract(left, right);
-        Divide* outer = new Divide(copyTree(), new Log(new Constant('e'), leftOperand->copyTree()));
-        return new Multiply(outer, inner);
-    }
+	if (variableNames.find(var) == std::string::npos) { variableNames += var; }
+	return emit(Opcode::Load, (unsigned char)var);
 }
 
-Expression* Log::simplify()
+// A subtree's polynomial form found with no variable chosen yet, where var is the subtree's own variable or 0
+struct PolynomialMemo
 {
-    if (isConstant()) { return new Number(evaluate()); }
-    else
-    {
-        bool operandsEqual = true;
-        Expression *tmp;
-        
-        tmp = leftOperand->differentiate();
-        operandsEqual &= tmp->isConstant() && tmp->evaluate() == 0;
-        delete tmp;
-        
-        tmp = rightOperand->differentiate();
-        operandsEqual &= tmp->isConstant() && tmp->evaluate() == 0;
-        delete tmp;
-        
-        if (operandsEqual) { operandsEqual = leftOperand->evaluate() == rightOperand->evaluate(); }
-        if (operandsEqual) { return new Number(1); }
-        else
-		{
-			Expression* leftSim = leftOperand->simplify();
-			Expression* rightSim = rightOperand->simplify();
+	bool found;
+	char var;
+	std::vector<double> numerator;
+	std::vector<double> denominator;
+};
 
-			if (typeid(*rightSim) == typeid(Exponent))
-			{
-				Exponent* rightExp = (Exponent*)rightSim;
-				if (*leftSim == *(rightExp->getLeftOperand()))
-				{
-					Expression* result = rightExp->getRightOperand()->copyTree();
-					Expression* resultSim = result->simplify();
+// Set while a program is being emitted. Each Add, Subtract, Multiply and Divide node is tried as a polynomial and
+// every attempt walks the subtree below it, so without the memo a deep tree would be walked once per level
+static thread_local std::unordered_map<const Expression*, PolynomialMemo>* activePolynomials = nullptr;
 
-					delete leftSim;
-					delete rightSim;
-					delete result;
-					return resultSim;
-				}
-			}
+unsigned int Program::emitExpression(const Expression* expression)
+{
+	++nodes;
+	std::unordered_map<const Expression*, unsigned int>::iterator found = emitted.find(expression);
+	if (found != emitted.end()) { return found->second; }
 
-			return new Log(leftSim, rightSim);
-		}
-    }
+	// The outermost call owns the polynomial memo for the whole tree
+	std::unordered_map<const Expression*, PolynomialMemo> polynomials;
+	struct Active
+	{
+		bool owner;
+		~Active() { if (owner) { activePolynomials = nullptr; } }
+	} active = { !activePolynomials };
+	if (active.owner) { activePolynomials = &polynomials; }
+
+	unsigned int index;
+	if (!emitPolynomial(expression, index)) { index = expression->emit(*this); }
+	emitted.emplace(expression, index);
+	return index;
 }
 
-unsigned char Log::precedence() { return 10; }
-bool Log::isCommutative() { return false; }
-
-
-bool Number::operator== (const Expression &b)
+void Program::assignSlots()
 {
-	if (this == &b) { return true; }
-	if (typeid(*this) != typeid(b)) { return false; }
-	else
+	valueNumbers.clear();
+	emitted.clear();
+	std::sort(variableNames.begin(), variableNames.end());
+	for (size_t i = 0; i < instructions.size(); ++i)
 	{
-		Number* bNumber = (Number*)&b;
-		return value == bNumber->value;
+		if (instructions[i].opcode == Opcode::Load) { instructions[i].left = (unsigned int)variableNames.find((char)instructions[i].left); }
 	}
 }
 
-double Number::evaluate() const { return value; }
-
-bool Number::isConstant() { return true; }
-
-Number::Number(double value) { this->value = value; }
-
-Number* Number::differentiate(char diffOperator) { return new Number(0); }
-
-Number* Number::copyTree() { return new Number(value); }
-
-std::string Number::toString(bool showParentheses)
+#ifdef QMATH_JIT
+static double jitSin(double x) { return std::sin(x); }
+static double jitCos(double x) { return std::cos(x); }
+static double jitTan(double x) { return std::tan(x); }
+static double jitSinh(double x) { return std::sinh(x); }
+static double jitCosh(double x) { return std::cosh(x); }
+static double jitTanh(double x) { return std::tanh(x); }
+static double jitArcsin(double x) { return std::asin(x); }
+static double jitArccos(double x) { return std::acos(x); }
+static double jitLn(double x) { return std::log(x); }
+static double jitLog10(double x) { return std::log10(x); }
+static double jitPow(double x, double y) { return std::pow(x, y); }
+static double jitExp(double x) { return std::exp(x); }
+
+// Emits System V x86-64 code for a program. Every instruction's value lives in a stack slot; operands are
+// loaded into register 0 (left) and 1 (right), which are xmm registers for single points and ymm registers
+// for four points at a time. Loads read the variable array in rbx, or in the batch loop the arrays in r13
+// offset by the point index in r12, and constants are read from a pool placed after the code
+class NativeAssembler
 {
-	std::stringstream stream;
-	stream << value;
-	return stream.str();
-}
+public:
+	NativeAssembler(const Program& program) : program(program) {}
 
-void Number::substitute(const std::map<char, double>& varMap) {}
+	bool isVectorisable() const
+	{
+		for (size_t i = 0; i < program.size(); ++i)
+		{
+			Program::Opcode opcode = program[i].opcode;
+			if (opcode == Program::Opcode::Load || opcode == Program::Opcode::Constant || opcode == Program::Opcode::Sqrt) { continue; }
+			if (opcode < Program::Opcode::Add || opcode > Program::Opcode::Divide) { return false; }
+		}
+		return true;
+	}
 
-bool Number::isAtomic() { return true; }
+	// double function(const double* vars)
+	bool emitScalarFunction()
+	{
+		size_t frame = alignFrame(program.size() * 8);
+		emit({ 0x53, 0x48, 0x89, 0xFB });
+		adjustStack(0xEC, frame);
+		if (!emitScalarBody()) { return false; }
+		adjustStack(0xC4, frame);
+		emit({ 0x5B, 0xC3 });
+		return true;
+	}
 
-unsigned char Number::precedence() { return 0; }
+	// void function(const double* const* vars, double* out, size_t n)
+	bool emitBatchFunction(bool vector)
+	{
+		size_t variables = program.variables().size();
+		size_t slotsSize = program.size() * (vector ? 32 : 8);
+		size_t frame = alignFrame(slotsSize + variables * 8 + 8);
+		emit({ 0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57 });
+		adjustStack(0xEC, frame);
+		emit({ 0x49, 0x89, 0xFD, 0x49, 0x89, 0xF6, 0x49, 0x89, 0xD7, 0x45, 0x31, 0xE4 });
+		emit({ 0x48, 0x8D, 0x9C, 0x24 });
+		dword((unsigned int)slotsSize);
+
+		if (vector)
+		{
+			size_t top = code.size();
+			emit({ 0x49, 0x8D, 0x44, 0x24, 0x04, 0x4C, 0x39, 0xF8, 0x0F, 0x87 });
+			size_t exit = code.size();
+			dword(0);
+			if (!emitVectorBody()) { return false; }
+			emit({ 0x4B, 0x8D, 0x04, 0xE6, 0xC5, 0xFD, 0x11, 0x00, 0x49, 0x83, 0xC4, 0x04, 0xE9 });
+			jumpTo(top);
+			patchJump(exit);
+			emit({ 0xC5, 0xF8, 0x77 });
+		}
 
+		size_t top = code.size();
+		emit({ 0x4D, 0x39, 0xFC, 0x0F, 0x83 });
+		size_t exit = code.size();
+		dword(0);
+		for (size_t j = 0; j < variables; ++j)
+		{
+			emit({ 0x49, 0x8B, 0x85 });
+			dword((unsigned int)(j * 8));
+			emit({ 0xF2, 0x42, 0x0F, 0x10, 0x04, 0xE0, 0xF2, 0x0F, 0x11, 0x83 });
+			dword((unsigned int)(j * 8));
+		}
+		if (!emitScalarBody()) { return false; }
+		emit({ 0xF2, 0x43, 0x0F, 0x11, 0x04, 0xE6, 0x49, 0xFF, 0xC4, 0xE9 });
+		jumpTo(top);
+		patchJump(exit);
+
+		adjustStack(0xC4, frame);
+		emit({ 0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3 });
+		return true;
+	}
 
-bool Variable::operator== (const Expression &b)
-{
-	if (this == &b) { return true; }
-	if (typeid(*this) != typeid(b)) { return false; }
-	else
+	// Appends the constant pool and resolves the references into it; returns the code's total size
+	size_t finish()
 	{
-		Variable* bVariable = (Variable*)&b;
-		return var == bVariable->var;
+		while (code.size() % 8 != 0) { code.push_back(0xCC); }
+		size_t pool = code.size();
+		std::vector<size_t> poolIndex(program.size());
+		for (size_t i = 0; i < program.size(); ++i)
+		{
+			if (program[i].opcode != Program::Opcode::Constant) { continue; }
+			poolIndex[i] = (code.size() - pool) / 8;
+			double value = program.constant(program[i].left);
+			unsigned char raw[sizeof(double)];
+			std::memcpy(raw, &value, sizeof(double));
+			code.insert(code.end(), raw, raw + sizeof(double));
+		}
+		for (const std::pair<size_t, size_t>& reference : constantReferences)
+		{
+			unsigned int displacement = (unsigned int)(pool + poolIndex[reference.second] * 8 - (reference.first + 4));
+			std::memcpy(&code[reference.first], &displacement, 4);
+		}
+		return code.size();
 	}
-}
 
-double Variable::evaluate() const { return value; }
+	const std::vector<unsigned char>& machineCode() const { return code; }
 
-bool Variable::isConstant() { return false; }
+private:
+	const Program& program;
+	std::vector<unsigned char> code;
+	std::vector<std::pair<size_t, size_t>> constantReferences;
 
-Variable::Variable(char var, double value)
-{
-	this->var = var;
-	this->value = value;
-}
+	static size_t alignFrame(size_t size) { return (size + 15) & ~(size_t)15; }
 
-Variable::Variable(char var) : Variable::Variable(var, 0) {}
+	void emit(std::initializer_list<unsigned char> values) { code.insert(code.end(), values); }
 
-Expression* Variable::differentiate(char diffOperator)
-{
-	if (diffOperator == var) { return new Number(1); }
-	else { return new Differential(copyTree(), new Variable(diffOperator)); }
-}
+	void dword(unsigned int value)
+	{
+		unsigned char raw[4];
+		std::memcpy(raw, &value, 4);
+		code.insert(code.end(), raw, raw + 4);
+	}
 
-Variable* Variable::copyTree() { return new Variable(var, value); }
+	void adjustStack(unsigned char operation, size_t frame)
+	{
+		emit({ 0x48, 0x81, operation });
+		dword((unsigned int)frame);
+	}
 
-std::string Variable::toString(bool showParentheses)
-{
-	std::stringstream stream;
-	stream << var;
-	return stream.str();
-}
+	void jumpTo(size_t target) { dword((unsigned int)(target - (code.size() + 4))); }
 
-char Variable::charID() { return var; }
+	void patchJump(size_t at)
+	{
+		unsigned int displacement = (unsigned int)(code.size() - (at + 4));
+		std::memcpy(&code[at], &displacement, 4);
+	}
 
-bool Variable::isAtomic() { return true; }
+	// ModRM and displacement addressing the slot of an instruction, relative to rsp
+	void slot(unsigned char reg, size_t index, size_t slotSize)
+	{
+		emit({ (unsigned char)(0x84 | reg << 3), 0x24 });
+		dword((unsigned int)(index * slotSize));
+	}
 
-void Variable::substitute(const std::map<char, double>& varMap)
-{
-	if (varMap.find(var) != varMap.end())
+	void constant(unsigned char reg, size_t index)
 	{
-		value = varMap.at(var);
+		code.push_back((unsigned char)(0x05 | reg << 3));
+		constantReferences.push_back(std::make_pair(code.size(), index));
+		dword(0);
 	}
-}
 
-unsigned char Variable::precedence() { return 0; }
+	template<typename F>
+	void call(F function)
+	{
+		unsigned long long address = (unsigned long long)function;
+		unsigned char raw[8];
+		std::memcpy(raw, &address, 8);
+		emit({ 0x48, 0xB8 });
+		code.insert(code.end(), raw, raw + 8);
+		emit({ 0xFF, 0xD0 });
+	}
 
+	void loadScalar(unsigned char reg, size_t index)
+	{
+		const Program::Instruction& instruction = program[index];
+		emit({ 0xF2, 0x0F, 0x10 });
+		if (instruction.opcode == Program::Opcode::Load)
+		{
+			code.push_back((unsigned char)(0x83 | reg << 3));
+			dword(instruction.left * 8);
+		}
+		else if (instruction.opcode == Program::Opcode::Constant) { constant(reg, index); }
+		else { slot(reg, index, 8); }
+	}
 
-Constant::Constant(char var, double value) : Variable::Variable(var, value)
-{
-    if (var == 'e')
-    {
-        this->value = M_E;
-    }
-}
+	void storeScalar(size_t index)
+	{
+		emit({ 0xF2, 0x0F, 0x11 });
+		slot(0, index, 8);
+	}
 
-Constant::Constant(char var) : Constant::Constant(var, 0) {}
+	bool emitScalarBody()
+	{
+		size_t count = program.size();
+		size_t inRegister = count;
+		bool fast = program.precision() == Precision::Fast;
+		for (size_t i = 0; i < count; ++i)
+		{
+			const Program::Instruction& instruction = program[i];
+			if (instruction.opcode == Program::Opcode::Load || instruction.opcode == Program::Opcode::Constant) { continue; }
 
-Number* Constant::differentiate(char diffOperator) { return new Number(0); }
+			if (instruction.opcode == Program::Opcode::Log)
+			{
+				loadScalar(0, instruction.right);
+				call(jitLn);
+				storeScalar(i);
+				loadScalar(0, instruction.left);
+				call(jitLn);
+				emit({ 0x66, 0x0F, 0x28, 0xC8 });
+				loadScalar(0, i);
+				emit({ 0xF2, 0x0F, 0x5E, 0xC1 });
+			}
+			else
+			{
+				if (instruction.left != inRegister) { loadScalar(0, instruction.left); }
+				if (Program::isBinary(instruction.opcode)) { loadScalar(1, instruction.right); }
+				switch (instruction.opcode)
+				{
+					case Program::Opcode::Add: emit({ 0xF2, 0x0F, 0x58, 0xC1 }); break;
+					case Program::Opcode::Subtract: emit({ 0xF2, 0x0F, 0x5C, 0xC1 }); break;
+					case Program::Opcode::Multiply: emit({ 0xF2, 0x0F, 0x59, 0xC1 }); break;
+					case Program::Opcode::Divide: emit({ 0xF2, 0x0F, 0x5E, 0xC1 }); break;
+					case Program::Opcode::Exponent: call(jitPow); break;
+					case Program::Opcode::Sin: call(fast ? fastSin : jitSin); break;
+					case Program::Opcode::Cos: call(fast ? fastCos : jitCos); break;
+					case Program::Opcode::Tan: call(fast ? fastTan : jitTan); break;
+					case Program::Opcode::Sinh: call(fast ? fastSinh : jitSinh); break;
+					case Program::Opcode::Cosh: call(jitCosh); break;
+					case Program::Opcode::Tanh: call(fast ? fastTanh : jitTanh); break;
+					case Program::Opcode::Arcsin: call(fast ? fastArcsin : jitArcsin); break;
+					case Program::Opcode::Arccos: call(fast ? fastArccos : jitArccos); break;
+					case Program::Opcode::Ln: call(jitLn); break;
+					case Program::Opcode::Log10: call(jitLog10); break;
+					case Program::Opcode::Sqrt: emit({ 0xF2, 0x0F, 0x51, 0xC0 }); break;
+					case Program::Opcode::Exp: call(jitExp); break;
+					default: return false;
+				}
+			}
+			storeScalar(i);
+			inRegister = i;
+		}
+		if (count - 1 != inRegister) { loadScalar(0, count - 1); }
+		return true;
+	}
 
-Constant* Constant::copyTree() { return new Constant(var, value); }
+	void loadVector(unsigned char reg, size_t index)
+	{
+		const Program::Instruction& instruction = program[index];
+		if (instruction.opcode == Program::Opcode::Load)
+		{
+			emit({ 0x49, 0x8B, 0x85 });
+			dword(instruction.left * 8);
+			emit({ 0x4A, 0x8D, 0x04, 0xE0, 0xC5, 0xFD, 0x10, (unsigned char)(reg << 3) });
+		}
+		else if (instruction.opcode == Program::Opcode::Constant)
+		{
+			emit({ 0xC4, 0xE2, 0x7D, 0x19 });
+			constant(reg, index);
+		}
+		else
+		{
+			emit({ 0xC5, 0xFD, 0x10 });
+			slot(reg, index, 32);
+		}
+	}
+
+	bool emitVectorBody()
+	{
+		size_t count = program.size();
+		size_t inRegister = count;
+		for (size_t i = 0; i < count; ++i)
+		{
+			const Program::Instruction& instruction = program[i];
+			if (instruction.opcode == Program::Opcode::Load || instruction.opcode == Program::Opcode::Constant) { continue; }
 
+			if (instruction.left != inRegister) { loadVector(0, instruction.left); }
+			if (Program::isBinary(instruction.opcode)) { loadVector(1, instruction.right); }
+			switch (instruction.opcode)
+			{
+				case Program::Opcode::Add: emit({ 0xC5, 0xFD, 0x58, 0xC1 }); break;
+				case Program::Opcode::Subtract: emit({ 0xC5, 0xFD, 0x5C, 0xC1 }); break;
+				case Program::Opcode::Multiply: emit({ 0xC5, 0xFD, 0x59, 0xC1 }); break;
+				case Program::Opcode::Divide: emit({ 0xC5, 0xFD, 0x5E, 0xC1 }); break;
+				case Program::Opcode::Sqrt: emit({ 0xC5, 0xFD, 0x51, 0xC0 }); break;
+				default: return false;
+			}
+			emit({ 0xC5, 0xFD, 0x11 });
+			slot(0, i, 32);
+			inRegister = i;
+		}
+		if (count - 1 != inRegister) { loadVector(0, count - 1); }
+		return true;
+	}
+};
+#endif
 
-bool Func::operator== (const Expression &b)
+NativeProgram::NativeProgram(const Program& program) : interpreted(program)
 {
-	if (this == &b) { return true; }
-	if (typeid(*this) != typeid(b)) { return false; }
-	else
+#ifdef QMATH_JIT
+	NativeAssembler scalarCode(program);
+	NativeAssembler batchCode(program);
+	__builtin_cpu_init();
+	bool vector = batchCode.isVectorisable() && __builtin_cpu_supports("avx");
+	// A scalar loop would call the fast kernels a point at a time, where the interpreter vectorises them
+	bool nativeBatch = vector || program.precision() == Precision::Exact;
+	if (!scalarCode.emitScalarFunction() || (nativeBatch && !batchCode.emitBatchFunction(vector))) { return; }
+
+	size_t scalarSize = scalarCode.finish();
+	size_t batchOffset = (scalarSize + 63) & ~(size_t)63;
+	size_t size = nativeBatch ? batchOffset + batchCode.finish() : scalarSize;
+	void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (memory == MAP_FAILED) { return; }
+
+	std::memcpy(memory, scalarCode.machineCode().data(), scalarSize);
+	if (nativeBatch) { std::memcpy((char*)memory + batchOffset, batchCode.machineCode().data(), batchCode.machineCode().size()); }
+	if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0)
 	{
-		Func* bFunc = (Func*)&b;
-		return *operand == *bFunc->operand;
+		munmap(memory, size);
+		return;
 	}
+
+	code = memory;
+	codeSize = size;
+	scalar = (Function)memory;
+	if (nativeBatch) { batch = (BatchFunction)((char*)memory + batchOffset); }
+#endif
 }
 
-Func::Func(Expression *operand) { this->operand = operand; }
+NativeProgram::~NativeProgram()
+{
+#ifdef QMATH_JIT
+	if (code) { munmap(code, codeSize); }
+#endif
+}
 
-Func::~Func() { delete operand; }
+double NativeProgram::evaluate(const double* vars) const
+{
+	if (scalar) { return scalar(vars); }
+	return interpreted.evaluate(vars);
+}
 
-bool Func::isConstant() { return operand->isConstant(); }
+double NativeProgram::evaluate(const Bindings& bindings) const
+{
+	if (!scalar || bindings.variables() != interpreted.variables()) { return interpreted.evaluate(bindings); }
+	return scalar(bindings.data());
+}
 
-bool Func::isAtomic() { return true; }
+void NativeProgram::evaluateBatch(const double* const* vars, double* out, size_t n) const
+{
+	if (batch) { batch(vars, out, n); }
+	else { interpreted.evaluateBatch(vars, out, n); }
+}
 
-void Func::substitute(const std::map<char, double>& varMap) { operand->substitute(varMap); }
+NativeProgram::Function NativeProgram::function() const { return scalar; }
 
-unsigned char Func::precedence() { return 4; }
+NativeProgram::BatchFunction NativeProgram::batchFunction() const { return batch; }
 
+bool NativeProgram::isNative() const { return code != nullptr; }
 
-Sin* Sin::copyTree() { return new Sin(operand->copyTree()); }
+const Program& NativeProgram::program() const { return interpreted; }
 
-double Sin::evaluate() const { return std::sin(operand->evaluate()); }
+static thread_local ExpressionArena* currentArena = nullptr;
 
-Multiply* Sin::differentiate(char diffOperator)
+ExpressionArena::Scope::Scope(ExpressionArena& arena)
 {
-	Expression* left = operand->differentiate(diffOperator);
-	Cos* right = new Cos(operand->copyTree());
-	return new Multiply(left, right);
+	previous = currentArena;
+	currentArena = &arena;
 }
 
-Sin* Sin::simplify() { return new Sin(operand->simplify()); }
+ExpressionArena::Scope::~Scope() { currentArena = previous; }
 
-std::string Sin::toString(bool showParentheses) { return "sin(" + operand->toString() + ")"; }
+ExpressionArena::Suspension::Suspension()
+{
+	previous = currentArena;
+	currentArena = nullptr;
+}
 
+ExpressionArena::Suspension::~Suspension() { currentArena = previous; }
 
-Cos* Cos::copyTree() { return new Cos(operand->copyTree()); }
+ExpressionArena::ExpressionArena(size_t blockSize)
+{
+	this->blockSize = std::max<size_t>(blockSize, 16 * sizeClassCount + headerSize);
+	blockIndex = 0;
+	cursor = end = nullptr;
+	std::fill_n(freeLists, sizeClassCount, nullptr);
+	nodes = 0;
+}
 
-double Cos::evaluate() const { return std::cos(operand->evaluate()); }
+ExpressionArena::~ExpressionArena()
+{
+	for (char* block : blocks) { ::operator delete(block); }
+	for (char* block : largeBlocks) { ::operator delete(block); }
+}
 
-Multiply* Cos::differentiate(char diffOperator)
+void ExpressionArena::reset()
 {
-	Subtract* left = new Subtract(new Number(0), operand->differentiate(diffOperator));
-	Sin* right = new Sin(operand->copyTree());
-	return new Multiply(left, right);
+	for (char* block : largeBlocks) { ::operator delete(block); }
+	largeBlocks.clear();
+	blockIndex = 0;
+	cursor = blocks.empty() ? nullptr : blocks[0];
+	end = blocks.empty() ? nullptr : blocks[0] + blockSize;
+	std::fill_n(freeLists, sizeClassCount, nullptr);
+	nodes = 0;
 }
 
-Cos* Cos::simplify() { return new Cos(operand->simplify()); }
+size_t ExpressionArena::nodeCount() const { return nodes; }
 
-std::string Cos::toString(bool showParentheses) { return "cos(" + operand->toString() + ")"; }
+size_t ExpressionArena::blockCount() const { return blocks.size(); }
 
+void* ExpressionArena::allocate(size_t size)
+{
+	if (currentArena != nullptr)
+	{
+		if (size + headerSize <= 16 * sizeClassCount) { return currentArena->allocateNode(size); }
+		else { return currentArena->allocateLarge(size); }
+	}
 
-Tan* Tan::copyTree() { return new Tan(operand->copyTree()); }
+	char* block = (char*)::operator new(size + headerSize);
+	*(ExpressionArena**)block = nullptr;
+	return block + headerSize;
+}
 
-double Tan::evaluate() const { return std::tan(operand->evaluate()); }
+bool ExpressionArena::isPooled(const void* pointer) { return *(ExpressionArena* const*)((const char*)pointer - headerSize) != nullptr; }
 
-Multiply* Tan::differentiate(char diffOperator)
+void ExpressionArena::deallocate(void* pointer, size_t size)
 {
-    Expression* left = operand->differentiate(diffOperator);
-    Exponent* right = new Exponent(new Cos(operand->copyTree()), new Number(-2));
-    return new Multiply(left, right);
+	if (pointer == nullptr) { return; }
+
+	char* block = (char*)pointer - headerSize;
+	ExpressionArena* arena = *(ExpressionArena**)block;
+	if (arena == nullptr) { ::operator delete(block); }
+	else if (size + headerSize <= 16 * sizeClassCount) { arena->releaseNode(block, size); }
+	else { arena->releaseLarge(block); }
 }
 
-Tan* Tan::simplify() { return new Tan(operand->simplify()); }
+void* ExpressionArena::allocateNode(size_t size)
+{
+	size_t sizeClass = (size + headerSize - 1) / 16;
+	size_t allocationSize = (sizeClass + 1) * 16;
 
-std::string Tan::toString(bool showParentheses) { return "tan(" + operand->toString() + ")"; }
+	char* block;
+	if (freeLists[sizeClass] != nullptr)
+	{
+		block = (char*)freeLists[sizeClass];
+		freeLists[sizeClass] = *(void**)(block + headerSize);
+	}
+	else
+	{
+		if (cursor == nullptr || cursor + allocationSize > end)
+		{
+			if (cursor != nullptr) { ++blockIndex; }
+			if (blockIndex == blocks.size()) { blocks.push_back((char*)::operator new(blockSize)); }
+			cursor = blocks[blockIndex];
+			end = cursor + blockSize;
+		}
+		block = cursor;
+		cursor += allocationSize;
+	}
 
-Sinh* Sinh::copyTree() { return new Sinh(operand->copyTree()); }
+	*(ExpressionArena**)block = this;
+	++nodes;
+	return block + headerSize;
+}
 
-double Sinh::evaluate() const { return std::sinh(operand->evaluate()); }
+void ExpressionArena::releaseNode(void* pointer, size_t size)
+{
+	size_t sizeClass = (size + headerSize - 1) / 16;
+	*(void**)((char*)pointer + headerSize) = freeLists[sizeClass];
+	freeLists[sizeClass] = pointer;
+	--nodes;
+}
+
+// Allocations too big for a size class get their own block; the header keeps the arena and the block's
+// index in largeBlocks so it can be released individually or with everything else on reset()
+void* ExpressionArena::allocateLarge(size_t size)
+{
+	char* block = (char*)::operator new(size + headerSize);
+	*(ExpressionArena**)block = this;
+	*(size_t*)(block + sizeof(ExpressionArena*)) = largeBlocks.size();
+	largeBlocks.push_back(block);
+	return block + headerSize;
+}
 
-Multiply* Sinh::differentiate(char diffOperator)
+void ExpressionArena::releaseLarge(void* pointer)
 {
-	Expression* left = operand->differentiate(diffOperator);
-	Cosh* right = new Cosh(operand->copyTree());
-	return new Multiply(left, right);
+	size_t index = *(size_t*)((char*)pointer + sizeof(ExpressionArena*));
+	largeBlocks[index] = largeBlocks.back();
+	*(size_t*)(largeBlocks[index] + sizeof(ExpressionArena*)) = index;
+	largeBlocks.pop_back();
+	::operator delete(pointer);
 }
 
-Sinh* Sinh::simplify() { return new Sinh(operand->simplify()); }
+void* Expression::operator new(size_t size) { return ExpressionArena::allocate(size); }
 
-std::string Sinh::toString(bool showParentheses) { return "sinh(" + operand->toString() + ")"; }
+void Expression::operator delete(void* pointer, size_t size) { ExpressionArena::deallocate(pointer, size); }
 
-Cosh* Cosh::copyTree() { return new Cosh(operand->copyTree()); }
+bool Expression::operator!= (const Expression &b) { return !(*this == b); }
 
-double Cosh::evaluate() const { return std::cosh(operand->evaluate()); }
+Expression::~Expression() {}
+
+bool Expression::isAtomic() { return false; }
 
-Multiply* Cosh::differentiate(char diffOperator)
+Expression* Expression::simplify()
 {
-	Expression* left = operand->differentiate(diffOperator);
-	Sinh* right = new Sinh(operand->copyTree());
-	return new Multiply(left, right);
+	Simplifier simplifier;
+	return simplifier.simplify(copyTree());
 }
 
-Cosh* Cosh::simplify() { return new Cosh(operand->simplify()); }
+// While an ExpressionInterner is differentiating, operands it owns are shared rather than copied and their
+// derivatives come from its memo table; nodes outside it behave exactly as plain trees
+static thread_local ExpressionInterner* activeInterner = nullptr;
 
-std::string Cosh::toString(bool showParentheses) { return "cosh(" + operand->toString() + ")"; }
+// Set while taking a partial derivative, so variables other than the one differentiated by count as constants
+static thread_local bool holdingOthersConstant = false;
 
-Tanh* Tanh::copyTree() { return new Tanh(operand->copyTree()); }
+Expression* Expression::derivativeOf(Expression* expression, char diffOperator)
+{
+	if (activeInterner && activeInterner->contains(expression)) { return activeInterner->differentiate(expression, diffOperator); }
+	return expression->differentiate(diffOperator);
+}
 
-double Tanh::evaluate() const { return std::tanh(operand->evaluate()); }
+Expression* Expression::partialDerivative(char diffOperator)
+{
+	struct Holding
+	{
+		bool previous;
+		~Holding() { holdingOthersConstant = previous; }
+	} holding = { holdingOthersConstant };
+	holdingOthersConstant = true;
+
+	return differentiate(diffOperator);
+}
 
-Multiply* Tanh::differentiate(char diffOperator)
+Expression* Expression::copyOf(Expression* expression)
 {
-	Expression* left = operand->differentiate(diffOperator);
-	Exponent* right = new Exponent(new Cosh(operand->copyTree()), new Number(-2));
-	return new Multiply(left, right);
+	if (activeInterner && activeInterner->contains(expression)) { return expression; }
+	return expression->copyTree();
 }
 
-Tanh* Tanh::simplify() { return new Tanh(operand->simplify()); }
+static bool isShared(const Expression* expression) { return activeInterner && activeInterner->contains(expression); }
 
-std::string Tanh::toString(bool showParentheses) { return "tanh(" + operand->toString() + ")"; }
+void Expression::discard(Expression* expression)
+{
+	if (activeInterner) { activeInterner->release(expression); }
+	else { delete expression; }
+}
 
-Arcsin* Arcsin::copyTree() { return new Arcsin(operand->copyTree()); }
+static const Number* asNumber(Expression* expression) { return typeid(*expression) == typeid(Number) ? (const Number*)expression : nullptr; }
 
-double Arcsin::evaluate() const { return std::asin(operand->evaluate()); }
+// Coefficient vectors of polynomials in one variable, lowest power first. Degrees are capped so expanding
+// a large power cannot run away
+static const size_t maxPolynomialDegree = 64;
+
+static bool isConstantPolynomial(const std::vector<double>& p) { return p.size() == 1; }
+
+static size_t termCount(const std::vector<double>& p) { return p.size() - std::count(p.begin(), p.end(), 0.0); }
 
-Divide* Arcsin::differentiate(char diffOperator)
+static void trimPolynomial(std::vector<double>& p)
 {
-	Expression* top = operand->differentiate();
-	Expression* bottomInner = new Subtract(1, new Exponent(operand->copyTree(), 2));
-	Expression* bottom = new Exponent(bottomInner, 0.5f);
-	return new Divide(top, bottom);
+	while (p.size() > 1 && p.back() == 0) { p.pop_back(); }
 }
 
-Arcsin* Arcsin::simplify() { return new Arcsin(operand->simplify()); }
+static std::vector<double> addPolynomials(const std::vector<double>& a, const std::vector<double>& b, double scale = 1)
+{
+	std::vector<double> result(std::max(a.size(), b.size()), 0);
+	for (size_t i = 0; i < a.size(); ++i) { result[i] += a[i]; }
+	for (size_t i = 0; i < b.size(); ++i) { result[i] += scale * b[i]; }
+	trimPolynomial(result);
+	return result;
+}
 
-std::string Arcsin::toString(bool showParentheses) { return "arcsin(" + operand->toString() + ")"; }
+static std::vector<double> multiplyPolynomials(const std::vector<double>& a, const std::vector<double>& b)
+{
+	std::vector<double> result(a.size() + b.size() - 1, 0);
+	for (size_t i = 0; i < a.size(); ++i)
+	{
+		if (a[i] == 0) { continue; }
+		for (size_t j = 0; j < b.size(); ++j) { result[i + j] += a[i] * b[j]; }
+	}
+	trimPolynomial(result);
+	return result;
+}
 
-Arccos* Arccos::copyTree() { return new Arccos(operand->copyTree()); }
+bool Expression::polynomialOf(const Expression* expression, char& var, bool expand, std::vector<double>& numerator, std::vector<double>& denominator)
+{
+	if (activePolynomials && !expand && (dynamic_cast<const Operator*>(expression) || dynamic_cast<const NaryOperator*>(expression)))
+	{
+		// A chosen variable only adds the condition that the subtree's own variable matches it, so the form found
+		// without one answers every later query
+		std::unordered_map<const Expression*, PolynomialMemo>::iterator found = activePolynomials->find(expression);
+		if (found == activePolynomials->end())
+		{
+			PolynomialMemo memo;
+			memo.var = 0;
+			memo.found = expression->polynomialForm(memo.var, false, memo.numerator, memo.denominator)
+				&& memo.numerator.size() <= maxPolynomialDegree + 1 && memo.denominator.size() <= maxPolynomialDegree + 1;
+			found = activePolynomials->emplace(expression, std::move(memo)).first;
+		}
 
-double Arccos::evaluate() const { return std::acos(operand->evaluate()); }
+		const PolynomialMemo& memo = found->second;
+		if (!memo.found || (var && memo.var && memo.var != var)) { return false; }
+		if (memo.var) { var = memo.var; }
+		numerator = memo.numerator;
+		denominator = memo.denominator;
+		return true;
+	}
+
+	if (!expression->polynomialForm(var, expand, numerator, denominator)) { return false; }
+	return numerator.size() <= maxPolynomialDegree + 1 && denominator.size() <= maxPolynomialDegree + 1;
+}
 
-Divide* Arccos::differentiate(char diffOperator)
+// Nodes that are not arithmetic on the variable and numbers have no polynomial form. When expand is false, only
+// polynomials written out as sums of terms are accepted: products of several sums, powers of sums and division by
+// anything other than a number would have to be multiplied out, which changes how the value is rounded
+bool Expression::polynomialForm(char& var, bool expand, std::vector<double>& numerator, std::vector<double>& denominator) const { return false; }
+
+bool Expression::polynomialCoefficients(char var, std::vector<double>& coefficients) const
 {
-	Expression* top = new Multiply(-1, operand->differentiate());
-	Expression* bottomInner = new Subtract(1, new Exponent(operand->copyTree(), 2));
-	Expression* bottom = new Exponent(bottomInner, 0.5f);
-	return new Divide(top, bottom);
+	std::vector<double> denominator;
+	if (!polynomialOf(this, var, true, coefficients, denominator) || !isConstantPolynomial(denominator))
+	{
+		coefficients.clear();
+		return false;
+	}
+	for (double& coefficient : coefficients) { coefficient /= denominator[0]; }
+	return true;
 }
 
-Arccos* Arccos::simplify() { return new Arccos(operand->simplify()); }
+// The two polynomials are not reduced to lowest terms, so common factors of the numerator and denominator remain
+bool Expression::rationalCoefficients(char var, std::vector<double>& numerator, std::vector<double>& denominator) const
+{
+	if (polynomialOf(this, var, true, numerator, denominator)) { return true; }
+	numerator.clear();
+	denominator.clear();
+	return false;
+}
 
-std::string Arccos::toString(bool showParentheses) { return "arccos(" + operand->toString() + ")"; }
+// Sums, products and quotients by numbers that are polynomials in one variable, of degree two or more and with at
+// least two terms, are evaluated by Horner's rule or Estrin's scheme in place of a pow call per term. Either way
+// the program is left with additions and multiplications only, which the batch kernels and native code vectorise
+bool Program::emitPolynomial(const Expression* expression, unsigned int& index)
+{
+	const std::type_info& type = typeid(*expression);
+	if (type != typeid(Add) && type != typeid(Subtract) && type != typeid(Multiply) && type != typeid(Divide)) { return false; }
 
-Differential::Differential(Expression *left, Expression *right, unsigned char order) : Operator::Operator(left, right)
+	char var = 0;
+	std::vector<double> numerator;
+	std::vector<double> denominator;
+	if (!Expression::polynomialOf(expression, var, false, numerator, denominator) || !var) { return false; }
+	if (numerator.size() < 3 || termCount(numerator) < 2) { return false; }
+
+	index = emitPolynomial(numerator, emitVariable(var));
+	return true;
+}
+
+// Horner's rule up to cubics. Above that Estrin's scheme pairs the terms as (c0 + c1 x) + (c2 + c3 x) x^2 + ...
+// and repeats on the pairs with x^2, x^4, ..., so the chain of dependent operations grows with log n rather than
+// n. Zero coefficients are skipped and unit ones are not multiplied by
+unsigned int Program::emitPolynomial(const std::vector<double>& coefficients, unsigned int x)
 {
-    this->order = order;
+	const unsigned int zero = std::numeric_limits<unsigned int>::max();
+	const unsigned int one = zero - 1;
+	std::vector<unsigned int> terms;
+	for (double coefficient : coefficients) { terms.push_back(coefficient == 0 ? zero : coefficient == 1 ? one : emitConstant(coefficient)); }
+
+	auto combine = [&](unsigned int low, unsigned int high, unsigned int power) -> unsigned int
+	{
+		if (high == zero) { return low; }
+		unsigned int product = high == one ? power : emit(Opcode::Multiply, high, power);
+		if (low == zero) { return product; }
+		return emit(Opcode::Add, low == one ? emitConstant(1) : low, product);
+	};
+
+	if (terms.size() <= 4)
+	{
+		unsigned int result = terms.back();
+		for (size_t i = terms.size() - 1; i-- > 0;) { result = combine(terms[i], result, x); }
+		return result;
+	}
+
+	unsigned int power = x;
+	while (terms.size() > 1)
+	{
+		std::vector<unsigned int> pairs;
+		for (size_t i = 0; i < terms.size(); i += 2) { pairs.push_back(combine(terms[i], i + 1 < terms.size() ? terms[i + 1] : zero, power)); }
+		terms.swap(pairs);
+		if (terms.size() > 1) { power = emit(Opcode::Multiply, power, power); }
+	}
+	return terms[0];
 }
 
-Differential* Differential::copyTree()
+bool Expression::isCommutative() const { return true; }
+
+static size_t combineHash(size_t seed, size_t value) { return seed ^ (value + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2)); }
+
+static size_t mixHash(size_t value)
 {
-    return new Differential(leftOperand->copyTree(), rightOperand->copyTree(), order);
+	unsigned long long mixed = value;
+	mixed = (mixed ^ (mixed >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	mixed = (mixed ^ (mixed >> 27)) * 0x94d049bb133111ebULL;
+	return (size_t)(mixed ^ (mixed >> 31));
+}
+
+// Computed on first use and kept until the node's structure changes. Substituting values does not change
+// the structure, so it leaves the hash intact; 0 marks a hash that has not been computed yet. Threads sharing a
+// tree may race to fill the cache, but they compute the same value, so relaxed atomic accesses are enough
+size_t Expression::hash() const
+{
+	size_t cached = structuralHash.load(std::memory_order_relaxed);
+	if (!cached)
+	{
+		cached = combineHash(typeid(*this).hash_code(), computeHash());
+		if (!cached) { cached = 1; }
+		structuralHash.store(cached, std::memory_order_relaxed);
+	}
+	return cached;
 }
 
-double Differential::evaluate() const const { throw "Not implemented"; }
+void Expression::invalidateHash() { structuralHash.store(0, std::memory_order_relaxed); }
 
-Expression* Differential::differentiate(char diffOperator)
+void Expression::substitute(char var, double value)
 {
-    Expression* tmp = rightOperand->differentiate(diffOperator);
-    bool sameOperator = tmp->isConstant();
-    delete tmp;
-    
-    if (sameOperator) { return new Differential(leftOperand, rightOperand, order + 1); }
-    else
-    {
-        Differential* rhs = new Differential(rightOperand, new Variable(diffOperator));
-        Differential* lhs = new Differential(leftOperand, rightOperand, order + 1);
-        return new Multiply(lhs, rhs);
-    }
+	std::map<char, double> varMap = std::map<char, double>();
+	varMap.emplace(var, value);
+	substitute(varMap);
 }
 
-bool Differential::isCommutative() { return false; }
+double Expression::evaluate(const std::map<char, double>& varMap)
+{
+	substitute(varMap);
+	return evaluate();
+}
 
-unsigned char Differential::precedence() { return 2; }
+double Expression::evaluate(char var, double value)
+{
+	substitute(var, value);
+	return evaluate();
+}
 
-std::string Differential::toString(bool useParentheses)
+void Expression::evaluateBatch(const double* values, double* out, size_t n, char var) const
 {
-    std::string top = "d";
-    if (order > 1) { top += "^" + std::to_string(order); }
-    top += leftOperand->toString();
-    
-    std::string bottom = "d" + rightOperand->toString();
-    if (order > 1) { bottom += "^" + std::to_string(order); }
-    
-    std::string str = top + "/" + bottom;
-    if (useParentheses){ str = "(" + str + ")"; }
-    return str;
+	std::map<char, const double*> columns;
+	columns.emplace(var, values);
+	evaluateBatch(columns, out, n);
 }
 
-double NumericalMethods::integrateTrapezium(Expression *expression, double a, double b, int n, char var)
+void Expression::evaluateBatch(const std::map<char, const double*>& columns, double* out, size_t n) const
 {
-	double h = (b - a) / n;
-	double sum = expression->evaluate(var, a) + expression->evaluate(var, b);
-	for (int i = 1; i < n; ++i)
+	Program* program = compile();
+	std::vector<const double*> vars;
+	for (char var : program->variables())
 	{
-		double input = a + i * h;
-		sum += 2 * expression->evaluate(var, input);
+		std::map<char, const double*>::const_iterator column = columns.find(var);
+		if (column == columns.end())
+		{
+			delete program;
+			throw "Unbound variable";
+		}
+		vars.push_back(column->second);
+	}
+
+	program->evaluateBatch(vars.data(), out, n);
+	delete program;
+}
+
+Dual Expression::evaluateWithDerivative(char var, double value) const
+{
+	Bindings bindings(std::string(1, var));
+	bindings.set(var, value);
+	return evaluateWithDerivative(bindings, var);
+}
+
+Dual Expression::evaluateWithDerivative(const Bindings& bindings, char var) const
+{
+	Program* program = compile();
+	Dual result;
+	try { result = program->evaluateWithDerivative(bindings, var); }
+	catch (...)
+	{
+		delete program;
+		throw;
+	}
+	delete program;
+	return result;
+}
+
+void Expression::evaluateWithDerivative(const double* values, double* out, double* derivatives, size_t n, char var) const
+{
+	Program* program = compile();
+	if (program->variables().size() > 1 || (program->variables().size() == 1 && program->variables()[0] != var))
+	{
+		delete program;
+		throw "Unbound variable";
+	}
+
+	program->evaluateWithDerivativeBatch(&values, program->variableSlot(var), out, derivatives, n);
+	delete program;
+}
+
+double Expression::gradient(const Bindings& bindings, double* out) const
+{
+	Program* program = compile();
+	double value;
+	try { value = program->gradient(bindings, out); }
+	catch (...)
+	{
+		delete program;
+		throw;
+	}
+	delete program;
+	return value;
+}
+
+Program* Expression::compile(Precision precision) const
+{
+	Program* program = new Program();
+	program->setPrecision(precision);
+	program->emitExpression(this);
+	program->assignSlots();
+	return program;
+}
+
+NativeProgram* Expression::compileNative(Precision precision) const
+{
+	std::unique_ptr<Program> program(compile(precision));
+	return new NativeProgram(*program);
+}
+
+class Expression::Parser
+{
+public:
+	Parser(const std::string& input, bool validateAndRectify);
+
+	Expression* parse();
+
+private:
+	std::string source;
+	std::vector<size_t> positions;
+	size_t index;
+	bool rectify;
+
+	Expression* parseExpression(unsigned char minPrecedence);
+	Expression* parseUnary();
+	Expression* parsePrimary();
+	Expression* parseApplication(const std::string& function);
+	Expression* parseWord();
+	Expression* parseCharacter();
+	bool matchFunction(std::string& function) const;
+	ParseError error(const std::string& message) const;
+
+	static unsigned char precedence(char name);
+	static bool isWordCharacter(char c);
+};
+
+Expression* Expression::parse(const std::string& input, bool validateAndRectify)
+{
+	Parser parser(input, validateAndRectify);
+	return parser.parse();
+}
+
+Expression::Parser::Parser(const std::string& input, bool validateAndRectify)
+{
+	source.reserve(input.size());
+	positions.reserve(input.size() + 1);
+	for (size_t i = 0; i < input.size(); ++i)
+	{
+		if (!std::isspace((unsigned char)input[i]))
+		{
+			source += input[i];
+			positions.push_back(i);
+		}
+	}
+	positions.push_back(input.size());
+
+	index = 0;
+	rectify = validateAndRectify;
+}
+
+Expression* Expression::Parser::parse()
+{
+	Expression* expression = parseExpression(1);
+	if (index < source.size())
+	{
+		delete expression;
+		throw error("Unmatched ')'");
+	}
+	return expression;
+}
+
+Expression* Expression::Parser::parseExpression(unsigned char minPrecedence)
+{
+	Expression* left = parseUnary();
+	while (index < source.size() && source[index] != ')')
+	{
+		char name = source[index];
+		unsigned char operatorPrecedence = precedence(name);
+		bool implicit = operatorPrecedence == 0;
+		if (implicit)
+		{
+			if (!rectify)
+			{
+				delete left;
+				throw error("Expected operator");
+			}
+			name = '*';
+			operatorPrecedence = precedence(name);
+		}
+		if (operatorPrecedence < minPrecedence) { break; }
+		if (!implicit) { ++index; }
+
+		Expression* right;
+		try { right = parseExpression(operatorPrecedence + 1); }
+		catch (...)
+		{
+			delete left;
+			throw;
+		}
+		left = parseOperator(name, left, right);
+	}
+	return left;
+}
+
+Expression* Expression::Parser::parseUnary()
+{
+	if (index < source.size() && (source[index] == '-' || source[index] == '+'))
+	{
+		bool negate = source[index++] == '-';
+		Expression* operand = parseExpression(precedence('^'));
+		if (!negate) { return operand; }
+		if (typeid(*operand) == typeid(Number))
+		{
+			Number* negated = new Number(-operand->evaluate());
+			delete operand;
+			return negated;
+		}
+		return new Subtract(new Number(0), operand);
+	}
+	return parsePrimary();
+}
+
+Expression* Expression::Parser::parsePrimary()
+{
+	if (index >= source.size()) { throw error("Unexpected end of input"); }
+
+	char c = source[index];
+	if (c == '(')
+	{
+		++index;
+		Expression* inner = parseExpression(1);
+		if (index >= source.size())
+		{
+			delete inner;
+			throw error("Expected ')'");
+		}
+		++index;
+		return inner;
+	}
+	else if (c == ')') { throw error("Unexpected ')'"); }
+	else if (precedence(c) != 0) { throw error(std::string("Unexpected operator '") + c + "'"); }
+
+	std::string function;
+	if (matchFunction(function)) { return parseApplication(function); }
+	else { return parseWord(); }
+}
+
+Expression* Expression::Parser::parseApplication(const std::string& function)
+{
+	index += function.size();
+
+	Expression* operand;
+	std::string innerFunction;
+	if (index < source.size() && source[index] == '(') { operand = parsePrimary(); }
+	else if (index < source.size() && isWordCharacter(source[index]))
+	{
+		if (matchFunction(innerFunction)) { operand = parseApplication(innerFunction); }
+		else { operand = parseCharacter(); }
+	}
+	else { throw error("Expected operand for '" + function + "'"); }
+
+	return parseFunction(function, operand);
+}
+
+Expression* Expression::Parser::parseWord()
+{
+	// A signed exponent stays in the number, so 1e-5 reads as one literal rather than 1e - 5
+	size_t end = index;
+	bool mantissa = true;
+	bool digits = false;
+	bool point = false;
+	while (end < source.size())
+	{
+		char c = source[end];
+		if (isWordCharacter(c))
+		{
+			bool exponent = mantissa && digits && (c == 'e' || c == 'E') && end + 2 < source.size()
+				&& (source[end + 1] == '+' || source[end + 1] == '-') && source[end + 2] >= '0' && source[end + 2] <= '9';
+			mantissa = mantissa && ((c >= '0' && c <= '9') || (c == '.' && !point));
+			digits = digits || (mantissa && c != '.');
+			point = point || c == '.';
+			end += exponent ? 2 : 1;
+		}
+		else { break; }
+	}
+
+	char buffer[64];
+	std::string longWord;
+	const char* word = buffer;
+	if (end - index < sizeof(buffer))
+	{
+		std::memcpy(buffer, source.data() + index, end - index);
+		buffer[end - index] = '\0';
+	}
+	else
+	{
+		longWord = source.substr(index, end - index);
+		word = longWord.c_str();
+	}
+
+	char* numberEnd = nullptr;
+	double value = std::strtod(word, &numberEnd);
+	Expression* result;
+	if (numberEnd != word)
+	{
+		result = new Number(value);
+		index += numberEnd - word;
+	}
+	else { result = parseCharacter(); }
+
+	std::string function;
+	while (index < end && !matchFunction(function)) { result = new Multiply(result, parseCharacter()); }
+	return result;
+}
+
+Expression* Expression::Parser::parseCharacter()
+{
+	char c = source[index++];
+	if (c >= '0' && c <= '9') { return new Number(c - '0'); }
+	else if (c == 'e') { return new Constant('e'); }
+	else { return new Variable(c); }
+}
+
+bool Expression::Parser::matchFunction(std::string& function) const
+{
+	static const char* const functions[] = { "invsqrt", "sqrt", "arcsin", "arccos", "sinh", "cosh", "tanh", "sinc", "cosech", "cosec",
+											 "sech", "sec", "csc", "cotanh", "cotan", "coth", "cot", "sin", "cos", "tan", "ln", "log" };
+
+	size_t longest = 0;
+	for (size_t i = 0; i < sizeof(functions) / sizeof(functions[0]); ++i)
+	{
+		size_t length = std::strlen(functions[i]);
+		if (length > longest && source.compare(index, length, functions[i]) == 0)
+		{
+			longest = length;
+			function = functions[i];
+		}
+	}
+	return longest > 0;
+}
+
+ParseError Expression::Parser::error(const std::string& message) const { return ParseError(message, positions[std::min(index, source.size())]); }
+
+unsigned char Expression::Parser::precedence(char name)
+{
+	switch (name)
+	{
+		case '+': return 1;
+		case '-': return 2;
+		case '*': return 3;
+		case '/': return 4;
+		case '^': return 5;
+		default: return 0;
 	}
+}
+
+bool Expression::Parser::isWordCharacter(char c) { return precedence(c) == 0 && c != '(' && c != ')'; }
+
+Expression* Expression::parseOperator(char name, Expression* leftOperand, Expression* rightOperand)
+{
+    if (name == '+') { return new Add(leftOperand, rightOperand); }
+    else if (name == '-') { return new Subtract(leftOperand, rightOperand); }
+    else if (name == '*') { return new Multiply(leftOperand, rightOperand); }
+    else if (name == '/') { return new Divide(leftOperand, rightOperand); }
+    else if (name == '^') { return new Exponent(leftOperand, rightOperand); }
+    else { throw "Not implemented"; }
+}
+
+Expression* Expression::parseFunction(const std::string& name, Expression* operand)
+{
+    if (name == "sin") { return new Sin(operand); }
+	else if (name == "arcsin") { return new Arcsin(operand); }
+    else if (name == "cos") { return new Cos(operand); }
+	else if (name == "arccos") { return new Arccos(operand); }
+    else if (name == "tan") { return new Tan(operand); }
+	else if (name == "sinh") { return new Sinh(operand); }
+	else if (name == "cosh") { return new Cosh(operand); }
+	else if (name == "tanh") { return new Tanh(operand); }
+    else if (name == "sec") { return new Exponent(new Cos(operand), new Number(-1)); }
+    else if (name == "cosec") { return new Exponent(new Sin(operand), new Number(-1)); }
+	else if (name == "csc") { return new Exponent(new Sin(operand), new Number(-1)); }
+    else if (name == "cotan") { return new Exponent(new Tan(operand), new Number(-1)); }
+	else if (name == "cot") { return new Exponent(new Tan(operand), new Number(-1)); }
+	else if (name == "sech") { return new Exponent(new Cosh(operand), new Number(-1)); }
+	else if (name == "cosech") { return new Exponent(new Sinh(operand), new Number(-1)); }
+	else if (name == "cotanh") { return new Exponent(new Tanh(operand), new Number(-1)); }
+	else if (name == "coth") { return new Exponent(new Tanh(operand), new Number(-1)); }
+    else if (name == "sinc") { return new Divide(new Sin(operand), operand->copyTree()); }
+    else if (name == "ln") { return new Log(new Constant('e'), operand); }
+    else if (name == "log") { return new Log(new Number(10), operand); }
+	else if (name == "sqrt") { return new Exponent(operand, 0.5f); }
+	else if (name == "invsqrt") { return new Exponent(operand, -0.5f); }
+    else { throw "Not implemented"; }
+}
 
-	sum *= h / 2;
-	return sum;
+ParseError::ParseError(const std::string& message, size_t position) : std::runtime_error(message + " at position " + std::to_string(position))
+{
+	errorPosition = position;
 }
 
+size_t ParseError::position() const { return errorPosition; }
+
+bool Operator::operator== (const Expression &b)
+{
+	if (this == &b) { return true; }
+	if (hash() != b.hash()) { return false; }
+	if (typeid(*this) != typeid(b)) { return false; }
+	else
+	{
+		Operator* bOperator = (Operator*)&b;
+		if (isCommutative()) { return (*leftOperand == *bOperator->leftOperand && *rightOperand == *bOperator->rightOperand) ||
+										(*leftOperand == *bOperator->rightOperand && *rightOperand == *bOperator->leftOperand); }
+		else { return *leftOperand == *bOperator->leftOperand && *rightOperand == *bOperator->rightOperand; }
+	}
+}
+
+size_t Operator::computeHash() const
+{
+	size_t left = leftOperand->hash();
+	size_t right = rightOperand->hash();
+	if (isCommutative() && right < left) { std::swap(left, right); }
+	return combineHash(left, right);
+}
+
+void Operator::determineParentheses(bool& left, bool& right)
+{
+	if (leftOperand->precedence() < precedence()) { left = true; }
+	else { left = false; }
+	if (rightOperand->precedence() < precedence()) { right = true; }
+	else if (rightOperand->precedence() == precedence() && !(isCommutative() && rightOperand->isCommutative())) { right = true; }
+	else { right = false; }
+}
+
+void Operator::toStringOperands(std::string& left, std::string& right)
+{
+	bool leftParentheses;
+	bool rightParentheses;
+	determineParentheses(leftParentheses, rightParentheses);
+	left = leftOperand->toString(leftParentheses);
+	right = rightOperand->toString(rightParentheses);
+}
+
+bool Operator::isConstant() { return leftOperand->isConstant() && rightOperand->isConstant(); }
+
+void Operator::substitute(const std::map<char, double>& varMap)
+{
+	leftOperand->substitute(varMap);
+	rightOperand->substitute(varMap);
+}
+
+Operator::Operator(Expression *left, Expression *right)
+{
+	leftOperand = left;
+	rightOperand = right;
+}
+
+Operator::Operator(double left, Expression *right) : Operator::Operator(new Number(left), right) {}
+Operator::Operator(Expression *left, double right) : Operator::Operator(left, new Number(right)) {}
+Operator::Operator(double left, double right) : Operator::Operator(new Number(left), new Number(right)) {}
+
+Operator::~Operator()
+{
+	delete leftOperand;
+	delete rightOperand;
+}
+
+Expression* Operator::getLeftOperand() { return leftOperand; }
+Expression* Operator::getRightOperand() { return rightOperand; }
+
+unsigned int Operator::emitOperands(Program& program, Program::Opcode opcode) const
+{
+	unsigned int left = program.emitExpression(leftOperand);
+	unsigned int right = program.emitExpression(rightOperand);
+	return program.emit(opcode, left, right);
+}
+
+void Operator::encodeOperands(std::string& out, SerializedExpression::Kind kind) const
+{
+	leftOperand->encode(out);
+	rightOperand->encode(out);
+	SerializedExpression::encodeKind(out, kind);
+}
+
+static int canonicalRank(Expression* expression)
+{
+	const std::type_info& type = typeid(*expression);
+	if (type == typeid(Number)) { return 0; }
+	else if (type == typeid(Constant)) { return 1; }
+	else if (type == typeid(Variable)) { return 2; }
+	else if (dynamic_cast<Func*>(expression)) { return 3; }
+	else if (dynamic_cast<NaryOperator*>(expression)) { return 5; }
+	else { return 4; }
+}
+
+// Total order used to sort operands: numbers first, then constants, variables, functions, binary operators
+// and n-ary operators, ties broken structurally. Returns 0 exactly when the expressions are structurally equal
+int NaryOperator::compare(Expression* a, Expression* b)
+{
+	if (a == b) { return 0; }
+
+	int rankA = canonicalRank(a);
+	if (typeid(*a) != typeid(*b))
+	{
+		int rankB = canonicalRank(b);
+		if (rankA != rankB) { return rankA < rankB ? -1 : 1; }
+		return typeid(*a).before(typeid(*b)) ? -1 : 1;
+	}
+
+	switch (rankA)
+	{
+		case 0:
+		{
+			double valueA = a->evaluate();
+			double valueB = b->evaluate();
+			if (valueA != valueB) { return valueA < valueB ? -1 : 1; }
+			return 0;
+		}
+		case 1:
+		case 2:
+		{
+			char varA = ((Variable*)a)->charID();
+			char varB = ((Variable*)b)->charID();
+			if (varA != varB) { return varA < varB ? -1 : 1; }
+			return 0;
+		}
+		case 3: return compare(((Func*)a)->getOperand(), ((Func*)b)->getOperand());
+		case 4:
+		{
+			Operator* opA = (Operator*)a;
+			Operator* opB = (Operator*)b;
+			int result = compare(opA->getLeftOperand(), opB->getLeftOperand());
+			if (result == 0) { result = compare(opA->getRightOperand(), opB->getRightOperand()); }
+			if (result == 0 && typeid(*a) == typeid(Differential))
+			{
+				unsigned char orderA = ((Differential*)a)->getOrder();
+				unsigned char orderB = ((Differential*)b)->getOrder();
+				if (orderA != orderB) { result = orderA < orderB ? -1 : 1; }
+			}
+			return result;
+		}
+		default:
+		{
+			const Operands& operandsA = ((NaryOperator*)a)->operands;
+			const Operands& operandsB = ((NaryOperator*)b)->operands;
+			if (operandsA.size() != operandsB.size()) { return operandsA.size() < operandsB.size() ? -1 : 1; }
+			for (size_t i = 0; i < operandsA.size(); ++i)
+			{
+				int result = compare(operandsA[i], operandsB[i]);
+				if (result != 0) { return result; }
+			}
+			return 0;
+		}
+	}
+}
+
+NaryOperator::~NaryOperator()
+{
+	for (Expression* operand : operands) { delete operand; }
+}
+
+bool NaryOperator::operator== (const Expression &b)
+{
+	if (this == &b) { return true; }
+	if (hash() != b.hash()) { return false; }
+	if (typeid(*this) != typeid(b)) { return false; }
+
+	const Operands& bOperands = ((NaryOperator*)&b)->operands;
+	if (operands.size() != bOperands.size()) { return false; }
+	for (size_t i = 0; i < operands.size(); ++i)
+	{
+		if (!(*operands[i] == *bOperands[i])) { return false; }
+	}
+	return true;
+}
+
+// Operand hashes are summed so the result does not depend on the order the operands are held in
+size_t NaryOperator::computeHash() const
+{
+	size_t hash = operands.size();
+	for (Expression* operand : operands) { hash += mixHash(operand->hash()); }
+	return hash;
+}
+
+bool NaryOperator::isConstant()
+{
+	for (Expression* operand : operands)
+	{
+		if (!operand->isConstant()) { return false; }
+	}
+	return true;
+}
+
+void NaryOperator::substitute(const std::map<char, double>& varMap)
+{
+	for (Expression* operand : operands) { operand->substitute(varMap); }
+}
+
+const NaryOperator::Operands& NaryOperator::getOperands() { return operands; }
+
+// Operands of the same kind are spliced in rather than nested. A nested node owned by an active interner keeps
+// its operands and is left intact; the spliced operands are then shared with it just as copyOf() would share them
+void NaryOperator::insert(Expression* operand)
+{
+	invalidateHash();
+	if (typeid(*operand) != typeid(*this))
+	{
+		operands.insert(std::upper_bound(operands.begin(), operands.end(), operand,
+			[](Expression* a, Expression* b) { return compare(a, b) < 0; }), operand);
+		return;
+	}
+
+	NaryOperator* nested = (NaryOperator*)operand;
+	if (isShared(nested))
+	{
+		for (Expression* nestedOperand : nested->operands) { insert(nestedOperand); }
+		return;
+	}
+
+	if (operands.empty()) { operands.swap(nested->operands); }
+	else
+	{
+		for (Expression* nestedOperand : nested->operands) { insert(nestedOperand); }
+		nested->operands.clear();
+	}
+	delete nested;
+}
+
+void NaryOperator::canonicalise()
+{
+	Operands current;
+	current.swap(operands);
+	for (Expression* operand : current) { insert(operand); }
+}
+
+Expression* NaryOperator::unwrap(double identity)
+{
+	if (operands.size() > 1)
+	{
+		invalidateHash();
+		return this;
+	}
+
+	Expression* result = operands.empty() ? new Number(identity) : operands[0];
+	operands.clear();
+	delete this;
+	return result;
+}
+
+unsigned int NaryOperator::emitOperands(Program& program, Program::Opcode opcode) const
+{
+	unsigned int result = program.emitExpression(operands[0]);
+	for (size_t i = 1; i < operands.size(); ++i) { result = program.emit(opcode, result, program.emitExpression(operands[i])); }
+	return result;
+}
+
+void NaryOperator::encodeOperands(std::string& out, SerializedExpression::Kind kind) const
+{
+	for (Expression* operand : operands) { operand->encode(out); }
+	SerializedExpression::encodeKind(out, kind);
+	SerializedExpression::encodeCount(out, operands.size());
+}
+
+// Interval arithmetic. Every bound computed in floating point is pushed one ulp outwards, which covers the
+// rounding of the basic operations and of the libm functions used, so the true range always lies inside
+static const double pi = 3.14159265358979323846;
+static const Interval emptyInterval = { std::numeric_limits<double>::quiet_NaN(), std::numeric_limits<double>::quiet_NaN() };
+static const Interval entireInterval = { -std::numeric_limits<double>::infinity(), std::numeric_limits<double>::infinity() };
+
+static double roundDown(double value) { return std::nextafter(value, -std::numeric_limits<double>::infinity()); }
+static double roundUp(double value) { return std::nextafter(value, std::numeric_limits<double>::infinity()); }
+static bool isEmpty(const Interval& x) { return !(x.lower <= x.upper); }
+static Interval outward(double lower, double upper) { return { roundDown(lower), roundUp(upper) }; }
+
+// 0 * inf is taken as 0: a bound of zero is attained, whereas an infinite bound is only approached
+static double boundProduct(double a, double b) { return a == 0 || b == 0 ? 0 : a * b; }
+
+static Interval intervalAdd(const Interval& a, const Interval& b) { return outward(a.lower + b.lower, a.upper + b.upper); }
+
+static Interval intervalSubtract(const Interval& a, const Interval& b) { return outward(a.lower - b.upper, a.upper - b.lower); }
+
+static Interval intervalMultiply(const Interval& a, const Interval& b)
+{
+	if (isEmpty(a) || isEmpty(b)) { return emptyInterval; }
+	double products[4] = { boundProduct(a.lower, b.lower), boundProduct(a.lower, b.upper), boundProduct(a.upper, b.lower), boundProduct(a.upper, b.upper) };
+	return outward(*std::min_element(products, products + 4), *std::max_element(products, products + 4));
+}
+
+// A divisor with zero at one end divides by [1 / upper, inf) or (-inf, 1 / lower]; one with zero inside
+// gives the whole line, as the quotient is unbounded on both sides
+static Interval intervalDivide(const Interval& a, const Interval& b)
+{
+	if (isEmpty(a) || isEmpty(b)) { return emptyInterval; }
+	if (b.lower > 0 || b.upper < 0)
+	{
+		double quotients[4] = { a.lower / b.lower, a.lower / b.upper, a.upper / b.lower, a.upper / b.upper };
+		return outward(*std::min_element(quotients, quotients + 4), *std::max_element(quotients, quotients + 4));
+	}
+	if (b.lower == 0 && b.upper > 0) { return intervalMultiply(a, { roundDown(1 / b.upper), std::numeric_limits<double>::infinity() }); }
+	if (b.upper == 0 && b.lower < 0) { return intervalMultiply(a, { -std::numeric_limits<double>::infinity(), roundUp(1 / b.lower) }); }
+	return entireInterval;
+}
+
+static Interval intervalIncreasing(const Interval& x, double (*f)(double))
+{
+	if (isEmpty(x)) { return emptyInterval; }
+	return outward(f(x.lower), f(x.upper));
+}
+
+static Interval intervalIntersect(const Interval& x, double lower, double upper)
+{
+	Interval result = { std::max(x.lower, lower), std::min(x.upper, upper) };
+	return isEmpty(result) ? emptyInterval : result;
+}
+
+static Interval intervalClamp(const Interval& x, double lower, double upper)
+{
+	if (isEmpty(x)) { return emptyInterval; }
+	return { std::max(x.lower, lower), std::min(x.upper, upper) };
+}
+
+// Whether offset + k * period lies in x for some integer k. The test is widened by a few ulps of the
+// operands, as pi itself is rounded; reporting a point that is just outside only loosens the bound
+static bool containsPeriodicPoint(const Interval& x, double offset, double period)
+{
+	double slack = 4 * std::numeric_limits<double>::epsilon() * (1 + std::max(std::fabs(x.lower), std::fabs(x.upper)));
+	double k = std::ceil((x.lower - slack - offset) / period);
+	return offset + k * period <= x.upper + slack;
+}
+
+// Sine and cosine are bounded by their values at the ends unless a peak or trough lies between them
+static Interval intervalPeriodic(const Interval& x, double (*f)(double), double peak, double trough)
+{
+	if (isEmpty(x)) { return emptyInterval; }
+	if (!std::isfinite(x.lower) || !std::isfinite(x.upper) || x.upper - x.lower >= 2 * pi) { return { -1, 1 }; }
+	double a = f(x.lower);
+	double b = f(x.upper);
+	Interval result = outward(std::min(a, b), std::max(a, b));
+	if (containsPeriodicPoint(x, peak, 2 * pi)) { result.upper = 1; }
+	if (containsPeriodicPoint(x, trough, 2 * pi)) { result.lower = -1; }
+	return intervalClamp(result, -1, 1);
+}
+
+// Each real branch of log is increasing; arguments below zero are outside the domain and an argument range
+// reaching zero is unbounded below
+static Interval intervalLog(const Interval& x, double (*f)(double))
+{
+	if (isEmpty(x) || x.upper < 0) { return emptyInterval; }
+	return { x.lower > 0 ? roundDown(f(x.lower)) : -std::numeric_limits<double>::infinity(), roundUp(f(x.upper)) };
+}
+
+static bool isInteger(double value) { return std::isfinite(value) && value == std::floor(value); }
+
+// Integral indices keep the sign rules of repeated multiplication: odd powers are increasing, even powers
+// fall to zero when the base spans it, and negative powers are reciprocals. Any other index needs a base of at
+// least zero, over which pow(x, y) = exp(y * ln x) takes its extremes at the corners, as y * ln x is bilinear
+static Interval intervalPower(const Interval& base, const Interval& index)
+{
+	if (isEmpty(base) || isEmpty(index)) { return emptyInterval; }
+	if (index.lower == index.upper && isInteger(index.lower))
+	{
+		double n = index.lower;
+		if (n == 0) { return { 1, 1 }; }
+		if (n < 0) { return intervalDivide({ 1, 1 }, intervalPower(base, { -n, -n })); }
+
+		double a = std::pow(base.lower, n);
+		double b = std::pow(base.upper, n);
+		if (std::fmod(n, 2) != 0 || base.lower >= 0) { return outward(std::min(a, b), std::max(a, b)); }
+		if (base.upper <= 0) { return outward(b, a); }
+		return { 0, roundUp(std::max(a, b)) };
+	}
+
+	// A negative base is still defined at integral indices, which pow reaches only through isolated points
+	if (base.lower < 0 && std::floor(index.upper) >= index.lower) { return entireInterval; }
+
+	Interval x = intervalIntersect(base, 0, std::numeric_limits<double>::infinity());
+	if (isEmpty(x)) { return emptyInterval; }
+	double corners[4] = { std::pow(x.lower, index.lower), std::pow(x.lower, index.upper), std::pow(x.upper, index.lower), std::pow(x.upper, index.upper) };
+	Interval result = outward(*std::min_element(corners, corners + 4), *std::max_element(corners, corners + 4));
+	result.lower = std::max(result.lower, 0.0);
+	return result;
+}
+
+Add::Add() {}
+Add::Add(Expression *left, Expression *right)
+{
+	insert(left);
+	insert(right);
+}
+Add::Add(double left, Expression *right) : Add::Add(new Number(left), right) {}
+Add::Add(Expression *left, double right) : Add::Add(left, new Number(right)) {}
+Add::Add(double left, double right) : Add::Add(new Number(left), new Number(right)) {}
+Add::Add(const std::vector<Expression*>& operands)
+{
+	for (Expression* operand : operands) { insert(operand); }
+}
+
+double Add::evaluate() const
+{
+	double result = operands[0]->evaluate();
+	for (size_t i = 1; i < operands.size(); ++i) { result += operands[i]->evaluate(); }
+	return result;
+}
+
+double Add::evaluate(const Bindings& bindings) const
+{
+	double result = operands[0]->evaluate(bindings);
+	for (size_t i = 1; i < operands.size(); ++i) { result += operands[i]->evaluate(bindings); }
+	return result;
+}
+
+Interval Add::evaluateInterval(const std::map<char, Interval>& ranges) const
+{
+	Interval result = operands[0]->evaluateInterval(ranges);
+	for (size_t i = 1; i < operands.size(); ++i) { result = intervalAdd(result, operands[i]->evaluateInterval(ranges)); }
+	return result;
+}
+
+bool Add::polynomialForm(char& var, bool expand, std::vector<double>& numerator, std::vector<double>& denominator) const
+{
+	if (!polynomialOf(operands[0], var, expand, numerator, denominator)) { return false; }
+	for (size_t i = 1; i < operands.size(); ++i)
+	{
+		std::vector<double> n;
+		std::vector<double> d;
+		if (!polynomialOf(operands[i], var, expand, n, d)) { return false; }
+		if (d == denominator) { numerator = addPolynomials(numerator, n); }
+		else
+		{
+			numerator = addPolynomials(multiplyPolynomials(numerator, d), multiplyPolynomials(n, denominator));
+			denominator = multiplyPolynomials(denominator, d);
+		}
+	}
+	return true;
+}
+
+unsigned int Add::emit(Program& program) const { return emitOperands(program, Program::Opcode::Add); }
+
+void Add::encode(std::string& out) const { encodeOperands(out, SerializedExpression::Kind::Add); }
+
+Expression* Add::make(Expression *left, Expression *right) { return make(std::vector<Expression*>{ left, right }); }
+
+// Numbers sort first, so they are merged at the front and a zero sum of them is dropped
+Expression* Add::make(const std::vector<Expression*>& operands)
+{
+	Add* sum = new Add(operands);
+	Operands& terms = sum->operands;
+	while (terms.size() > 1 && asNumber(terms[0]) && asNumber(terms[1]))
+	{
+		Expression* merged = new Number(terms[0]->evaluate() + terms[1]->evaluate());
+		discard(terms[0]);
+		discard(terms[1]);
+		terms.erase(terms.begin());
+		terms[0] = merged;
+	}
+	if (terms.size() > 1 && asNumber(terms[0]) && terms[0]->evaluate() == 0)
+	{
+		discard(terms[0]);
+		terms.erase(terms.begin());
+	}
+	return sum->unwrap(0);
+}
+
+Expression* Add::differentiate(char diffOperator)
+{
+	std::vector<Expression*> derivatives;
+	for (Expression* operand : operands) { derivatives.push_back(derivativeOf(operand, diffOperator)); }
+	return make(derivatives);
+}
+
+Add* Add::copyTree()
+{
+	Add* copy = new Add();
+	copy->operands.reserve(operands.size());
+	for (Expression* operand : operands) { copy->operands.push_back(operand->copyTree()); }
+	return copy;
+}
+
+std::string Add::toString(bool showParentheses)
+{
+	std::string out = operands[0]->toString();
+	for (size_t i = 1; i < operands.size(); ++i) { out += " + " + operands[i]->toString(); }
+	if (showParentheses) { out = "(" + out + ")"; }
+	return out;
+}
+
+unsigned char Add::precedence() { return 1; }
+
+Subtract* Subtract::copyTree() { return new Subtract(leftOperand->copyTree(), rightOperand->copyTree()); }
+
+double Subtract::evaluate() const { return leftOperand->evaluate() - rightOperand->evaluate(); }
+
+double Subtract::evaluate(const Bindings& bindings) const { return leftOperand->evaluate(bindings) - rightOperand->evaluate(bindings); }
+
+Interval Subtract::evaluateInterval(const std::map<char, Interval>& ranges) const
+{
+	return intervalSubtract(leftOperand->evaluateInterval(ranges), rightOperand->evaluateInterval(ranges));
+}
+
+bool Subtract::polynomialForm(char& var, bool expand, std::vector<double>& numerator, std::vector<double>& denominator) const
+{
+	std::vector<double> n;
+	std::vector<double> d;
+	if (!polynomialOf(leftOperand, var, expand, numerator, denominator) || !polynomialOf(rightOperand, var, expand, n, d)) { return false; }
+	if (d == denominator) { numerator = addPolynomials(numerator, n, -1); }
+	else
+	{
+		numerator = addPolynomials(multiplyPolynomials(numerator, d), multiplyPolynomials(n, denominator), -1);
+		denominator = multiplyPolynomials(denominator, d);
+	}
+	return true;
+}
+
+unsigned int Subtract::emit(Program& program) const { return emitOperands(program, Program::Opcode::Subtract); }
+
+void Subtract::encode(std::string& out) const { encodeOperands(out, SerializedExpression::Kind::Subtract); }
+
+Expression* Subtract::make(Expression *left, Expression *right)
+{
+	const Number* a = asNumber(left);
+	const Number* b = asNumber(right);
+	Expression* result;
+	if (a && b) { result = new Number(a->evaluate() - b->evaluate()); }
+	else if (b && b->evaluate() == 0) { discard(right); return left; }
+	else if (a && a->evaluate() == 0) { discard(left); return Multiply::make(new Number(-1), right); }
+	else { return new Subtract(left, right); }
+
+	discard(left);
+	discard(right);
+	return result;
+}
+
+Expression* Subtract::differentiate(char diffOperator) { return make(derivativeOf(leftOperand, diffOperator), derivativeOf(rightOperand, diffOperator)); }
+
+std::string Subtract::toString(bool showParentheses)
+{
+	std::string left, right;
+	toStringOperands(left, right);
+	std::string out = left + " - " + right;
+	if (showParentheses) { out = "(" + out + ")"; }
+	return out;
+}
+
+unsigned char Subtract::precedence() { return 1; }
+
+bool Subtract::isCommutative() const { return false; }
+
+
+Multiply::Multiply() {}
+Multiply::Multiply(Expression *left, Expression *right)
+{
+	insert(left);
+	insert(right);
+}
+Multiply::Multiply(double left, Expression *right) : Multiply::Multiply(new Number(left), right) {}
+Multiply::Multiply(Expression *left, double right) : Multiply::Multiply(left, new Number(right)) {}
+Multiply::Multiply(double left, double right) : Multiply::Multiply(new Number(left), new Number(right)) {}
+Multiply::Multiply(const std::vector<Expression*>& operands)
+{
+	for (Expression* operand : operands) { insert(operand); }
+}
+
+Multiply* Multiply::copyTree()
+{
+	Multiply* copy = new Multiply();
+	copy->operands.reserve(operands.size());
+	for (Expression* operand : operands) { copy->operands.push_back(operand->copyTree()); }
+	return copy;
+}
+
+double Multiply::evaluate() const
+{
+	double result = operands[0]->evaluate();
+	for (size_t i = 1; i < operands.size(); ++i) { result *= operands[i]->evaluate(); }
+	return result;
+}
+
+double Multiply::evaluate(const Bindings& bindings) const
+{
+	double result = operands[0]->evaluate(bindings);
+	for (size_t i = 1; i < operands.size(); ++i) { result *= operands[i]->evaluate(bindings); }
+	return result;
+}
+
+Interval Multiply::evaluateInterval(const std::map<char, Interval>& ranges) const
+{
+	Interval result = operands[0]->evaluateInterval(ranges);
+	for (size_t i = 1; i < operands.size(); ++i) { result = intervalMultiply(result, operands[i]->evaluateInterval(ranges)); }
+	return result;
+}
+
+bool Multiply::polynomialForm(char& var, bool expand, std::vector<double>& numerator, std::vector<double>& denominator) const
+{
+	if (!polynomialOf(operands[0], var, expand, numerator, denominator)) { return false; }
+	size_t sums = termCount(numerator) > 1;
+	for (size_t i = 1; i < operands.size(); ++i)
+	{
+		std::vector<double> n;
+		std::vector<double> d;
+		if (!polynomialOf(operands[i], var, expand, n, d)) { return false; }
+		sums += termCount(n) > 1;
+		if (!expand && sums > 1) { return false; }
+
+		numerator = multiplyPolynomials(numerator, n);
+		denominator = multiplyPolynomials(denominator, d);
+		if (numerator.size() > maxPolynomialDegree + 1 || denominator.size() > maxPolynomialDegree + 1) { return false; }
+	}
+	return true;
+}
+
+unsigned int Multiply::emit(Program& program) const { return emitOperands(program, Program::Opcode::Multiply); }
+
+void Multiply::encode(std::string& out) const { encodeOperands(out, SerializedExpression::Kind::Multiply); }
+
+Expression* Multiply::make(Expression *left, Expression *right) { return make(std::vector<Expression*>{ left, right }); }
+
+// Numbers sort first, so they are merged into a single leading coefficient which is dropped when it is 1
+Expression* Multiply::make(const std::vector<Expression*>& operands)
+{
+	Multiply* product = new Multiply(operands);
+	Operands& factors = product->operands;
+	while (factors.size() > 1 && asNumber(factors[0]) && asNumber(factors[1]))
+	{
+		Expression* merged = new Number(factors[0]->evaluate() * factors[1]->evaluate());
+		discard(factors[0]);
+		discard(factors[1]);
+		factors.erase(factors.begin());
+		factors[0] = merged;
+	}
+	if (factors.size() > 1 && asNumber(factors[0]))
+	{
+		if (factors[0]->evaluate() == 0)
+		{
+			discard(product);
+			return new Number(0);
+		}
+		else if (factors[0]->evaluate() == 1)
+		{
+			discard(factors[0]);
+			factors.erase(factors.begin());
+		}
+	}
+	return product->unwrap(1);
+}
+
+Expression* Multiply::differentiate(char diffOperator)
+{
+	std::vector<Expression*> terms;
+	for (size_t i = 0; i < operands.size(); ++i)
+	{
+		std::vector<Expression*> factors;
+		for (size_t j = 0; j < operands.size(); ++j) { factors.push_back(j == i ? derivativeOf(operands[j], diffOperator) : copyOf(operands[j])); }
+		terms.push_back(make(factors));
+	}
+	return Add::make(terms);
+}
+
+bool Multiply::isAtomic()
+{
+	for (Expression* operand : operands)
+	{
+		if (!operand->isAtomic() || operand->isConstant()) { return false; }
+	}
+	return true;
+}
+
+// Adjacent atomic factors are juxtaposed ("2x", "xy") unless both are constant; everything else is joined by " * "
+std::string Multiply::toString(bool showParentheses)
+{
+	std::string out;
+	for (size_t i = 0; i < operands.size(); ++i)
+	{
+		Expression* operand = operands[i];
+		bool parentheses = operand->precedence() < precedence() || (i > 0 && operand->precedence() == precedence() && !operand->isCommutative());
+		if (i > 0)
+		{
+			Expression* previous = operands[i - 1];
+			if (!previous->isAtomic() || !operand->isAtomic() || (previous->isConstant() && operand->isConstant())) { out += " * "; }
+		}
+		out += operand->toString(parentheses);
+	}
+	if (showParentheses) { out = "(" + out + ")"; }
+	return out;
+}
+
+unsigned char Multiply::precedence() { return 2; }
+
+
+Divide* Divide::copyTree() { return new Divide(leftOperand->copyTree(), rightOperand->copyTree()); }
+
+double Divide::evaluate() const { return leftOperand->evaluate() / rightOperand->evaluate(); }
+
+double Divide::evaluate(const Bindings& bindings) const { return leftOperand->evaluate(bindings) / rightOperand->evaluate(bindings); }
+
+Interval Divide::evaluateInterval(const std::map<char, Interval>& ranges) const
+{
+	return intervalDivide(leftOperand->evaluateInterval(ranges), rightOperand->evaluateInterval(ranges));
+}
+
+bool Divide::polynomialForm(char& var, bool expand, std::vector<double>& numerator, std::vector<double>& denominator) const
+{
+	std::vector<double> n;
+	std::vector<double> d;
+	if (!polynomialOf(leftOperand, var, expand, numerator, denominator) || !polynomialOf(rightOperand, var, expand, n, d)) { return false; }
+	if (termCount(n) == 0) { return false; }
+	if (!expand)
+	{
+		if (!isConstantPolynomial(n)) { return false; }
+		for (double& coefficient : numerator) { coefficient /= n[0]; }
+		return true;
+	}
+
+	numerator = multiplyPolynomials(numerator, d);
+	denominator = multiplyPolynomials(denominator, n);
+	return true;
+}
+
+unsigned int Divide::emit(Program& program) const { return emitOperands(program, Program::Opcode::Divide); }
+
+void Divide::encode(std::string& out) const { encodeOperands(out, SerializedExpression::Kind::Divide); }
+
+Expression* Divide::make(Expression *left, Expression *right)
+{
+	const Number* a = asNumber(left);
+	const Number* b = asNumber(right);
+	Expression* result;
+	if (a && b) { result = new Number(a->evaluate() / b->evaluate()); }
+	else if (a && a->evaluate() == 0) { result = new Number(0); }
+	else if (b && b->evaluate() == 1) { discard(right); return left; }
+	else { return new Divide(left, right); }
+
+	discard(left);
+	discard(right);
+	return result;
+}
+
+Expression* Divide::differentiate(char diffOperator)
+{
+	Expression *left = Multiply::make(derivativeOf(leftOperand, diffOperator), copyOf(rightOperand));
+	Expression *right = Multiply::make(copyOf(leftOperand), derivativeOf(rightOperand, diffOperator));
+	Expression *numerator = Subtract::make(left, right);
+	Expression *denominator = Exponent::make(copyOf(rightOperand), new Number(2));
+	return make(numerator, denominator);
+}
+
+std::string Divide::toString(bool showParentheses)
+{
+	std::string left, right;
+	toStringOperands(left, right);
+	if (showParentheses) { return "(" + left + " / " + right + ")"; }
+	else { return left + " / " + right; }
+}
+
+unsigned char Divide::precedence() { return 2; }
+
+bool Divide::isCommutative() const { return false; }
+
+
+Exponent* Exponent::copyTree() { return new Exponent(leftOperand->copyTree(), rightOperand->copyTree()); }
+
+// Constant indices that are whole or half-integers up to 32 in size are strength reduced: the whole part becomes
+// multiplications by repeated squaring, a half adds a square root and a negative index takes the reciprocal. These
+// cover the x^2 of collected products, the ^0.5 and ^-0.5 of sqrt and invsqrt and the ^-1 of sec, cot and the like
+struct ReducedPower
+{
+	unsigned int whole;
+	bool half;
+	bool reciprocal;
+};
+
+static bool reducePower(double index, ReducedPower& power)
+{
+	double magnitude = std::fabs(index);
+	double whole = std::floor(magnitude);
+	if (!(magnitude <= 32) || (magnitude != whole && magnitude - whole != 0.5)) { return false; }
+
+	power = { (unsigned int)whole, magnitude != whole, index < 0 };
+	return true;
+}
+
+static double power(double base, double index, bool constantIndex)
+{
+	ReducedPower reduced;
+	if (!constantIndex || !reducePower(index, reduced)) { return std::pow(base, index); }
+
+	double result = reduced.half ? std::sqrt(base) : 1;
+	double square = base;
+	for (unsigned int n = reduced.whole; n; n >>= 1)
+	{
+		if (n & 1) { result *= square; }
+		if (n > 1) { square *= square; }
+	}
+	if (!reduced.reciprocal) { return result; }
+
+	// x^n can overflow, or the quotient fall below the normal range, when x^-n itself is representable, as
+	// 1e10^-32 is; pow reaches those without the intermediate
+	double reciprocal = 1 / result;
+	return std::isnormal(reciprocal) ? reciprocal : std::pow(base, index);
+}
+
+// Powers of e take exp, which is closer than pow with e rounded to a double and, in fast batches, than fastPow's
+// exp(y ln x)
+static bool isEuler(Expression* expression) { return typeid(*expression) == typeid(Constant) && expression->evaluate() == M_E; }
+
+double Exponent::evaluate() const
+{
+	if (isEuler(leftOperand)) { return std::exp(rightOperand->evaluate()); }
+	return power(leftOperand->evaluate(), rightOperand->evaluate(), typeid(*rightOperand) == typeid(Number));
+}
+
+double Exponent::evaluate(const Bindings& bindings) const
+{
+	if (isEuler(leftOperand)) { return std::exp(rightOperand->evaluate(bindings)); }
+	return power(leftOperand->evaluate(bindings), rightOperand->evaluate(bindings), typeid(*rightOperand) == typeid(Number));
+}
+
+Interval Exponent::evaluateInterval(const std::map<char, Interval>& ranges) const
+{
+	return intervalPower(leftOperand->evaluateInterval(ranges), rightOperand->evaluateInterval(ranges));
+}
+
+bool Exponent::polynomialForm(char& var, bool expand, std::vector<double>& numerator, std::vector<double>& denominator) const
+{
+	if (typeid(*rightOperand) != typeid(Number)) { return false; }
+	double index = rightOperand->evaluate();
+	if (!isInteger(index) || std::fabs(index) > maxPolynomialDegree) { return false; }
+
+	std::vector<double> n;
+	std::vector<double> d;
+	if (!polynomialOf(leftOperand, var, expand, n, d)) { return false; }
+	if (!expand && (index < 0 || termCount(n) > 1)) { return false; }
+	if (index < 0)
+	{
+		if (termCount(n) == 0) { return false; }
+		std::swap(n, d);
+		index = -index;
+	}
+
+	numerator.assign(1, 1);
+	denominator.assign(1, 1);
+	for (int i = 0; i < (int)index; ++i)
+	{
+		numerator = multiplyPolynomials(numerator, n);
+		denominator = multiplyPolynomials(denominator, d);
+		if (numerator.size() > maxPolynomialDegree + 1 || denominator.size() > maxPolynomialDegree + 1) { return false; }
+	}
+	return true;
+}
+
+unsigned int Exponent::emit(Program& program) const
+{
+	if (isEuler(leftOperand)) { return program.emit(Program::Opcode::Exp, program.emitExpression(rightOperand)); }
+
+	ReducedPower power;
+	if (typeid(*rightOperand) != typeid(Number) || !reducePower(rightOperand->evaluate(), power)) { return emitOperands(program, Program::Opcode::Exponent); }
+
+	unsigned int base = program.emitExpression(leftOperand);
+	const unsigned int none = std::numeric_limits<unsigned int>::max();
+	unsigned int result = power.half ? program.emit(Program::Opcode::Sqrt, base) : none;
+	unsigned int square = base;
+	for (unsigned int n = power.whole; n; n >>= 1)
+	{
+		if (n & 1) { result = result == none ? square : program.emit(Program::Opcode::Multiply, result, square); }
+		if (n > 1) { square = program.emit(Program::Opcode::Multiply, square, square); }
+	}
+	if (result == none) { return program.emitConstant(1); }
+	return power.reciprocal ? program.emit(Program::Opcode::Divide, program.emitConstant(1), result) : result;
+}
+
+void Exponent::encode(std::string& out) const { encodeOperands(out, SerializedExpression::Kind::Exponent); }
+
+Expression* Exponent::make(Expression *left, Expression *right)
+{
+	const Number* a = asNumber(left);
+	const Number* b = asNumber(right);
+	Expression* result;
+	if (a && b) { result = new Number(std::pow(a->evaluate(), b->evaluate())); }
+	else if ((a && a->evaluate() == 1) || (b && b->evaluate() == 0)) { result = new Number(1); }
+	else if (b && b->evaluate() == 1) { discard(right); return left; }
+	else { return new Exponent(left, right); }
+
+	discard(left);
+	discard(right);
+	return result;
+}
+
+Expression* Exponent::differentiate(char diffOperator)
+{
+	bool constIndex = true;
+	if (!rightOperand->isConstant())
+	{
+		Expression* tmp = derivativeOf(rightOperand, diffOperator);
+		constIndex = tmp->isConstant() && tmp->evaluate() == 0;
+		discard(tmp);
+	}
+	if (constIndex)
+	{
+		Expression *index = Subtract::make(copyOf(rightOperand), new Number(1));
+		Expression *power = make(copyOf(leftOperand), index);
+		Expression *multiplicand = Multiply::make(copyOf(rightOperand), derivativeOf(leftOperand, diffOperator));
+		return Multiply::make(multiplicand, power);
+	}
+	else
+    {
+        bool constBase = true;
+        if (!leftOperand->isConstant())
+        {
+            Expression* tmp = derivativeOf(leftOperand, diffOperator);
+            constBase = tmp->isConstant() && tmp->evaluate() == 0;
+            discard(tmp);
+        }
+        
+        if (constBase)
+        {
+            Expression* power = make(copyOf(leftOperand), copyOf(rightOperand));
+            Expression *multiplicand = Multiply::make(new Log(new Constant('e'), copyOf(leftOperand)), derivativeOf(rightOperand, diffOperator));
+            return Multiply::make(multiplicand, power);
+        }
+        else
+        {
+            Expression* leftTop = Multiply::make(copyOf(rightOperand), derivativeOf(leftOperand, diffOperator));
+            Expression* left = Divide::make(leftTop, copyOf(leftOperand));
+            Expression* right = Multiply::make(derivativeOf(rightOperand, diffOperator), new Log(new Constant('e'), copyOf(leftOperand)));
+            Expression* inner = Add::make(left, right);
+            return Multiply::make(copyOf(this), inner);
+        }
+    }
+}
+
+std::string Exponent::toString(bool showParentheses)
+{
+	std::string left, right;
+	toStringOperands(left, right);
+	if (showParentheses) { return "(" + left + "^" + right + ")"; }
+	else { return left + "^" + right; }
+}
+
+unsigned char Exponent::precedence() { return 3; }
+
+bool Exponent::isCommutative() const { return false; }
+
+
+Log::Log(Expression *left, Expression *right) : Operator::Operator(left, right) { classifyBase(); }
+
+void Log::classifyBase()
+{
+    isNatural = is10 = false;
+    if (leftOperand->isConstant() && leftOperand->isAtomic() && leftOperand->evaluate() == 10) { is10 = true; }
+    else
+    {
+        Expression *tmp = derivativeOf(leftOperand, 'x');
+        if (tmp->isConstant() && leftOperand->isAtomic() && tmp->evaluate() == 0 && leftOperand->evaluate() == M_E) { isNatural = true; }
+        discard(tmp);
+    }
+}
+
+std::string Log::toString(bool showParentheses)
+{
+    std::string base;
+    if (isNatural) { base = "ln"; }
+    else
+    {
+        base = "log";
+        if (!is10) { base += "[" + leftOperand->toString() + "]"; }
+    }
+    
+    return base + "(" + rightOperand->toString() + ")";
+}
+
+Log* Log::copyTree() { return new Log(leftOperand->copyTree(), rightOperand->copyTree()); }
+
+double Log::evaluate() const
+{
+    if (isNatural) { return std::log(rightOperand->evaluate()); }
+    else if (is10) { return std::log10(rightOperand->evaluate()); }
+    else { return std::log(rightOperand->evaluate()) / std::log(leftOperand->evaluate()); }
+}
+
+double Log::evaluate(const Bindings& bindings) const
+{
+    if (isNatural) { return std::log(rightOperand->evaluate(bindings)); }
+    else if (is10) { return std::log10(rightOperand->evaluate(bindings)); }
+    else { return std::log(rightOperand->evaluate(bindings)) / std::log(leftOperand->evaluate(bindings)); }
+}
+
+Interval Log::evaluateInterval(const std::map<char, Interval>& ranges) const
+{
+    if (isNatural) { return intervalLog(rightOperand->evaluateInterval(ranges), naturalLog); }
+    else if (is10) { return intervalLog(rightOperand->evaluateInterval(ranges), std::log10); }
+    else { return intervalDivide(intervalLog(rightOperand->evaluateInterval(ranges), naturalLog), intervalLog(leftOperand->evaluateInterval(ranges), naturalLog)); }
+}
+
+unsigned int Log::emit(Program& program) const
+{
+    if (isNatural) { return program.emit(Program::Opcode::Ln, program.emitExpression(rightOperand)); }
+    else if (is10) { return program.emit(Program::Opcode::Log10, program.emitExpression(rightOperand)); }
+    else { return emitOperands(program, Program::Opcode::Log); }
+}
+
+void Log::encode(std::string& out) const
+{
+    encodeOperands(out, SerializedExpression::Kind::Log);
+    SerializedExpression::LogBase base = isNatural ? SerializedExpression::LogBase::Natural : is10 ? SerializedExpression::LogBase::Decimal : SerializedExpression::LogBase::General;
+    out.push_back((char)base);
+}
+
+Expression* Log::differentiate(char diffOperator)
+{
+    if (isNatural) { return Divide::make(derivativeOf(rightOperand, diffOperator), copyOf(rightOperand)); }
+    else
+    {
+        Expression* tmp = derivativeOf(leftOperand, diffOperator);
+        if (tmp->isConstant() && tmp->evaluate() == 0)
+        {
+            discard(tmp);
+            Expression* numerator = derivativeOf(rightOperand, diffOperator);
+            Expression* denominator = Multiply::make(copyOf(rightOperand), new Log(new Constant('e'), copyOf(leftOperand)));
+            return Divide::make(numerator, denominator);
+        }
+        discard(tmp);
+        
+        Expression* right = Multiply::make(copyOf(this), Divide::make(derivativeOf(leftOperand, diffOperator), copyOf(leftOperand)));
+        Expression* left = Divide::make(derivativeOf(rightOperand, diffOperator), copyOf(rightOperand));
+        Expression* inner = Subtract::make(left, right);
+        Expression* outer = Divide::make(new Number(1), new Log(new Constant('e'), copyOf(leftOperand)));
+        return Multiply::make(outer, inner);
+    }
+}
+
+unsigned char Log::precedence() { return 10; }
+bool Log::isCommutative() const { return false; }
+
+
+bool Number::operator== (const Expression &b)
+{
+	if (this == &b) { return true; }
+	if (hash() != b.hash()) { return false; }
+	if (typeid(*this) != typeid(b)) { return false; }
+	else
+	{
+		Number* bNumber = (Number*)&b;
+		return value == bNumber->value;
+	}
+}
+
+size_t Number::computeHash() const { return std::hash<double>()(value); }
+
+double Number::evaluate() const { return value; }
+
+double Number::evaluate(const Bindings& bindings) const { return value; }
+
+Interval Number::evaluateInterval(const std::map<char, Interval>& ranges) const { return { value, value }; }
+
+bool Number::polynomialForm(char& var, bool expand, std::vector<double>& numerator, std::vector<double>& denominator) const
+{
+	numerator.assign(1, value);
+	denominator.assign(1, 1);
+	return true;
+}
+
+unsigned int Number::emit(Program& program) const { return program.emitConstant(value); }
+
+void Number::encode(std::string& out) const
+{
+	SerializedExpression::encodeKind(out, SerializedExpression::Kind::Number);
+	SerializedExpression::encodeValue(out, value);
+}
+
+bool Number::isConstant() { return true; }
+
+Number::Number(double value) { this->value = value; }
+
+Number* Number::differentiate(char diffOperator) { return new Number(0); }
+
+Number* Number::copyTree() { return new Number(value); }
+
+std::string Number::toString(bool showParentheses)
+{
+	std::stringstream stream;
+	stream << value;
+	return stream.str();
+}
+
+void Number::substitute(const std::map<char, double>& varMap) {}
+
+bool Number::isAtomic() { return true; }
+
+unsigned char Number::precedence() { return 0; }
+
+
+bool Variable::operator== (const Expression &b)
+{
+	if (this == &b) { return true; }
+	if (hash() != b.hash()) { return false; }
+	if (typeid(*this) != typeid(b)) { return false; }
+	else
+	{
+		Variable* bVariable = (Variable*)&b;
+		return var == bVariable->var;
+	}
+}
+
+size_t Variable::computeHash() const { return (unsigned char)var; }
+
+double Variable::evaluate() const { return value; }
+
+double Variable::evaluate(const Bindings& bindings) const
+{
+	int slot = bindings.slot(var);
+	if (slot < 0) { return value; }
+	else { return bindings.value(slot); }
+}
+
+Interval Variable::evaluateInterval(const std::map<char, Interval>& ranges) const
+{
+	std::map<char, Interval>::const_iterator range = ranges.find(var);
+	if (range == ranges.end()) { return { value, value }; }
+	else { return range->second; }
+}
+
+bool Variable::polynomialForm(char& var, bool expand, std::vector<double>& numerator, std::vector<double>& denominator) const
+{
+	if (var && var != this->var) { return false; }
+	var = this->var;
+	numerator = { 0, 1 };
+	denominator.assign(1, 1);
+	return true;
+}
+
+unsigned int Variable::emit(Program& program) const { return program.emitVariable(var); }
+
+// Most variables are never substituted, so their value is only stored when it is not +0
+void Variable::encode(std::string& out) const
+{
+	bool substituted = value != 0 || std::signbit(value);
+	SerializedExpression::encodeKind(out, substituted ? SerializedExpression::Kind::SubstitutedVariable : SerializedExpression::Kind::Variable);
+	out.push_back(var);
+	if (substituted) { SerializedExpression::encodeValue(out, value); }
+}
+
+bool Variable::isConstant() { return false; }
+
+Variable::Variable(char var, double value)
+{
+	this->var = var;
+	this->value = value;
+}
+
+Variable::Variable(char var) : Variable::Variable(var, 0) {}
+
+Expression* Variable::differentiate(char diffOperator)
+{
+	if (diffOperator == var) { return new Number(1); }
+	else if (holdingOthersConstant) { return new Number(0); }
+	else { return new Differential(copyTree(), new Variable(diffOperator)); }
+}
+
+Variable* Variable::copyTree() { return new Variable(var, value); }
+
+std::string Variable::toString(bool showParentheses)
+{
+	std::stringstream stream;
+	stream << var;
+	return stream.str();
+}
+
+char Variable::charID() { return var; }
+
+bool Variable::isAtomic() { return true; }
+
+void Variable::substitute(const std::map<char, double>& varMap)
+{
+	if (varMap.find(var) != varMap.end())
+	{
+		value = varMap.at(var);
+	}
+}
+
+unsigned char Variable::precedence() { return 0; }
+
+
+Constant::Constant(char var, double value) : Variable::Variable(var, value)
+{
+    if (var == 'e')
+    {
+        this->value = M_E;
+    }
+}
+
+Constant::Constant(char var) : Constant::Constant(var, 0) {}
+
+Number* Constant::differentiate(char diffOperator) { return new Number(0); }
+
+Constant* Constant::copyTree() { return new Constant(var, value); }
+
+double Constant::evaluate(const Bindings& bindings) const { return value; }
+
+Interval Constant::evaluateInterval(const std::map<char, Interval>& ranges) const { return { value, value }; }
+
+bool Constant::polynomialForm(char& var, bool expand, std::vector<double>& numerator, std::vector<double>& denominator) const
+{
+	numerator.assign(1, value);
+	denominator.assign(1, 1);
+	return true;
+}
+
+unsigned int Constant::emit(Program& program) const { return program.emitConstant(value); }
+
+void Constant::encode(std::string& out) const
+{
+	SerializedExpression::encodeKind(out, SerializedExpression::Kind::Constant);
+	out.push_back(var);
+	SerializedExpression::encodeValue(out, value);
+}
+
+
+bool Func::operator== (const Expression &b)
+{
+	if (this == &b) { return true; }
+	if (hash() != b.hash()) { return false; }
+	if (typeid(*this) != typeid(b)) { return false; }
+	else
+	{
+		Func* bFunc = (Func*)&b;
+		return *operand == *bFunc->operand;
+	}
+}
+
+Func::Func(Expression *operand) { this->operand = operand; }
+
+size_t Func::computeHash() const { return operand->hash(); }
+
+Func::~Func() { delete operand; }
+
+bool Func::isConstant() { return operand->isConstant(); }
+
+bool Func::isAtomic() { return true; }
+
+void Func::substitute(const std::map<char, double>& varMap) { operand->substitute(varMap); }
+
+unsigned char Func::precedence() { return 4; }
+
+Expression* Func::getOperand() { return operand; }
+
+unsigned int Func::emitOperand(Program& program, Program::Opcode opcode) const { return program.emit(opcode, program.emitExpression(operand)); }
+
+void Func::encodeOperand(std::string& out, SerializedExpression::Kind kind) const
+{
+	operand->encode(out);
+	SerializedExpression::encodeKind(out, kind);
+}
+
+
+Sin* Sin::copyTree() { return new Sin(operand->copyTree()); }
+
+double Sin::evaluate() const { return std::sin(operand->evaluate()); }
+
+double Sin::evaluate(const Bindings& bindings) const { return std::sin(operand->evaluate(bindings)); }
+
+Interval Sin::evaluateInterval(const std::map<char, Interval>& ranges) const { return intervalPeriodic(operand->evaluateInterval(ranges), std::sin, pi / 2, -pi / 2); }
+
+unsigned int Sin::emit(Program& program) const { return emitOperand(program, Program::Opcode::Sin); }
+
+void Sin::encode(std::string& out) const { encodeOperand(out, SerializedExpression::Kind::Sin); }
+
+Expression* Sin::differentiate(char diffOperator)
+{
+	Expression* left = derivativeOf(operand, diffOperator);
+	Cos* right = new Cos(copyOf(operand));
+	return Multiply::make(left, right);
+}
+
+std::string Sin::toString(bool showParentheses) { return "sin(" + operand->toString() + ")"; }
+
+
+Cos* Cos::copyTree() { return new Cos(operand->copyTree()); }
+
+double Cos::evaluate() const { return std::cos(operand->evaluate()); }
+
+double Cos::evaluate(const Bindings& bindings) const { return std::cos(operand->evaluate(bindings)); }
+
+Interval Cos::evaluateInterval(const std::map<char, Interval>& ranges) const { return intervalPeriodic(operand->evaluateInterval(ranges), std::cos, 0, pi); }
+
+unsigned int Cos::emit(Program& program) const { return emitOperand(program, Program::Opcode::Cos); }
+
+void Cos::encode(std::string& out) const { encodeOperand(out, SerializedExpression::Kind::Cos); }
+
+Expression* Cos::differentiate(char diffOperator)
+{
+	Expression* left = Subtract::make(new Number(0), derivativeOf(operand, diffOperator));
+	Sin* right = new Sin(copyOf(operand));
+	return Multiply::make(left, right);
+}
+
+std::string Cos::toString(bool showParentheses) { return "cos(" + operand->toString() + ")"; }
+
+
+Tan* Tan::copyTree() { return new Tan(operand->copyTree()); }
+
+double Tan::evaluate() const { return std::tan(operand->evaluate()); }
+
+double Tan::evaluate(const Bindings& bindings) const { return std::tan(operand->evaluate(bindings)); }
+
+// Increasing between the asymptotes at pi / 2 + k * pi, and unbounded across any of them
+Interval Tan::evaluateInterval(const std::map<char, Interval>& ranges) const
+{
+    Interval x = operand->evaluateInterval(ranges);
+    if (isEmpty(x)) { return emptyInterval; }
+    if (!std::isfinite(x.lower) || !std::isfinite(x.upper) || x.upper - x.lower >= pi || containsPeriodicPoint(x, pi / 2, pi)) { return entireInterval; }
+    return intervalIncreasing(x, std::tan);
+}
+
+unsigned int Tan::emit(Program& program) const { return emitOperand(program, Program::Opcode::Tan); }
+
+void Tan::encode(std::string& out) const { encodeOperand(out, SerializedExpression::Kind::Tan); }
+
+Expression* Tan::differentiate(char diffOperator)
+{
+    Expression* left = derivativeOf(operand, diffOperator);
+    Exponent* right = new Exponent(new Cos(copyOf(operand)), new Number(-2));
+    return Multiply::make(left, right);
+}
+
+std::string Tan::toString(bool showParentheses) { return "tan(" + operand->toString() + ")"; }
+
+Sinh* Sinh::copyTree() { return new Sinh(operand->copyTree()); }
+
+double Sinh::evaluate() const { return std::sinh(operand->evaluate()); }
+
+double Sinh::evaluate(const Bindings& bindings) const { return std::sinh(operand->evaluate(bindings)); }
+
+Interval Sinh::evaluateInterval(const std::map<char, Interval>& ranges) const { return intervalIncreasing(operand->evaluateInterval(ranges), std::sinh); }
+
+unsigned int Sinh::emit(Program& program) const { return emitOperand(program, Program::Opcode::Sinh); }
+
+void Sinh::encode(std::string& out) const { encodeOperand(out, SerializedExpression::Kind::Sinh); }
+
+Expression* Sinh::differentiate(char diffOperator)
+{
+	Expression* left = derivativeOf(operand, diffOperator);
+	Cosh* right = new Cosh(copyOf(operand));
+	return Multiply::make(left, right);
+}
+
+std::string Sinh::toString(bool showParentheses) { return "sinh(" + operand->toString() + ")"; }
+
+Cosh* Cosh::copyTree() { return new Cosh(operand->copyTree()); }
+
+double Cosh::evaluate() const { return std::cosh(operand->evaluate()); }
+
+double Cosh::evaluate(const Bindings& bindings) const { return std::cosh(operand->evaluate(bindings)); }
+
+Interval Cosh::evaluateInterval(const std::map<char, Interval>& ranges) const
+{
+	Interval x = operand->evaluateInterval(ranges);
+	if (isEmpty(x)) { return emptyInterval; }
+	double a = std::cosh(x.lower);
+	double b = std::cosh(x.upper);
+	if (x.lower <= 0 && x.upper >= 0) { return { 1, roundUp(std::max(a, b)) }; }
+	return intervalClamp(outward(std::min(a, b), std::max(a, b)), 1, std::numeric_limits<double>::infinity());
+}
+
+unsigned int Cosh::emit(Program& program) const { return emitOperand(program, Program::Opcode::Cosh); }
+
+void Cosh::encode(std::string& out) const { encodeOperand(out, SerializedExpression::Kind::Cosh); }
+
+Expression* Cosh::differentiate(char diffOperator)
+{
+	Expression* left = derivativeOf(operand, diffOperator);
+	Sinh* right = new Sinh(copyOf(operand));
+	return Multiply::make(left, right);
+}
+
+std::string Cosh::toString(bool showParentheses) { return "cosh(" + operand->toString() + ")"; }
+
+Tanh* Tanh::copyTree() { return new Tanh(operand->copyTree()); }
+
+double Tanh::evaluate() const { return std::tanh(operand->evaluate()); }
+
+double Tanh::evaluate(const Bindings& bindings) const { return std::tanh(operand->evaluate(bindings)); }
+
+Interval Tanh::evaluateInterval(const std::map<char, Interval>& ranges) const { return intervalClamp(intervalIncreasing(operand->evaluateInterval(ranges), std::tanh), -1, 1); }
+
+unsigned int Tanh::emit(Program& program) const { return emitOperand(program, Program::Opcode::Tanh); }
+
+void Tanh::encode(std::string& out) const { encodeOperand(out, SerializedExpression::Kind::Tanh); }
+
+Expression* Tanh::differentiate(char diffOperator)
+{
+	Expression* left = derivativeOf(operand, diffOperator);
+	Exponent* right = new Exponent(new Cosh(copyOf(operand)), new Number(-2));
+	return Multiply::make(left, right);
+}
+
+std::string Tanh::toString(bool showParentheses) { return "tanh(" + operand->toString() + ")"; }
+
+Arcsin* Arcsin::copyTree() { return new Arcsin(operand->copyTree()); }
+
+double Arcsin::evaluate() const { return std::asin(operand->evaluate()); }
+
+double Arcsin::evaluate(const Bindings& bindings) const { return std::asin(operand->evaluate(bindings)); }
+
+Interval Arcsin::evaluateInterval(const std::map<char, Interval>& ranges) const { return intervalIncreasing(intervalIntersect(operand->evaluateInterval(ranges), -1, 1), std::asin); }
+
+unsigned int Arcsin::emit(Program& program) const { return emitOperand(program, Program::Opcode::Arcsin); }
+
+void Arcsin::encode(std::string& out) const { encodeOperand(out, SerializedExpression::Kind::Arcsin); }
+
+Expression* Arcsin::differentiate(char diffOperator)
+{
+	Expression* top = derivativeOf(operand, diffOperator);
+	Expression* bottomInner = Subtract::make(new Number(1), Exponent::make(copyOf(operand), new Number(2)));
+	Expression* bottom = Exponent::make(bottomInner, new Number(0.5));
+	return Divide::make(top, bottom);
+}
+
+std::string Arcsin::toString(bool showParentheses) { return "arcsin(" + operand->toString() + ")"; }
+
+Arccos* Arccos::copyTree() { return new Arccos(operand->copyTree()); }
+
+double Arccos::evaluate() const { return std::acos(operand->evaluate()); }
+
+double Arccos::evaluate(const Bindings& bindings) const { return std::acos(operand->evaluate(bindings)); }
+
+Interval Arccos::evaluateInterval(const std::map<char, Interval>& ranges) const
+{
+	Interval x = intervalIntersect(operand->evaluateInterval(ranges), -1, 1);
+	if (isEmpty(x)) { return emptyInterval; }
+	return intervalClamp(outward(std::acos(x.upper), std::acos(x.lower)), 0, std::numeric_limits<double>::infinity());
+}
+
+unsigned int Arccos::emit(Program& program) const { return emitOperand(program, Program::Opcode::Arccos); }
+
+void Arccos::encode(std::string& out) const { encodeOperand(out, SerializedExpression::Kind::Arccos); }
+
+Expression* Arccos::differentiate(char diffOperator)
+{
+	Expression* top = Multiply::make(new Number(-1), derivativeOf(operand, diffOperator));
+	Expression* bottomInner = Subtract::make(new Number(1), Exponent::make(copyOf(operand), new Number(2)));
+	Expression* bottom = Exponent::make(bottomInner, new Number(0.5));
+	return Divide::make(top, bottom);
+}
+
+std::string Arccos::toString(bool showParentheses) { return "arccos(" + operand->toString() + ")"; }
+
+Differential::Differential(Expression *left, Expression *right, unsigned char order) : Operator::Operator(left, right)
+{
+    this->order = order;
+}
+
+Differential* Differential::copyTree()
+{
+    return new Differential(leftOperand->copyTree(), rightOperand->copyTree(), order);
+}
+
+double Differential::evaluate() const { throw "Not implemented"; }
+
+double Differential::evaluate(const Bindings& bindings) const { throw "Not implemented"; }
+
+Interval Differential::evaluateInterval(const std::map<char, Interval>& ranges) const { throw "Not implemented"; }
+
+unsigned int Differential::emit(Program& program) const { throw "Not implemented"; }
+
+void Differential::encode(std::string& out) const
+{
+    encodeOperands(out, SerializedExpression::Kind::Differential);
+    out.push_back((char)order);
+}
+
+Expression* Differential::differentiate(char diffOperator)
+{
+    Expression* tmp = derivativeOf(rightOperand, diffOperator);
+    bool sameOperator = tmp->isConstant();
+    discard(tmp);
+    
+    if (sameOperator) { return new Differential(copyOf(leftOperand), copyOf(rightOperand), order + 1); }
+    else
+    {
+        Differential* rhs = new Differential(copyOf(rightOperand), new Variable(diffOperator));
+        Differential* lhs = new Differential(copyOf(leftOperand), copyOf(rightOperand), order + 1);
+        return new Multiply(lhs, rhs);
+    }
+}
+
+bool Differential::isCommutative() const { return false; }
+
+unsigned char Differential::getOrder() { return order; }
+
+unsigned char Differential::precedence() { return 2; }
+
+std::string Differential::toString(bool useParentheses)
+{
+    std::string top = "d";
+    if (order > 1) { top += "^" + std::to_string(order); }
+    top += leftOperand->toString();
+    
+    std::string bottom = "d" + rightOperand->toString();
+    if (order > 1) { bottom += "^" + std::to_string(order); }
+    
+    std::string str = top + "/" + bottom;
+    if (useParentheses){ str = "(" + str + ")"; }
+    return str;
+}
+
+SerializedExpression::SerializedExpression(const void* data, size_t size)
+{
+	records = (const unsigned char*)data;
+	length = size;
+
+	// Checked once here, so evaluation can trust the records: every payload lies inside the buffer and every
+	// operator finds its operands on the stack
+	size_t stack = 0;
+	const unsigned char* cursor = records;
+	const unsigned char* end = records + length;
+	while (cursor < end)
+	{
+		Kind kind = (Kind)*cursor++;
+		size_t operands = 0;
+		size_t payload = 0;
+		switch (kind)
+		{
+			case Kind::Number: payload = sizeof(double); break;
+			case Kind::Variable: payload = 1; break;
+			case Kind::SubstitutedVariable:
+			case Kind::Constant:
+				payload = 1 + sizeof(double);
+				break;
+			case Kind::Add:
+			case Kind::Multiply:
+			{
+				unsigned int shift = 0;
+				do
+				{
+					if (cursor == end || shift > 56) { throw "Invalid expression data"; }
+					operands |= (size_t)(*cursor & 0x7F) << shift;
+					shift += 7;
+				} while (*cursor++ & 0x80);
+				if (operands == 0) { throw "Invalid expression data"; }
+				break;
+			}
+			case Kind::Subtract:
+			case Kind::Divide:
+			case Kind::Exponent:
+				operands = 2;
+				break;
+			case Kind::Differential:
+				operands = 2;
+				payload = 1;
+				break;
+			case Kind::Log:
+				operands = 2;
+				payload = 1;
+				if (cursor < end && *cursor > (unsigned char)LogBase::Decimal) { throw "Invalid expression data"; }
+				break;
+			case Kind::Sin:
+			case Kind::Cos:
+			case Kind::Tan:
+			case Kind::Sinh:
+			case Kind::Cosh:
+			case Kind::Tanh:
+			case Kind::Arcsin:
+			case Kind::Arccos:
+				operands = 1;
+				break;
+			default: throw "Invalid expression data";
+		}
+
+		if ((size_t)(end - cursor) < payload || stack < operands) { throw "Invalid expression data"; }
+		cursor += payload;
+		stack = stack - operands + 1;
+		depth = std::max(depth, stack);
+		++nodes;
+	}
+	if (stack != 1) { throw "Invalid expression data"; }
+}
+
+static double decodeValue(const unsigned char*& cursor)
+{
+	double value;
+	std::memcpy(&value, cursor, sizeof(double));
+	cursor += sizeof(double);
+	return value;
+}
+
+static size_t decodeCount(const unsigned char*& cursor)
+{
+	size_t count = 0;
+	unsigned int shift = 0;
+	do
+	{
+		count |= (size_t)(*cursor & 0x7F) << shift;
+		shift += 7;
+	} while (*cursor++ & 0x80);
+	return count;
+}
+
+double SerializedExpression::evaluate() const { return execute(nullptr); }
+
+double SerializedExpression::evaluate(const Bindings& bindings) const { return execute(&bindings); }
+
+// Mirrors the nodes' own evaluate(), down to the order operands are combined in, so results match the tree's exactly
+double SerializedExpression::execute(const Bindings* bindings) const
+{
+	double localStack[64];
+	std::vector<double> heapStack;
+	double* stack = localStack;
+	if (depth > 64)
+	{
+		heapStack.resize(depth);
+		stack = heapStack.data();
+	}
+
+	size_t top = 0;
+	Kind previous = Kind::Variable;
+	const unsigned char* cursor = records;
+	const unsigned char* end = records + length;
+	while (cursor < end)
+	{
+		Kind kind = (Kind)*cursor++;
+		switch (kind)
+		{
+			case Kind::Number: stack[top++] = decodeValue(cursor); break;
+			case Kind::Variable:
+			case Kind::SubstitutedVariable:
+			{
+				char var = (char)*cursor++;
+				double value = kind == Kind::SubstitutedVariable ? decodeValue(cursor) : 0;
+				int slot = bindings ? bindings->slot(var) : -1;
+				stack[top++] = slot < 0 ? value : bindings->value(slot);
+				break;
+			}
+			case Kind::Constant:
+				++cursor;
+				stack[top++] = decodeValue(cursor);
+				break;
+			case Kind::Add:
+			case Kind::Multiply:
+			{
+				size_t count = decodeCount(cursor);
+				top -= count;
+				double result = stack[top];
+				for (size_t i = 1; i < count; ++i)
+				{
+					if (kind == Kind::Add) { result += stack[top + i]; }
+					else { result *= stack[top + i]; }
+				}
+				stack[top++] = result;
+				break;
+			}
+			case Kind::Subtract: --top; stack[top - 1] -= stack[top]; break;
+			case Kind::Divide: --top; stack[top - 1] /= stack[top]; break;
+			case Kind::Exponent: --top; stack[top - 1] = power(stack[top - 1], stack[top], previous == Kind::Number); break;
+			case Kind::Differential: throw "Not implemented";
+			case Kind::Log:
+			{
+				LogBase base = (LogBase)*cursor++;
+				--top;
+				if (base == LogBase::Natural) { stack[top - 1] = std::log(stack[top]); }
+				else if (base == LogBase::Decimal) { stack[top - 1] = std::log10(stack[top]); }
+				else { stack[top - 1] = std::log(stack[top]) / std::log(stack[top - 1]); }
+				break;
+			}
+			case Kind::Sin: stack[top - 1] = std::sin(stack[top - 1]); break;
+			case Kind::Cos: stack[top - 1] = std::cos(stack[top - 1]); break;
+			case Kind::Tan: stack[top - 1] = std::tan(stack[top - 1]); break;
+			case Kind::Sinh: stack[top - 1] = std::sinh(stack[top - 1]); break;
+			case Kind::Cosh: stack[top - 1] = std::cosh(stack[top - 1]); break;
+			case Kind::Tanh: stack[top - 1] = std::tanh(stack[top - 1]); break;
+			case Kind::Arcsin: stack[top - 1] = std::asin(stack[top - 1]); break;
+			case Kind::Arccos: stack[top - 1] = std::acos(stack[top - 1]); break;
+		}
+		previous = kind;
+	}
+	return stack[top - 1];
+}
+
+Expression* SerializedExpression::materialise() const
+{
+	std::vector<Expression*> stack;
+	stack.reserve(depth);
+	auto pop = [&]()
+	{
+		Expression* top = stack.back();
+		stack.pop_back();
+		return top;
+	};
+
+	const unsigned char* cursor = records;
+	const unsigned char* end = records + length;
+	while (cursor < end)
+	{
+		Kind kind = (Kind)*cursor++;
+		Expression* right = nullptr;
+		switch (kind)
+		{
+			case Kind::Number: stack.push_back(new Number(decodeValue(cursor))); break;
+			case Kind::Variable: stack.push_back(new Variable((char)*cursor++)); break;
+			case Kind::SubstitutedVariable:
+			case Kind::Constant:
+			{
+				char var = (char)*cursor++;
+				double value = decodeValue(cursor);
+				if (kind == Kind::Constant) { stack.push_back(new Constant(var, value)); }
+				else { stack.push_back(new Variable(var, value)); }
+				break;
+			}
+			case Kind::Add:
+			case Kind::Multiply:
+			{
+				size_t count = decodeCount(cursor);
+				std::vector<Expression*> operands(stack.end() - count, stack.end());
+				stack.resize(stack.size() - count);
+				if (kind == Kind::Add) { stack.push_back(new Add(operands)); }
+				else { stack.push_back(new Multiply(operands)); }
+				break;
+			}
+			case Kind::Subtract: right = pop(); stack.push_back(new Subtract(pop(), right)); break;
+			case Kind::Divide: right = pop(); stack.push_back(new Divide(pop(), right)); break;
+			case Kind::Exponent: right = pop(); stack.push_back(new Exponent(pop(), right)); break;
+			case Kind::Differential: right = pop(); stack.push_back(new Differential(pop(), right, *cursor++)); break;
+			case Kind::Log:
+				// The base is classified again from the operand, as the node's constructor always does
+				++cursor;
+				right = pop();
+				stack.push_back(new Log(pop(), right));
+				break;
+			case Kind::Sin: stack.push_back(new Sin(pop())); break;
+			case Kind::Cos: stack.push_back(new Cos(pop())); break;
+			case Kind::Tan: stack.push_back(new Tan(pop())); break;
+			case Kind::Sinh: stack.push_back(new Sinh(pop())); break;
+			case Kind::Cosh: stack.push_back(new Cosh(pop())); break;
+			case Kind::Tanh: stack.push_back(new Tanh(pop())); break;
+			case Kind::Arcsin: stack.push_back(new Arcsin(pop())); break;
+			case Kind::Arccos: stack.push_back(new Arccos(pop())); break;
+		}
+	}
+	return stack[0];
+}
+
+const unsigned char* SerializedExpression::data() const { return records; }
+
+size_t SerializedExpression::size() const { return length; }
+
+size_t SerializedExpression::nodeCount() const { return nodes; }
+
+void SerializedExpression::encodeKind(std::string& out, Kind kind) { out.push_back((char)kind); }
+
+void SerializedExpression::encodeValue(std::string& out, double value)
+{
+	char raw[sizeof(double)];
+	std::memcpy(raw, &value, sizeof(double));
+	out.append(raw, sizeof(double));
+}
+
+// Seven bits at a time, low bits first, with the top bit set on every byte but the last
+void SerializedExpression::encodeCount(std::string& out, size_t count)
+{
+	for (; count >= 0x80; count >>= 7) { out.push_back((char)((count & 0x7F) | 0x80)); }
+	out.push_back((char)count);
+}
+
+// Header: magic, version, byte order mark, expression count and padding to 16 bytes; then count + 1 offsets
+// from the start of the file, the last marking the end of the final expression
+static const char fileMagic[4] = { 'Q', 'M', 'X', 'B' };
+static const unsigned short byteOrderMark = 0x0102;
+static const size_t fileHeaderSize = 16;
+
+ExpressionFile::ExpressionFile(const std::string& path)
+{
+#ifdef QMATH_MMAP
+	int descriptor = open(path.c_str(), O_RDONLY);
+	if (descriptor < 0) { throw "Could not open file"; }
+	struct stat status;
+	if (fstat(descriptor, &status) != 0)
+	{
+		close(descriptor);
+		throw "Could not open file";
+	}
+
+	length = (size_t)status.st_size;
+	void* memory = length ? mmap(nullptr, length, PROT_READ, MAP_PRIVATE, descriptor, 0) : MAP_FAILED;
+	close(descriptor);
+	if (memory == MAP_FAILED) { throw "Could not open file"; }
+	mapping = memory;
+	base = (const unsigned char*)memory;
+#else
+	std::ifstream file(path, std::ios::binary);
+	if (!file) { throw "Could not open file"; }
+	buffer.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+	base = buffer.data();
+	length = buffer.size();
+#endif
+
+	try { readHeader(); }
+	catch (...)
+	{
+#ifdef QMATH_MMAP
+		munmap(mapping, length);
+#endif
+		throw;
+	}
+}
+
+ExpressionFile::ExpressionFile(const void* data, size_t size)
+{
+	base = (const unsigned char*)data;
+	length = size;
+	readHeader();
+}
+
+ExpressionFile::~ExpressionFile()
+{
+#ifdef QMATH_MMAP
+	if (mapping) { munmap(mapping, length); }
+#endif
+}
+
+void ExpressionFile::readHeader()
+{
+	unsigned short version;
+	unsigned short order;
+	unsigned int expressions;
+	if (length < fileHeaderSize || std::memcmp(base, fileMagic, sizeof(fileMagic)) != 0) { throw "Invalid expression data"; }
+	std::memcpy(&version, base + 4, sizeof(version));
+	std::memcpy(&order, base + 6, sizeof(order));
+	std::memcpy(&expressions, base + 8, sizeof(expressions));
+	if (version != formatVersion) { throw "Unsupported format version"; }
+	if (order != byteOrderMark) { throw "Unsupported byte order"; }
+
+	size_t table = fileHeaderSize + ((size_t)expressions + 1) * sizeof(unsigned long long);
+	if (length < table) { throw "Invalid expression data"; }
+
+	// Each expression's records are validated here, once, and operator[] hands out the checked views
+	unsigned long long previous;
+	std::memcpy(&previous, base + fileHeaderSize, sizeof(previous));
+	if (previous < table || previous > length) { throw "Invalid expression data"; }
+	entries.reserve(expressions);
+	for (size_t i = 1; i <= expressions; ++i)
+	{
+		unsigned long long offset;
+		std::memcpy(&offset, base + fileHeaderSize + i * sizeof(offset), sizeof(offset));
+		if (offset < previous || offset > length) { throw "Invalid expression data"; }
+		entries.push_back(SerializedExpression(base + previous, (size_t)(offset - previous)));
+		previous = offset;
+	}
+}
+
+size_t ExpressionFile::size() const { return entries.size(); }
+
+SerializedExpression ExpressionFile::operator[] (size_t index) const
+{
+	if (index >= entries.size()) { throw "Expression index out of range"; }
+	return entries[index];
+}
+
+std::string ExpressionFile::encode(const std::vector<Expression*>& expressions)
+{
+	std::string out(fileMagic, sizeof(fileMagic));
+	unsigned short version = formatVersion;
+	unsigned int expressionCount = (unsigned int)expressions.size();
+	unsigned int padding = 0;
+	out.append((const char*)&version, sizeof(version));
+	out.append((const char*)&byteOrderMark, sizeof(byteOrderMark));
+	out.append((const char*)&expressionCount, sizeof(expressionCount));
+	out.append((const char*)&padding, sizeof(padding));
+
+	size_t table = out.size();
+	out.resize(table + (expressions.size() + 1) * sizeof(unsigned long long));
+	for (size_t i = 0; i <= expressions.size(); ++i)
+	{
+		unsigned long long offset = out.size();
+		std::memcpy(&out[table + i * sizeof(offset)], &offset, sizeof(offset));
+		if (i < expressions.size()) { expressions[i]->encode(out); }
+	}
+	return out;
+}
+
+void ExpressionFile::write(const std::string& path, const std::vector<Expression*>& expressions)
+{
+	std::string image = encode(expressions);
+	std::ofstream file(path, std::ios::binary | std::ios::trunc);
+	if (!file.write(image.data(), image.size()) || !file.flush()) { throw "Could not write file"; }
+}
+
+std::string Expression::serialize() const
+{
+	std::vector<Expression*> expressions(1, const_cast<Expression*>(this));
+	return ExpressionFile::encode(expressions);
+}
+
+Expression* Expression::deserialize(const std::string& data)
+{
+	ExpressionFile file(data.data(), data.size());
+	if (file.size() != 1) { throw "Invalid expression data"; }
+	return file[0].materialise();
+}
+
+// Rules are tried in table order against each node once its operands have been rewritten; the first match
+// replaces the node and matching restarts on the replacement, so every rule may assume reduced operands
+const Simplifier::Rule Simplifier::rules[] =
+{
+	{ "fold-constant", nullptr, &Simplifier::foldConstant },
+	{ "add-constants", &typeid(Add), &Simplifier::combineLiterals },
+	{ "add-zero", &typeid(Add), &Simplifier::removeIdentity },
+	{ "add-collect", &typeid(Add), &Simplifier::addCollect },
+	{ "add-factorise", &typeid(Add), &Simplifier::addFactorise },
+	{ "subtract-zero", &typeid(Subtract), &Simplifier::subtractZero },
+	{ "subtract-same", &typeid(Subtract), &Simplifier::subtractSame },
+	{ "subtract-factorise", &typeid(Subtract), &Simplifier::factoriseLinear },
+	{ "multiply-zero", &typeid(Multiply), &Simplifier::multiplyZero },
+	{ "multiply-constants", &typeid(Multiply), &Simplifier::combineLiterals },
+	{ "multiply-one", &typeid(Multiply), &Simplifier::removeIdentity },
+	{ "multiply-collect", &typeid(Multiply), &Simplifier::multiplyCollect },
+	{ "divide-zero", &typeid(Divide), &Simplifier::divideZero },
+	{ "divide-one", &typeid(Divide), &Simplifier::divideOne },
+	{ "divide-same", &typeid(Divide), &Simplifier::divideSame },
+	{ "divide-indices", &typeid(Divide), &Simplifier::accumulateExponentIndicies },
+	{ "exponent-base", &typeid(Exponent), &Simplifier::exponentBase },
+	{ "exponent-index", &typeid(Exponent), &Simplifier::exponentIndex },
+	{ "exponent-nested", &typeid(Exponent), &Simplifier::exponentNested },
+	{ "exponent-log", &typeid(Exponent), &Simplifier::exponentLog },
+	{ "log-same", &typeid(Log), &Simplifier::logSame },
+	{ "log-exponent", &typeid(Log), &Simplifier::logExponent },
+};
+
+const size_t Simplifier::ruleCount = sizeof(rules) / sizeof(rules[0]);
+
+static Expression* take(Expression*& operand)
+{
+	Expression* result = operand;
+	operand = nullptr;
+	return result;
+}
+
+// Named constants stay symbolic; only numbers, and functions of them, fold into their parent
+static bool isLiteral(Expression* expression)
+{
+	if (Func* func = dynamic_cast<Func*>(expression)) { return isLiteral(func->getOperand()); }
+	return typeid(*expression) == typeid(Number);
+}
+
+static bool isValue(Expression* expression, double value) { return isLiteral(expression) && expression->evaluate() == value; }
+
+Simplifier::Simplifier(unsigned int maxPasses) : hits(ruleCount, 0), maxPasses(maxPasses) {}
+
+Expression* Simplifier::simplify(Expression* expression)
+{
+	passCount = 0;
+	do
+	{
+		changed = false;
+		expression = rewrite(expression);
+		++passCount;
+	} while (changed && passCount < maxPasses);
+
+	return expression;
+}
+
+std::vector<Simplifier::Statistic> Simplifier::statistics() const
+{
+	std::vector<Statistic> result;
+	for (size_t i = 0; i < ruleCount; ++i) { result.push_back({ rules[i].name, hits[i] }); }
+	return result;
+}
+
+unsigned int Simplifier::passes() const { return passCount; }
+
+Expression* Simplifier::rewrite(Expression* node)
+{
+	if (Operator* op = dynamic_cast<Operator*>(node))
+	{
+		Expression* base = op->leftOperand;
+		op->leftOperand = rewrite(op->leftOperand);
+		op->rightOperand = rewrite(op->rightOperand);
+		if (op->leftOperand != base && typeid(*op) == typeid(Log)) { ((Log*)op)->classifyBase(); }
+	}
+	else if (NaryOperator* nary = dynamic_cast<NaryOperator*>(node))
+	{
+		bool moved = false;
+		for (Expression*& operand : nary->operands)
+		{
+			Expression* rewritten = rewrite(operand);
+			moved |= rewritten != operand;
+			operand = rewritten;
+		}
+		if (moved) { nary->canonicalise(); }
+	}
+	else if (Func* func = dynamic_cast<Func*>(node)) { func->operand = rewrite(func->operand); }
+
+	// Operands are rewritten in place, so a hash cached before this pass may no longer describe the node
+	node->invalidateHash();
+	return reduce(node);
+}
+
+Expression* Simplifier::reduce(Expression* node)
+{
+	size_t i = 0;
+	while (i < ruleCount)
+	{
+		if (!rules[i].type || *rules[i].type == typeid(*node))
+		{
+			if (Expression* result = (this->*rules[i].apply)(node))
+			{
+				++hits[i];
+				changed = true;
+				node = result;
+				i = 0;
+				continue;
+			}
+		}
+		++i;
+	}
+
+	return node;
+}
+
+Expression* Simplifier::foldConstant(Expression* node)
+{
+	if (NaryOperator* nary = dynamic_cast<NaryOperator*>(node))
+	{
+		for (Expression* operand : nary->operands)
+		{
+			if (!isLiteral(operand)) { return nullptr; }
+		}
+	}
+	else
+	{
+		Operator* op = dynamic_cast<Operator*>(node);
+		if (!op || typeid(*op) == typeid(Differential) || !isLiteral(op->leftOperand) || !isLiteral(op->rightOperand)) { return nullptr; }
+	}
+
+	Expression* result = new Number(node->evaluate());
+	delete node;
+	return result;
+}
+
+Expression* Simplifier::subtractZero(Expression* node)
+{
+	Operator* op = (Operator*)node;
+	Expression* result;
+	if (isValue(op->rightOperand, 0)) { result = take(op->leftOperand); }
+	else if (isValue(op->leftOperand, 0)) { result = reduce(new Multiply(new Number(-1), take(op->rightOperand))); }
+	else { return nullptr; }
+
+	delete node;
+	return result;
+}
+
+Expression* Simplifier::subtractSame(Expression* node)
+{
+	Operator* op = (Operator*)node;
+	if (!(*op->leftOperand == *op->rightOperand)) { return nullptr; }
+
+	delete node;
+	return new Number(0);
+}
+
+// Merges the literal operands of a sum or product into one number
+Expression* Simplifier::combineLiterals(Expression* node)
+{
+	NaryOperator* nary = (NaryOperator*)node;
+	bool sum = typeid(*node) == typeid(Add);
+	size_t literals = 0;
+	for (Expression* operand : nary->operands) { literals += isLiteral(operand); }
+	if (literals < 2) { return nullptr; }
+
+	double value = sum ? 0 : 1;
+	NaryOperator::Operands remaining;
+	for (Expression* operand : nary->operands)
+	{
+		if (!isLiteral(operand)) { remaining.push_back(operand); }
+		else
+		{
+			value = sum ? value + operand->evaluate() : value * operand->evaluate();
+			delete operand;
+		}
+	}
+	nary->operands.swap(remaining);
+	nary->insert(new Number(value));
+	return node;
+}
+
+Expression* Simplifier::removeIdentity(Expression* node)
+{
+	NaryOperator* nary = (NaryOperator*)node;
+	double identity = typeid(*node) == typeid(Add) ? 0 : 1;
+	NaryOperator::Operands remaining;
+	for (Expression* operand : nary->operands)
+	{
+		if (!isValue(operand, identity)) { remaining.push_back(operand); }
+	}
+	if (remaining.size() == nary->operands.size()) { return nullptr; }
+
+	for (Expression* operand : nary->operands)
+	{
+		if (isValue(operand, identity)) { delete operand; }
+	}
+	nary->operands.swap(remaining);
+	return nary->unwrap(identity);
+}
+
+// A term of a sum seen as a numeric coefficient times a run of factors: the operands of a product after its
+// leading number, or the term itself
+struct CollectedTerm
+{
+	double coefficient;
+	Expression* term;
+	size_t start;
+	size_t count;
+
+	Expression* factor(size_t i) const { return typeid(*term) == typeid(Multiply) ? ((Multiply*)term)->getOperands()[start + i] : term; }
+};
+
+static CollectedTerm collectedTerm(Expression* term)
+{
+	CollectedTerm result = { 1, term, 0, 1 };
+	if (typeid(*term) == typeid(Multiply))
+	{
+		const NaryOperator::Operands& factors = ((Multiply*)term)->getOperands();
+		if (asNumber(factors[0]))
+		{
+			result.coefficient = factors[0]->evaluate();
+			result.start = 1;
+		}
+		result.count = factors.size() - result.start;
+	}
+	return result;
+}
+
+static int compareTerms(const CollectedTerm& a, const CollectedTerm& b)
+{
+	for (size_t i = 0; i < a.count && i < b.count; ++i)
+	{
+		int result = NaryOperator::compare(a.factor(i), b.factor(i));
+		if (result != 0) { return result; }
+	}
+	if (a.count != b.count) { return a.count < b.count ? -1 : 1; }
+	return 0;
+}
+
+// Sorts the terms by their factors so like terms become adjacent, then replaces each run by one term
+// carrying the summed coefficient
+Expression* Simplifier::addCollect(Expression* node)
+{
+	NaryOperator* sum = (NaryOperator*)node;
+	std::vector<Expression*> collected;
+	std::vector<CollectedTerm> terms;
+	for (Expression* operand : sum->operands)
+	{
+		if (asNumber(operand)) { collected.push_back(operand); }
+		else { terms.push_back(collectedTerm(operand)); }
+	}
+	std::stable_sort(terms.begin(), terms.end(), [](const CollectedTerm& a, const CollectedTerm& b) { return compareTerms(a, b) < 0; });
+
+	bool like = false;
+	for (size_t i = 1; i < terms.size() && !like; ++i) { like = compareTerms(terms[i - 1], terms[i]) == 0; }
+	if (!like) { return nullptr; }
+
+	size_t first = 0;
+	while (first < terms.size())
+	{
+		size_t last = first + 1;
+		double coefficient = terms[first].coefficient;
+		while (last < terms.size() && compareTerms(terms[first], terms[last]) == 0) { coefficient += terms[last++].coefficient; }
+
+		if (last - first == 1) { collected.push_back(terms[first].term); }
+		else
+		{
+			for (size_t i = first + 1; i < last; ++i) { delete terms[i].term; }
+
+			std::vector<Expression*> factors;
+			Expression* term = terms[first].term;
+			if (typeid(*term) == typeid(Multiply))
+			{
+				NaryOperator::Operands& operands = ((Multiply*)term)->operands;
+				factors.assign(operands.begin() + terms[first].start, operands.end());
+				operands.erase(operands.begin() + terms[first].start, operands.end());
+				delete term;
+			}
+			else { factors.push_back(term); }
+
+			if (coefficient == 0)
+			{
+				for (Expression* factor : factors) { delete factor; }
+			}
+			else
+			{
+				if (coefficient != 1) { factors.push_back(new Number(coefficient)); }
+				collected.push_back(factors.size() == 1 ? factors[0] : reduce(new Multiply(factors)));
+			}
+		}
+		first = last;
+	}
+
+	sum->operands.clear();
+	delete node;
+	if (collected.empty()) { return new Number(0); }
+	return collected.size() == 1 ? collected[0] : reduce(new Add(collected));
+}
+
+// Pulls a factor shared by several terms of a sum out in front of them, the n-ary form of factoriseLinear:
+// x*y + x*z + w becomes x*(y + z) + w. A term that is not a product takes part as a product of one factor, and
+// numbers are left for add-collect to combine
+Expression* Simplifier::addFactorise(Expression* node)
+{
+	NaryOperator* sum = (NaryOperator*)node;
+	NaryOperator::Operands& terms = sum->operands;
+	const size_t absent = (size_t)-1;
+	auto factorCount = [](Expression* term) -> size_t { return typeid(*term) == typeid(Multiply) ? ((Multiply*)term)->operands.size() : 1; };
+	auto factor = [](Expression* term, size_t i) -> Expression* { return typeid(*term) == typeid(Multiply) ? ((Multiply*)term)->operands[i] : term; };
+
+	for (size_t i = 0; i < terms.size(); ++i)
+	{
+		for (size_t k = 0; k < factorCount(terms[i]); ++k)
+		{
+			Expression* common = factor(terms[i], k);
+			if (asNumber(common)) { continue; }
+
+			std::vector<size_t> sharing(terms.size(), absent);
+			sharing[i] = k;
+			size_t count = 1;
+			for (size_t j = i + 1; j < terms.size(); ++j)
+			{
+				for (size_t l = 0; l < factorCount(terms[j]) && sharing[j] == absent; ++l)
+				{
+					if (*factor(terms[j], l) == *common) { sharing[j] = l; }
+				}
+				count += sharing[j] != absent;
+			}
+			if (count < 2) { continue; }
+
+			std::vector<Expression*> remainders;
+			std::vector<Expression*> rest;
+			for (size_t j = 0; j < terms.size(); ++j)
+			{
+				Expression* term = terms[j];
+				if (sharing[j] == absent)
+				{
+					rest.push_back(term);
+					continue;
+				}
+
+				Expression* shared = factor(term, sharing[j]);
+				if (typeid(*term) != typeid(Multiply)) { remainders.push_back(new Number(1)); }
+				else
+				{
+					Multiply* product = (Multiply*)term;
+					product->operands.erase(product->operands.begin() + sharing[j]);
+					remainders.push_back(product->unwrap(1));
+				}
+				if (shared != common) { delete shared; }
+			}
+
+			terms.clear();
+			delete node;
+			rest.push_back(reduce(new Multiply(reduce(new Add(remainders)), common)));
+			return rest.size() == 1 ? rest[0] : reduce(new Add(rest));
+		}
+	}
+
+	return nullptr;
+}
+
+Expression* Simplifier::factoriseLinear(Expression* node)
+{
+	Operator* op = (Operator*)node;
+	Multiply* left = typeid(*op->leftOperand) == typeid(Multiply) ? (Multiply*)op->leftOperand : nullptr;
+	Multiply* right = typeid(*op->rightOperand) == typeid(Multiply) ? (Multiply*)op->rightOperand : nullptr;
+	if (!left && !right) { return nullptr; }
+
+	// A lone operand takes part as a product of one factor; removing it leaves 1
+	auto remainder = [](Expression*& operand, size_t i) -> Expression*
+	{
+		Expression* factor = operand;
+		operand = nullptr;
+		if (typeid(*factor) != typeid(Multiply)) { return new Number(1); }
+
+		Multiply* product = (Multiply*)factor;
+		product->operands.erase(product->operands.begin() + i);
+		return product->unwrap(1);
+	};
+
+	size_t leftCount = left ? left->operands.size() : 1;
+	size_t rightCount = right ? right->operands.size() : 1;
+	for (size_t i = 0; i < leftCount; i++)
+	{
+		Expression* leftFactor = left ? left->operands[i] : op->leftOperand;
+		for (size_t j = 0; j < rightCount; j++)
+		{
+			Expression* rightFactor = right ? right->operands[j] : op->rightOperand;
+			if (*leftFactor == *rightFactor)
+			{
+				Expression* leftRest = remainder(op->leftOperand, i);
+				Expression* rightRest = remainder(op->rightOperand, j);
+				delete rightFactor;
+				delete node;
+				return reduce(new Multiply(reduce(new Subtract(leftRest, rightRest)), leftFactor));
+			}
+		}
+	}
+
+	return nullptr;
+}
+
+Expression* Simplifier::multiplyZero(Expression* node)
+{
+	NaryOperator* product = (NaryOperator*)node;
+	for (Expression* operand : product->operands)
+	{
+		if (isValue(operand, 0))
+		{
+			delete node;
+			return new Number(0);
+		}
+	}
+	return nullptr;
+}
+
+// Sorts the factors of a product by base so powers of the same base become adjacent, then replaces each run by
+// the base raised to the sum of the indices; a factor that is not a power counts as its own base raised to 1
+Expression* Simplifier::multiplyCollect(Expression* node)
+{
+	NaryOperator* product = (NaryOperator*)node;
+	std::vector<Expression*> collected;
+	std::vector<std::pair<Expression*, Expression*>> powers;
+	for (Expression* operand : product->operands)
+	{
+		if (isLiteral(operand)) { collected.push_back(operand); }
+		else { powers.push_back(std::make_pair(typeid(*operand) == typeid(Exponent) ? ((Exponent*)operand)->leftOperand : operand, operand)); }
+	}
+	std::stable_sort(powers.begin(), powers.end(),
+		[](const std::pair<Expression*, Expression*>& a, const std::pair<Expression*, Expression*>& b) { return NaryOperator::compare(a.first, b.first) < 0; });
+
+	bool like = false;
+	for (size_t i = 1; i < powers.size() && !like; ++i) { like = NaryOperator::compare(powers[i - 1].first, powers[i].first) == 0; }
+	if (!like) { return nullptr; }
+
+	size_t first = 0;
+	while (first < powers.size())
+	{
+		size_t last = first + 1;
+		while (last < powers.size() && NaryOperator::compare(powers[first].first, powers[last].first) == 0) { ++last; }
+
+		if (last - first == 1) { collected.push_back(powers[first].second); }
+		else
+		{
+			Expression* base = nullptr;
+			std::vector<Expression*> indices;
+			for (size_t i = first; i < last; ++i)
+			{
+				Expression* factor = powers[i].second;
+				if (typeid(*factor) != typeid(Exponent))
+				{
+					indices.push_back(new Number(1));
+					if (!base) { base = factor; }
+					else { delete factor; }
+				}
+				else
+				{
+					Exponent* power = (Exponent*)factor;
+					indices.push_back(take(power->rightOperand));
+					if (!base) { base = take(power->leftOperand); }
+					delete power;
+				}
+			}
+			collected.push_back(reduce(new Exponent(base, reduce(new Add(indices)))));
+		}
+		first = last;
+	}
+
+	product->operands.clear();
+	delete node;
+	return collected.size() == 1 ? collected[0] : reduce(new Multiply(collected));
+}
+
+Expression* Simplifier::accumulateExponentIndicies(Expression* node)
+{
+	Operator* op = (Operator*)node;
+	Exponent* left = typeid(*op->leftOperand) == typeid(Exponent) ? (Exponent*)op->leftOperand : nullptr;
+	Exponent* right = typeid(*op->rightOperand) == typeid(Exponent) ? (Exponent*)op->rightOperand : nullptr;
+	if (!left && !right) { return nullptr; }
+
+	// A lone operand takes part as itself raised to 1
+	Expression*& leftBase = left ? left->leftOperand : op->leftOperand;
+	Expression*& rightBase = right ? right->leftOperand : op->rightOperand;
+	if (!(*leftBase == *rightBase)) { return nullptr; }
+
+	Expression* base = take(leftBase);
+	Expression* leftIndex = left ? take(left->rightOperand) : new Number(1);
+	Expression* rightIndex = right ? take(right->rightOperand) : new Number(1);
+	delete node;
+	return reduce(new Exponent(base, reduce(new Subtract(leftIndex, rightIndex))));
+}
+
+Expression* Simplifier::divideZero(Expression* node)
+{
+	Operator* op = (Operator*)node;
+	if (!isValue(op->leftOperand, 0)) { return nullptr; }
+
+	delete node;
+	return new Number(0);
+}
+
+Expression* Simplifier::divideOne(Expression* node)
+{
+	Operator* op = (Operator*)node;
+	if (!isValue(op->rightOperand, 1)) { return nullptr; }
+
+	Expression* result = take(op->leftOperand);
+	delete node;
+	return result;
+}
+
+Expression* Simplifier::divideSame(Expression* node)
+{
+	Operator* op = (Operator*)node;
+	if (!(*op->leftOperand == *op->rightOperand)) { return nullptr; }
+
+	delete node;
+	return new Number(1);
+}
+
+Expression* Simplifier::exponentBase(Expression* node)
+{
+	Operator* op = (Operator*)node;
+	Expression* result;
+	if (isValue(op->leftOperand, 0)) { result = new Number(0); }
+	else if (isValue(op->leftOperand, 1)) { result = new Number(1); }
+	else { return nullptr; }
+
+	delete node;
+	return result;
+}
+
+Expression* Simplifier::exponentIndex(Expression* node)
+{
+	Operator* op = (Operator*)node;
+	Expression* result;
+	if (isValue(op->rightOperand, 0)) { result = new Number(1); }
+	else if (isValue(op->rightOperand, 1)) { result = take(op->leftOperand); }
+	else { return nullptr; }
+
+	delete node;
+	return result;
+}
+
+// (a^b)^c is a^(bc) unless a is negative, b even and c not an integer: ((-2)^2)^0.5 is 2, not (-2)^1. The rule
+// fires only when c is an integral number or b a number that is not an even integer
+Expression* Simplifier::exponentNested(Expression* node)
+{
+	Operator* op = (Operator*)node;
+	if (typeid(*op->leftOperand) != typeid(Exponent)) { return nullptr; }
+
+	Exponent* inner = (Exponent*)op->leftOperand;
+	bool integralOuter = isLiteral(op->rightOperand) && isInteger(op->rightOperand->evaluate());
+	bool evenInner = !isLiteral(inner->rightOperand) || isInteger(inner->rightOperand->evaluate() / 2);
+	if (!integralOuter && evenInner) { return nullptr; }
+
+	Expression* base = take(inner->leftOperand);
+	Expression* index = reduce(new Multiply(take(inner->rightOperand), take(op->rightOperand)));
+	delete node;
+	return reduce(new Exponent(base, index));
+}
+
+Expression* Simplifier::exponentLog(Expression* node)
+{
+	Operator* op = (Operator*)node;
+	if (typeid(*op->rightOperand) != typeid(Log)) { return nullptr; }
+
+	Log* index = (Log*)op->rightOperand;
+	if (!(*op->leftOperand == *index->leftOperand)) { return nullptr; }
+
+	Expression* result = take(index->rightOperand);
+	delete node;
+	return result;
+}
+
+Expression* Simplifier::logSame(Expression* node)
+{
+	Operator* op = (Operator*)node;
+	if (!(*op->leftOperand == *op->rightOperand)) { return nullptr; }
+
+	delete node;
+	return new Number(1);
+}
+
+Expression* Simplifier::logExponent(Expression* node)
+{
+	Operator* op = (Operator*)node;
+	if (typeid(*op->rightOperand) != typeid(Exponent)) { return nullptr; }
+
+	Exponent* argument = (Exponent*)op->rightOperand;
+	if (!(*op->leftOperand == *argument->leftOperand)) { return nullptr; }
+
+	Expression* result = take(argument->rightOperand);
+	delete node;
+	return result;
+}
+
+bool ExpressionInterner::Key::operator== (const Key& b) const
+{
+	return *type == *b.type && payload == b.payload && var == b.var && left == b.left && right == b.right && operands == b.operands;
+}
+
+size_t ExpressionInterner::KeyHash::operator()(const Key& key) const
+{
+	size_t hash = key.type->hash_code();
+	hash = hash * 31 + std::hash<unsigned long long>()(key.payload);
+	hash = hash * 31 + (unsigned char)key.var;
+	hash = hash * 31 + std::hash<const Expression*>()(key.left);
+	hash = hash * 31 + std::hash<const Expression*>()(key.right);
+	for (const Expression* operand : key.operands) { hash = hash * 31 + std::hash<const Expression*>()(operand); }
+	return hash;
+}
+
+ExpressionInterner::ExpressionInterner() {}
+
+ExpressionInterner::~ExpressionInterner()
+{
+	for (const std::pair<const Key, Expression*>& node : nodes)
+	{
+		Expression* expression = node.second;
+		if (Operator* op = dynamic_cast<Operator*>(expression)) { op->leftOperand = op->rightOperand = nullptr; }
+		else if (NaryOperator* nary = dynamic_cast<NaryOperator*>(expression)) { nary->operands.clear(); }
+		else if (Func* func = dynamic_cast<Func*>(expression)) { func->operand = nullptr; }
+		delete expression;
+	}
+}
+
+ExpressionInterner::Key ExpressionInterner::makeKey(Expression* expression)
+{
+	Key key;
+	key.type = &typeid(*expression);
+	key.payload = 0;
+	key.var = 0;
+	key.left = nullptr;
+	key.right = nullptr;
+
+	if (Operator* op = dynamic_cast<Operator*>(expression))
+	{
+		key.left = op->leftOperand;
+		key.right = op->rightOperand;
+		if (op->isCommutative() && std::less<const Expression*>()(key.right, key.left)) { std::swap(key.left, key.right); }
+		if (typeid(*expression) == typeid(Differential)) { key.payload = ((Differential*)expression)->getOrder(); }
+	}
+	else if (NaryOperator* nary = dynamic_cast<NaryOperator*>(expression)) { key.operands.assign(nary->operands.begin(), nary->operands.end()); }
+	else if (Func* func = dynamic_cast<Func*>(expression)) { key.left = func->operand; }
+	// A variable's substituted value can change after interning, so variables are keyed on their name alone
+	else if (Variable* variable = dynamic_cast<Variable*>(expression)) { key.var = variable->charID(); }
+	else
+	{
+		double value = expression->evaluate();
+		std::memcpy(&key.payload, &value, sizeof(double));
+	}
+	return key;
+}
+
+Expression* ExpressionInterner::intern(Expression* expression)
+{
+	if (owned.count(expression) > 0) { return expression; }
+
+	if (Operator* op = dynamic_cast<Operator*>(expression))
+	{
+		op->leftOperand = intern(op->leftOperand);
+		op->rightOperand = intern(op->rightOperand);
+	}
+	else if (NaryOperator* nary = dynamic_cast<NaryOperator*>(expression))
+	{
+		for (Expression*& operand : nary->operands) { operand = intern(operand); }
+	}
+	else if (Func* func = dynamic_cast<Func*>(expression)) { func->operand = intern(func->operand); }
+
+	Key key = makeKey(expression);
+	std::unordered_map<Key, Expression*, KeyHash>::iterator found = nodes.find(key);
+	if (found != nodes.end())
+	{
+		if (Operator* op = dynamic_cast<Operator*>(expression)) { op->leftOperand = op->rightOperand = nullptr; }
+		else if (NaryOperator* nary = dynamic_cast<NaryOperator*>(expression)) { nary->operands.clear(); }
+		else if (Func* func = dynamic_cast<Func*>(expression)) { func->operand = nullptr; }
+		delete expression;
+		++eliminated;
+		return found->second;
+	}
+
+	if (ExpressionArena::isPooled(expression)) { expression = rehome(expression); }
+	nodes.emplace(key, expression);
+	owned.insert(expression);
+	return expression;
+}
+
+// Nodes built inside an arena would die with it, so the interner keeps a heap copy instead. Its operands are
+// already interned and stay shared: the copy is taken with them swapped for a placeholder, then put back
+Expression* ExpressionInterner::rehome(Expression* expression)
+{
+	ExpressionArena::Suspension suspension;
+	Number placeholder(0);
+	Expression* copy;
+	if (Operator* op = dynamic_cast<Operator*>(expression))
+	{
+		Expression* left = op->leftOperand;
+		Expression* right = op->rightOperand;
+		op->leftOperand = op->rightOperand = &placeholder;
+		Operator* opCopy = (Operator*)op->copyTree();
+		delete opCopy->leftOperand;
+		delete opCopy->rightOperand;
+		opCopy->leftOperand = left;
+		opCopy->rightOperand = right;
+		if (typeid(*opCopy) == typeid(Log)) { ((Log*)opCopy)->classifyBase(); }
+		op->leftOperand = op->rightOperand = nullptr;
+		copy = opCopy;
+	}
+	else if (NaryOperator* nary = dynamic_cast<NaryOperator*>(expression))
+	{
+		std::vector<Expression*> operands(nary->operands.begin(), nary->operands.end());
+		std::fill(nary->operands.begin(), nary->operands.end(), &placeholder);
+		NaryOperator* naryCopy = (NaryOperator*)nary->copyTree();
+		for (size_t i = 0; i < operands.size(); ++i)
+		{
+			delete naryCopy->operands[i];
+			naryCopy->operands[i] = operands[i];
+		}
+		nary->operands.clear();
+		copy = naryCopy;
+	}
+	else if (Func* func = dynamic_cast<Func*>(expression))
+	{
+		Expression* operand = func->operand;
+		func->operand = &placeholder;
+		Func* funcCopy = (Func*)func->copyTree();
+		delete funcCopy->operand;
+		funcCopy->operand = operand;
+		func->operand = nullptr;
+		copy = funcCopy;
+	}
+	else { copy = expression->copyTree(); }
+
+	delete expression;
+	return copy;
+}
+
+Expression* ExpressionInterner::differentiate(Expression* expression, char diffOperator, unsigned int order)
+{
+	struct Activation
+	{
+		ExpressionInterner* previous;
+		~Activation() { activeInterner = previous; }
+	} activation = { activeInterner };
+	activeInterner = this;
+	ExpressionArena::Suspension suspension;
+
+	Expression* result = intern(expression);
+	for (unsigned int i = 0; i < order; ++i)
+	{
+		std::pair<const Expression*, char> key(result, diffOperator);
+		std::map<std::pair<const Expression*, char>, Expression*>::iterator found = derivatives.find(key);
+		if (found != derivatives.end()) { result = found->second; }
+		else
+		{
+			Expression* derivative = intern(result->differentiate(diffOperator));
+			derivatives.emplace(key, derivative);
+			result = derivative;
+		}
+	}
+	return result;
+}
+
+double ExpressionInterner::evaluate(Expression* expression, const Bindings& bindings)
+{
+	Expression* canonical = intern(expression);
+	std::unique_ptr<Program>& program = programs[canonical];
+	if (!program) { program.reset(canonical->compile()); }
+	return program->evaluate(bindings);
+}
+
+void ExpressionInterner::release(Expression* expression)
+{
+	if (owned.count(expression) > 0) { return; }
+
+	if (Operator* op = dynamic_cast<Operator*>(expression))
+	{
+		release(op->leftOperand);
+		release(op->rightOperand);
+		op->leftOperand = op->rightOperand = nullptr;
+	}
+	else if (NaryOperator* nary = dynamic_cast<NaryOperator*>(expression))
+	{
+		for (Expression* operand : nary->operands) { release(operand); }
+		nary->operands.clear();
+	}
+	else if (Func* func = dynamic_cast<Func*>(expression))
+	{
+		release(func->operand);
+		func->operand = nullptr;
+	}
+	delete expression;
+}
+
+bool ExpressionInterner::contains(const Expression* expression) const { return owned.count(expression) > 0; }
+
+size_t ExpressionInterner::size() const { return nodes.size(); }
+
+size_t ExpressionInterner::eliminatedCount() const { return eliminated; }
+
+ExpressionCache::ExpressionCache(size_t maxEntries, size_t maxBytes, size_t shardCount)
+{
+	if (shardCount == 0) { shardCount = 1; }
+	for (size_t i = 0; i < shardCount; ++i) { shards.emplace_back(new Shard()); }
+	maxShardEntries = std::max<size_t>(1, (maxEntries + shardCount - 1) / shardCount);
+	maxShardBytes = maxBytes == 0 ? 0 : std::max<size_t>(1, (maxBytes + shardCount - 1) / shardCount);
+}
+
+ExpressionCache::Entry ExpressionCache::get(const std::string& input)
+{
+	std::string key = normalize(input);
+	Shard& shard = *shards[std::hash<std::string>()(key) % shards.size()];
+
+	{
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		std::unordered_map<std::string, std::list<Node>::iterator>::iterator found = shard.index.find(key);
+		if (found != shard.index.end())
+		{
+			shard.entries.splice(shard.entries.begin(), shard.entries, found->second);
+			shard.hits++;
+			return found->second->entry;
+		}
+		shard.misses++;
+	}
+
+	// Entries outlive any arena the caller has in scope
+	Entry entry;
+	{
+		ExpressionArena::Suspension suspension;
+		entry.expression.reset(Expression::parse(key));
+		try { entry.program.reset(entry.expression->compile()); }
+		catch (const char*) { entry.program.reset(); }
+	}
+	Node node;
+	node.key = key;
+	node.entry = entry;
+	node.size = estimateSize(key, entry);
+
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	std::unordered_map<std::string, std::list<Node>::iterator>::iterator found = shard.index.find(key);
+	if (found != shard.index.end())
+	{
+		shard.entries.splice(shard.entries.begin(), shard.entries, found->second);
+		return found->second->entry;
+	}
+
+	shard.entries.push_front(node);
+	shard.index.emplace(key, shard.entries.begin());
+	shard.bytes += node.size;
+
+	while (shard.entries.size() > 1 && (shard.entries.size() > maxShardEntries || (maxShardBytes > 0 && shard.bytes > maxShardBytes)))
+	{
+		shard.bytes -= shard.entries.back().size;
+		shard.index.erase(shard.entries.back().key);
+		shard.entries.pop_back();
+		shard.evictions++;
+	}
+	return entry;
+}
+
+ExpressionCache::Statistics ExpressionCache::statistics() const
+{
+	Statistics total = {};
+	for (const std::unique_ptr<Shard>& shard : shards)
+	{
+		std::lock_guard<std::mutex> lock(shard->mutex);
+		total.hits += shard->hits;
+		total.misses += shard->misses;
+		total.evictions += shard->evictions;
+		total.entries += shard->entries.size();
+		total.bytes += shard->bytes;
+	}
+	return total;
+}
+
+void ExpressionCache::clear()
+{
+	for (std::unique_ptr<Shard>& shard : shards)
+	{
+		std::lock_guard<std::mutex> lock(shard->mutex);
+		shard->entries.clear();
+		shard->index.clear();
+		shard->bytes = 0;
+	}
+}
+
+std::string ExpressionCache::normalize(const std::string& input)
+{
+	std::string normalized = input;
+	normalized.erase(std::remove_if(normalized.begin(), normalized.end(), static_cast<int(&)(int)>(std::isspace)), normalized.end());
+	return normalized;
+}
+
+size_t ExpressionCache::estimateSize(const std::string& key, const Entry& entry)
+{
+	size_t size = sizeof(Entry) + 3 * key.size() + 128;
+	if (entry.program)
+	{
+		size += entry.program->size() * (sizeof(Program::Instruction) + sizeof(Operator));
+		size += sizeof(Program) + entry.program->variables().size();
+	}
+	else { size += key.size() * sizeof(Operator); }
+	return size;
+}
+
+
+
+// Variables other than the one integrated over keep the values last substituted into the tree
+static void collectVariableValues(Expression* expression, std::map<char, double>& values)
+{
+	if (Operator* op = dynamic_cast<Operator*>(expression))
+	{
+		collectVariableValues(op->getLeftOperand(), values);
+		collectVariableValues(op->getRightOperand(), values);
+	}
+	else if (NaryOperator* nary = dynamic_cast<NaryOperator*>(expression))
+	{
+		for (Expression* operand : nary->getOperands()) { collectVariableValues(operand, values); }
+	}
+	else if (Func* func = dynamic_cast<Func*>(expression)) { collectVariableValues(func->getOperand(), values); }
+	else if (typeid(*expression) == typeid(Variable)) { values[((Variable*)expression)->charID()] = expression->evaluate(); }
+}
+
+// The integrand of an adaptive rule, evaluated in batches through native code. Infinite limits are mapped
+// onto a finite interval of t: [a, inf) by x = a + t / (1 - t), (-inf, b] by x = b - (1 - t) / t and the
+// whole line by x = t / (1 - t^2), with the integrand scaled by dx/dt. The mapping is singular at the ends
+// of a mapped interval, so rules used on one must not evaluate there
+class Integrand
+{
+public:
+	Integrand(Expression* expression, double a, double b, char var) : a(a), b(b)
+	{
+		std::unique_ptr<Program> compiled(expression->compile());
+		program.reset(new NativeProgram(*compiled));
+
+		std::map<char, double> values;
+		collectVariableValues(expression, values);
+		for (char name : program->program().variables())
+		{
+			if (name == var) { slot = (int)fixed.size(); }
+			fixed.push_back(values.count(name) ? values[name] : 0);
+		}
+
+		if (std::isinf(a) && std::isinf(b)) { mapping = Mapping::Line; lower = -1; upper = 1; }
+		else if (std::isinf(b)) { mapping = Mapping::Upper; lower = 0; upper = 1; }
+		else if (std::isinf(a)) { mapping = Mapping::Lower; lower = 0; upper = 1; }
+		else { mapping = Mapping::None; lower = a; upper = b; }
+	}
+
+	void evaluate(const std::vector<double>& t, std::vector<double>& out)
+	{
+		size_t n = t.size();
+		std::vector<double> x(n), scale(n, 1.0);
+		for (size_t i = 0; i < n; ++i)
+		{
+			switch (mapping)
+			{
+				case Mapping::None: x[i] = t[i]; break;
+				case Mapping::Upper: x[i] = a + t[i] / (1 - t[i]); scale[i] = 1 / ((1 - t[i]) * (1 - t[i])); break;
+				case Mapping::Lower: x[i] = b - (1 - t[i]) / t[i]; scale[i] = 1 / (t[i] * t[i]); break;
+				case Mapping::Line: x[i] = t[i] / (1 - t[i] * t[i]); scale[i] = (1 + t[i] * t[i]) / ((1 - t[i] * t[i]) * (1 - t[i] * t[i])); break;
+			}
+		}
+
+		std::vector<std::vector<double>> columns(fixed.size());
+		std::vector<const double*> vars(fixed.size());
+		for (size_t j = 0; j < fixed.size(); ++j)
+		{
+			if ((int)j == slot) { vars[j] = x.data(); }
+			else
+			{
+				columns[j].assign(n, fixed[j]);
+				vars[j] = columns[j].data();
+			}
+		}
+
+		out.resize(n);
+		program->evaluateBatch(vars.data(), out.data(), n);
+		for (size_t i = 0; i < n; ++i) { out[i] *= scale[i]; }
+		evaluations += n;
+	}
+
+	bool isMapped() const { return mapping != Mapping::None; }
+
+	double lower;
+	double upper;
+	size_t evaluations = 0;
+
+private:
+	enum class Mapping { None, Upper, Lower, Line };
+
+	std::unique_ptr<NativeProgram> program;
+	std::vector<double> fixed;
+	int slot = -1;
+	double a;
+	double b;
+	Mapping mapping;
+};
+
+// Gauss-Kronrod 7-15 rule on [-1, 1]: the Kronrod abscissae with the Gauss points at odd indices
+static const double kronrodNodes[8] =
+{
+	0.991455371120812639206854697526329, 0.949107912342758524526189684047851, 0.864864423359769072789712788640926,
+	0.741531185599394439863864773280788, 0.586087235467691130294144845693013, 0.405845151377397166906606412076961,
+	0.207784955007898467600689403773245, 0.000000000000000000000000000000000
+};
+static const double kronrodWeights[8] =
+{
+	0.022935322010529224963732008058970, 0.063092092629978553290700663189204, 0.104790010322250183839876322541518,
+	0.140653259715525918745189590510238, 0.169004726639267902826583426598550, 0.190350578064785409913256402421014,
+	0.204432940075298892414161999234649, 0.209482141084727828012999174891714
+};
+static const double gaussWeights[4] =
+{
+	0.129484966168869693270611432679082, 0.279705391489276667901467771423780, 0.381830050505118944950369775488975,
+	0.417959183673469387755102040816327
+};
+
+struct KronrodInterval
+{
+	double a;
+	double b;
+	double value;
+	double error;
+};
+
+static void appendKronrodNodes(double a, double b, std::vector<double>& points)
+{
+	double centre = (a + b) / 2;
+	double halfLength = (b - a) / 2;
+	for (int i = 0; i < 7; ++i)
+	{
+		points.push_back(centre - halfLength * kronrodNodes[i]);
+		points.push_back(centre + halfLength * kronrodNodes[i]);
+	}
+	points.push_back(centre);
+}
+
+static void applyKronrod(KronrodInterval& interval, const double* values)
+{
+	double halfLength = (interval.b - interval.a) / 2;
+	double kronrod = kronrodWeights[7] * values[14];
+	double gauss = gaussWeights[3] * values[14];
+	for (int i = 0; i < 7; ++i)
+	{
+		double pair = values[2 * i] + values[2 * i + 1];
+		kronrod += kronrodWeights[i] * pair;
+		if (i % 2 == 1) { gauss += gaussWeights[i / 2] * pair; }
+	}
+	interval.value = kronrod * halfLength;
+	interval.error = std::fabs((kronrod - gauss) * halfLength);
+}
+
+// Globally adaptive: each round bisects the intervals with the largest error estimates, just enough of them
+// that the rest carry under half the tolerance, and evaluates all of their nodes as one batch
+IntegrationResult NumericalMethods::integrateGaussKronrod(Expression *expression, double a, double b, double absoluteTolerance,
+	double relativeTolerance, char var, size_t maxIntervals)
+{
+	if (a == b) { return { 0, 0, 0, true }; }
+	if (a > b)
+	{
+		IntegrationResult result = integrateGaussKronrod(expression, b, a, absoluteTolerance, relativeTolerance, var, maxIntervals);
+		result.value = -result.value;
+		return result;
+	}
+
+	Integrand integrand(expression, a, b, var);
+	std::vector<double> points;
+	std::vector<double> values;
+	appendKronrodNodes(integrand.lower, integrand.upper, points);
+	integrand.evaluate(points, values);
+
+	std::vector<KronrodInterval> intervals(1, { integrand.lower, integrand.upper, 0, 0 });
+	applyKronrod(intervals[0], values.data());
+
+	IntegrationResult result = { 0, 0, 0, false };
+	while (true)
+	{
+		result.value = result.error = 0;
+		for (const KronrodInterval& interval : intervals)
+		{
+			result.value += interval.value;
+			result.error += interval.error;
+		}
+		// A NaN or infinite value anywhere poisons the sums, and no amount of bisection will bring them back
+		if (!std::isfinite(result.value) || !std::isfinite(result.error)) { break; }
+		double tolerance = std::max(absoluteTolerance, relativeTolerance * std::fabs(result.value));
+		if (result.error <= tolerance) { result.converged = true; break; }
+		if (intervals.size() >= maxIntervals) { break; }
+
+		std::sort(intervals.begin(), intervals.end(), [](const KronrodInterval& x, const KronrodInterval& y) { return x.error > y.error; });
+		size_t split = 0;
+		double remaining = result.error;
+		while (split < intervals.size() && intervals.size() + split < maxIntervals && remaining > tolerance / 2) { remaining -= intervals[split++].error; }
+
+		points.clear();
+		std::vector<KronrodInterval> halves;
+		for (size_t i = 0; i < split; ++i)
+		{
+			double middle = (intervals[i].a + intervals[i].b) / 2;
+			halves.push_back({ intervals[i].a, middle, 0, 0 });
+			halves.push_back({ middle, intervals[i].b, 0, 0 });
+		}
+		for (const KronrodInterval& half : halves) { appendKronrodNodes(half.a, half.b, points); }
+		integrand.evaluate(points, values);
+		for (size_t i = 0; i < halves.size(); ++i) { applyKronrod(halves[i], values.data() + 15 * i); }
+
+		intervals.erase(intervals.begin(), intervals.begin() + split);
+		intervals.insert(intervals.end(), halves.begin(), halves.end());
+	}
+
+	result.evaluations = integrand.evaluations;
+	return result;
+}
+
+// Trapezium rule on successively halved steps, each level evaluating only the new points as one batch, with
+// Richardson extrapolation across the levels. A mapped infinite interval uses the midpoint rule on successively
+// tripled subdivisions instead, since the mapping is singular at the ends; tripling runs at most openLevelLimit
+// levels, about seven million evaluations, where halving would stop at maxLevels. The error is the change between
+// the last two diagonal entries; at least four levels run so an early coincidence cannot pass for convergence
+static const unsigned int openLevelLimit = 15;
+
+IntegrationResult NumericalMethods::integrateRomberg(Expression *expression, double a, double b, double absoluteTolerance,
+	double relativeTolerance, char var, unsigned int maxLevels)
+{
+	if (a == b) { return { 0, 0, 0, true }; }
+	if (a > b)
+	{
+		IntegrationResult result = integrateRomberg(expression, b, a, absoluteTolerance, relativeTolerance, var, maxLevels);
+		result.value = -result.value;
+		return result;
+	}
+
+	Integrand integrand(expression, a, b, var);
+	bool open = integrand.isMapped();
+	double h = integrand.upper - integrand.lower;
+	std::vector<double> points;
+	if (open) { points.push_back(integrand.lower + h / 2); }
+	else { points = { integrand.lower, integrand.upper }; }
+	std::vector<double> values;
+	integrand.evaluate(points, values);
+
+	std::vector<double> previous(1, open ? h * values[0] : h * (values[0] + values[1]) / 2);
+	IntegrationResult result = { previous[0], std::numeric_limits<double>::infinity(), 0, false };
+	size_t intervals = 1;
+	if (open) { maxLevels = std::min(maxLevels, openLevelLimit); }
+	for (unsigned int level = 1; level < maxLevels; ++level)
+	{
+		points.clear();
+		for (size_t i = 0; i < intervals; ++i)
+		{
+			double start = integrand.lower + i * h;
+			if (open)
+			{
+				points.push_back(start + h / 6);
+				points.push_back(start + 5 * h / 6);
+			}
+			else { points.push_back(start + h / 2); }
+		}
+		integrand.evaluate(points, values);
+
+		double sum = 0;
+		for (double value : values) { sum += value; }
+
+		double ratio = open ? 3 : 2;
+		h /= ratio;
+		intervals *= (size_t)ratio;
+		std::vector<double> current(level + 1);
+		current[0] = previous[0] / ratio + h * sum;
+		double factor = ratio * ratio;
+		for (unsigned int j = 1; j <= level; ++j, factor *= ratio * ratio) { current[j] = current[j - 1] + (current[j - 1] - previous[j - 1]) / (factor - 1); }
+
+		result.value = current[level];
+		result.error = std::fabs(current[level] - previous[level - 1]);
+		if (!std::isfinite(result.error)) { break; }
+		if (level >= 4 && result.error <= std::max(absoluteTolerance, relativeTolerance * std::fabs(result.value)))
+		{
+			result.converged = true;
+			break;
+		}
+		previous.swap(current);
+	}
+
+	result.evaluations = integrand.evaluations;
+	return result;
+}
+
+// Neumaier's compensated sum: the low-order bits lost by each addition are accumulated separately
+struct CompensatedSum
+{
+	double sum = 0;
+	double compensation = 0;
+
+	void add(double value)
+	{
+		double total = sum + value;
+		if (std::fabs(sum) >= std::fabs(value)) { compensation += (sum - total) + value; }
+		else { compensation += (value - total) + sum; }
+		sum = total;
+	}
+};
+
+// The samples are split into chunks of a fixed size that worker threads claim in turn. Each chunk is summed
+// with compensation and the chunk sums are combined in order, so the result is the same for any thread count.
+// Every worker evaluates through its own compiled integrand and never touches the tree
+double NumericalMethods::integrateTrapezium(Expression *expression, double a, double b, int n, char var, unsigned int threads)
+{
+	if (n < 1) { throw "Invalid number of intervals"; }
+
+	const size_t chunkSize = 4096;
+	size_t samples = (size_t)n + 1;
+	size_t chunks = (samples + chunkSize - 1) / chunkSize;
+	double h = (b - a) / n;
+	if (threads == 0) { threads = std::max(1u, std::thread::hardware_concurrency()); }
+	threads = (unsigned int)std::min<size_t>(threads, chunks);
+
+	std::vector<std::unique_ptr<Integrand>> integrands;
+	for (unsigned int i = 0; i < threads; ++i) { integrands.emplace_back(new Integrand(expression, a, b, var)); }
+
+	std::vector<CompensatedSum> partials(chunks);
+	std::atomic<size_t> nextChunk(0);
+	auto work = [&](Integrand* integrand)
+	{
+		std::vector<double> points;
+		std::vector<double> values;
+		for (size_t chunk = nextChunk++; chunk < chunks; chunk = nextChunk++)
+		{
+			size_t first = chunk * chunkSize;
+			size_t last = std::min(first + chunkSize, samples);
+			points.resize(last - first);
+			for (size_t i = first; i < last; ++i) { points[i - first] = i == (size_t)n ? b : a + i * h; }
+			integrand->evaluate(points, values);
+
+			for (size_t i = first; i < last; ++i)
+			{
+				double value = values[i - first];
+				partials[chunk].add(i == 0 || i == (size_t)n ? value / 2 : value);
+			}
+		}
+	};
+
+	std::vector<std::thread> workers;
+	for (unsigned int i = 1; i < threads; ++i) { workers.emplace_back(work, integrands[i].get()); }
+	work(integrands[0].get());
+	for (std::thread& worker : workers) { worker.join(); }
+
+	CompensatedSum total;
+	for (const CompensatedSum& partial : partials)
+	{
+		total.add(partial.sum);
+		total.add(partial.compensation);
+	}
+	return (total.sum + total.compensation) * h;
+}
+
+static unsigned long long mixBits(unsigned long long value)
+{
+	value += 0x9e3779b97f4a7c15ULL;
+	value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+	return value ^ (value >> 31);
+}
+
+// Uniform on [0, 1), a pure function of the seed and the stream so any thread can produce any sample
+static double uniform(unsigned long long seed, unsigned long long stream) { return (mixBits(mixBits(seed) ^ stream) >> 11) / 9007199254740992.0; }
+
+static const unsigned int quasiRandomDimensions = 16;
+
+static const unsigned int haltonBases[quasiRandomDimensions] = { 2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53 };
+
+static double radicalInverse(unsigned long long index, unsigned int base)
+{
+	double result = 0;
+	double scale = 1.0 / base;
+	for (; index > 0; index /= base, scale /= base) { result += (index % base) * scale; }
+	return result;
+}
+
+// Primitive polynomials and initial direction numbers from Joe and Kuo for the dimensions after the first,
+// which is the van der Corput sequence
+struct SobolPolynomial
+{
+	unsigned int degree;
+	unsigned int coefficients;
+	unsigned int initial[6];
+};
+
+static const SobolPolynomial sobolPolynomials[quasiRandomDimensions - 1] =
+{
+	{ 1, 0, { 1 } }, { 2, 1, { 1, 3 } }, { 3, 1, { 1, 3, 1 } }, { 3, 2, { 1, 1, 1 } }, { 4, 1, { 1, 1, 3, 3 } },
+	{ 4, 4, { 1, 3, 5, 13 } }, { 5, 2, { 1, 1, 5, 5, 17 } }, { 5, 4, { 1, 1, 5, 5, 5 } }, { 5, 7, { 1, 1, 7, 11, 19 } },
+	{ 5, 11, { 1, 1, 5, 1, 1 } }, { 5, 13, { 1, 1, 1, 3, 11 } }, { 5, 14, { 1, 3, 5, 5, 31 } }, { 6, 1, { 1, 3, 3, 9, 7, 49 } },
+	{ 6, 13, { 1, 1, 1, 15, 21, 21 } }, { 6, 16, { 1, 3, 1, 13, 27, 49 } }
+};
+
+static void sobolDirections(unsigned int dimension, unsigned int* directions)
+{
+	if (dimension == 0)
+	{
+		for (unsigned int k = 0; k < 32; ++k) { directions[k] = 1u << (31 - k); }
+		return;
+	}
+
+	const SobolPolynomial& polynomial = sobolPolynomials[dimension - 1];
+	unsigned int degree = polynomial.degree;
+	for (unsigned int k = 0; k < 32; ++k)
+	{
+		if (k < degree) { directions[k] = polynomial.initial[k] << (31 - k); }
+		else
+		{
+			unsigned int value = directions[k - degree] ^ (directions[k - degree] >> degree);
+			for (unsigned int j = 1; j < degree; ++j)
+			{
+				if ((polynomial.coefficients >> (degree - 1 - j)) & 1) { value ^= directions[k - j]; }
+			}
+			directions[k] = value;
+		}
+	}
+}
+
+// Fills count points of the sequence from index first, one column per dimension, using the Gray code order
+static void sobolPoints(const std::vector<std::vector<unsigned int>>& directions, unsigned long long first, size_t count, std::vector<std::vector<double>>& columns)
+{
+	for (size_t d = 0; d < directions.size(); ++d)
+	{
+		unsigned long long gray = first ^ (first >> 1);
+		unsigned int value = 0;
+		for (unsigned int k = 0; k < 32; ++k)
+		{
+			if ((gray >> k) & 1) { value ^= directions[d][k]; }
+		}
+		for (size_t i = 0; i < count; ++i)
+		{
+			columns[d][i] = value / 4294967296.0;
+			unsigned long long index = first + i;
+			unsigned int bit = 0;
+			while ((index >> bit) & 1) { ++bit; }
+			value ^= directions[d][bit & 31];
+		}
+	}
+}
+
+// Samples are produced in blocks that worker threads claim in turn; each block's statistics are kept apart and
+// combined in block order, so results depend on the seed but not on the thread count.
+//  - Random: independent uniform points; the error is the sample standard deviation over the root of the count.
+//  - Halton and Sobol: sixteen replicas of the sequence, each under its own random shift modulo 1; the error
+//    is the standard deviation of the replica estimates over the root of the replica count.
+//  - Stratified: the unit cube is split into s^d equal cells with at least two random points in each; the
+//    error combines the variances within the cells.
+MonteCarloResult NumericalMethods::integrateMonteCarlo(Expression *expression, const std::map<char, std::pair<double, double>>& bounds,
+	size_t samples, SamplingMethod method, unsigned long long seed, unsigned int threads)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	size_t dimensions = bounds.size();
+	if (dimensions == 0) { throw "No integration variables"; }
+	if (samples == 0) { return { 0, std::numeric_limits<double>::infinity(), 0, 0 }; }
+	if ((method == SamplingMethod::Halton || method == SamplingMethod::Sobol) && dimensions > quasiRandomDimensions) { throw "Too many dimensions for a quasi-random sequence"; }
+
+	std::unique_ptr<Program> compiled(expression->compile());
+	NativeProgram program(*compiled);
+	std::map<char, double> values;
+	collectVariableValues(expression, values);
+
+	std::vector<double> lower;
+	std::vector<double> width;
+	double volume = 1;
+	for (const std::pair<const char, std::pair<double, double>>& bound : bounds)
+	{
+		lower.push_back(bound.second.first);
+		width.push_back(bound.second.second - bound.second.first);
+		volume *= width.back();
+	}
+
+	// Each variable of the program reads either a dimension of the sample or its last substituted value
+	std::vector<int> dimensionOf;
+	std::vector<double> fixed;
+	for (char name : program.program().variables())
+	{
+		std::map<char, std::pair<double, double>>::const_iterator bound = bounds.find(name);
+		dimensionOf.push_back(bound == bounds.end() ? -1 : (int)std::distance(bounds.begin(), bound));
+		fixed.push_back(values.count(name) ? values[name] : 0);
+	}
+
+	std::vector<std::vector<unsigned int>> directions;
+	if (method == SamplingMethod::Sobol)
+	{
+		directions.assign(dimensions, std::vector<unsigned int>(32));
+		for (size_t d = 0; d < dimensions; ++d) { sobolDirections((unsigned int)d, directions[d].data()); }
+	}
+
+	const size_t blockSize = 4096;
+	size_t groups = 1;
+	size_t groupSize = samples;
+	size_t cellsPerSide = 1;
+	size_t cells = 1;
+	size_t perCell = samples;
+	if (method == SamplingMethod::Halton || method == SamplingMethod::Sobol)
+	{
+		groups = std::min<size_t>(16, std::max<size_t>(samples, 1));
+		groupSize = samples / groups;
+	}
+	else if (method == SamplingMethod::Stratified)
+	{
+		cellsPerSide = std::max<size_t>(1, (size_t)std::floor(std::pow(samples / 2.0, 1.0 / dimensions) + 1e-9));
+		cells = 1;
+		for (size_t d = 0; d < dimensions; ++d) { cells *= cellsPerSide; }
+		perCell = samples / cells;
+		groupSize = cells * perCell;
+	}
+
+	// A block covers whole cells when stratifying, so each cell's variance is computed within one block
+	struct Block
+	{
+		size_t group;
+		size_t first;
+		size_t count;
+		double sum;
+		double mean;
+		double squares;
+	};
+	std::vector<Block> blocks;
+	size_t step = method == SamplingMethod::Stratified ? std::max<size_t>(1, blockSize / std::max<size_t>(perCell, 1)) * perCell : blockSize;
+	for (size_t group = 0; group < groups; ++group)
+	{
+		for (size_t first = 0; first < groupSize; first += step) { blocks.push_back({ group, first, std::min(step, groupSize - first), 0, 0, 0 }); }
+	}
+
+	if (threads == 0) { threads = std::max(1u, std::thread::hardware_concurrency()); }
+	threads = (unsigned int)std::min<size_t>(threads, std::max<size_t>(blocks.size(), 1));
+
+	std::atomic<size_t> nextBlock(0);
+	auto work = [&]()
+	{
+		std::vector<std::vector<double>> unit(dimensions, std::vector<double>(step));
+		std::vector<std::vector<double>> columns(fixed.size(), std::vector<double>(step));
+		std::vector<const double*> vars(fixed.size());
+		std::vector<double> out(step);
+		for (size_t b = nextBlock++; b < blocks.size(); b = nextBlock++)
+		{
+			Block& block = blocks[b];
+			size_t n = block.count;
+			for (size_t d = 0; d < dimensions; ++d)
+			{
+				for (size_t i = 0; i < n; ++i)
+				{
+					unsigned long long index = block.first + i;
+					switch (method)
+					{
+						case SamplingMethod::Random: unit[d][i] = uniform(seed, index * dimensions + d); break;
+						case SamplingMethod::Halton: unit[d][i] = radicalInverse(index + 1, haltonBases[d]); break;
+						case SamplingMethod::Sobol: break;
+						case SamplingMethod::Stratified:
+						{
+							size_t cell = index / perCell;
+							for (size_t k = 0; k < d; ++k) { cell /= cellsPerSide; }
+							unit[d][i] = (cell % cellsPerSide + uniform(seed, index * dimensions + d)) / cellsPerSide;
+							break;
+						}
+					}
+				}
+			}
+			if (method == SamplingMethod::Sobol) { sobolPoints(directions, block.first, n, unit); }
+			if (method == SamplingMethod::Halton || method == SamplingMethod::Sobol)
+			{
+				for (size_t d = 0; d < dimensions; ++d)
+				{
+					double shift = uniform(seed ^ 0x5851f42d4c957f2dULL, block.group * dimensions + d);
+					for (size_t i = 0; i < n; ++i)
+					{
+						unit[d][i] += shift;
+						if (unit[d][i] >= 1) { unit[d][i] -= 1; }
+					}
+				}
+			}
+
+			for (size_t j = 0; j < fixed.size(); ++j)
+			{
+				int d = dimensionOf[j];
+				if (d < 0) { std::fill_n(columns[j].begin(), n, fixed[j]); }
+				else
+				{
+					for (size_t i = 0; i < n; ++i) { columns[j][i] = lower[d] + width[d] * unit[d][i]; }
+				}
+				vars[j] = columns[j].data();
+			}
+			program.evaluateBatch(vars.data(), out.data(), n);
+
+			// Random blocks keep their mean and sum of squared deviations, stratified blocks the sum of their cell
+			// means and of the variances of those means, and quasi-random blocks their plain sum
+			if (method == SamplingMethod::Stratified)
+			{
+				for (size_t c = 0; c < n; c += perCell)
+				{
+					double cellMean = 0;
+					for (size_t i = c; i < c + perCell; ++i) { cellMean += out[i]; }
+					cellMean /= perCell;
+					double cellSquares = 0;
+					for (size_t i = c; i < c + perCell; ++i) { cellSquares += (out[i] - cellMean) * (out[i] - cellMean); }
+					block.sum += cellMean;
+					if (perCell > 1) { block.squares += cellSquares / (perCell - 1) / perCell; }
+				}
+			}
+			else
+			{
+				CompensatedSum sum;
+				for (size_t i = 0; i < n; ++i) { sum.add(out[i]); }
+				block.sum = sum.sum + sum.compensation;
+				block.mean = block.sum / n;
+				if (method == SamplingMethod::Random)
+				{
+					for (size_t i = 0; i < n; ++i) { block.squares += (out[i] - block.mean) * (out[i] - block.mean); }
+				}
+			}
+		}
+	};
+
+	std::vector<std::thread> workers;
+	for (unsigned int i = 1; i < threads; ++i) { workers.emplace_back(work); }
+	work();
+	for (std::thread& worker : workers) { worker.join(); }
+
+	MonteCarloResult result = { 0, 0, groups * groupSize, 0 };
+	if (method == SamplingMethod::Random)
+	{
+		double count = 0;
+		double mean = 0;
+		double squares = 0;
+		for (const Block& block : blocks)
+		{
+			double total = count + block.count;
+			double delta = block.mean - mean;
+			mean += delta * block.count / total;
+			squares += block.squares + delta * delta * count * block.count / total;
+			count = total;
+		}
+		result.value = volume * mean;
+		result.error = count > 1 ? std::fabs(volume) * std::sqrt(squares / (count - 1) / count) : std::numeric_limits<double>::infinity();
+	}
+	else if (method == SamplingMethod::Stratified)
+	{
+		CompensatedSum means;
+		double variance = 0;
+		for (const Block& block : blocks)
+		{
+			means.add(block.sum);
+			variance += block.squares;
+		}
+		result.value = volume * (means.sum + means.compensation) / cells;
+		result.error = perCell > 1 ? std::fabs(volume) * std::sqrt(variance) / cells : std::numeric_limits<double>::infinity();
+	}
+	else
+	{
+		std::vector<CompensatedSum> replicas(groups);
+		for (const Block& block : blocks) { replicas[block.group].add(block.sum); }
+		double mean = 0;
+		for (const CompensatedSum& replica : replicas) { mean += (replica.sum + replica.compensation) / groupSize; }
+		mean /= groups;
+		double squares = 0;
+		for (const CompensatedSum& replica : replicas)
+		{
+			double deviation = (replica.sum + replica.compensation) / groupSize - mean;
+			squares += deviation * deviation;
+		}
+		result.value = volume * mean;
+		result.error = groups > 1 ? std::fabs(volume) * std::sqrt(squares / (groups - 1) / groups) : std::numeric_limits<double>::infinity();
+	}
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	result.samplesPerSecond = seconds > 0 ? result.samples / seconds : 0;
+	return result;
+}
+
+// A box of the branch-and-bound search, with a lower bound on the objective over it
+struct SearchBox
+{
+	std::vector<Interval> ranges;
+	double bound;
+};
+
+static bool boundAbove(const SearchBox& a, const SearchBox& b) { return a.bound > b.bound; }
+
+// Best-first branch and bound on sign * f, so both extrema are found as minima. The box with the lowest bound is
+// split in half along its widest side; each half is bounded by interval evaluation, sampled at its midpoint and
+// kept only while it could still hold a value below the best sample. The search ends once the lowest bound left
+// is within the tolerance of the best sample
+static ExtremumResult branchAndBound(Expression* expression, const std::map<char, Interval>& box, double tolerance, size_t maxBoxes, double sign)
+{
+	if (box.empty()) { throw "No search variables"; }
+	std::vector<char> names;
+	SearchBox root;
+	for (const std::pair<const char, Interval>& range : box)
+	{
+		if (!std::isfinite(range.second.lower) || !std::isfinite(range.second.upper) || range.second.lower > range.second.upper) { throw "Invalid search range"; }
+		names.push_back(range.first);
+		root.ranges.push_back(range.second);
+	}
+
+	std::unique_ptr<Program> compiled(expression->compile());
+	NativeProgram program(*compiled);
+	std::map<char, double> values;
+	collectVariableValues(expression, values);
+
+	// Each variable of the program reads either a side of the box or its last substituted value
+	std::vector<int> dimensionOf;
+	std::vector<double> vars;
+	for (char name : program.program().variables())
+	{
+		std::vector<char>::const_iterator found = std::find(names.begin(), names.end(), name);
+		dimensionOf.push_back(found == names.end() ? -1 : (int)(found - names.begin()));
+		vars.push_back(values.count(name) ? values[name] : 0);
+	}
+
+	// Only sides the expression depends on are split, and its partial derivatives in them give the mean value bound
+	std::vector<std::unique_ptr<Expression>> gradient(names.size());
+	for (int dimension : dimensionOf)
+	{
+		if (dimension < 0) { continue; }
+		std::unique_ptr<Expression> derivative(expression->partialDerivative(names[dimension]));
+		gradient[dimension].reset(derivative->simplify());
+	}
+
+	std::map<char, Interval> ranges = box;
+	double best = std::numeric_limits<double>::infinity();
+	std::vector<double> bestPoint;
+	double unsplit = std::numeric_limits<double>::infinity();
+	size_t boxes = 0;
+	std::vector<SearchBox> queue;
+
+	// Bounds a box and samples its midpoint, returning false for a box that cannot improve on the best sample
+	auto examine = [&](SearchBox& candidate)
+	{
+		++boxes;
+		for (size_t d = 0; d < names.size(); ++d) { ranges[names[d]] = candidate.ranges[d]; }
+		Interval range = expression->evaluateInterval(ranges);
+		if (isEmpty(range)) { return false; }
+
+		std::vector<double> point(names.size());
+		for (size_t d = 0; d < names.size(); ++d) { point[d] = (candidate.ranges[d].lower + candidate.ranges[d].upper) / 2; }
+
+		// Mean value form, f(X) in f(m) + sum of f_d(X) (X_d - m_d). Its overestimate shrinks with the square of
+		// the box width rather than the width, which is what lets boxes around a smooth extremum be closed off
+		std::vector<Interval> slopes(names.size(), { 0, 0 });
+		for (size_t d = 0; d < names.size(); ++d) { if (gradient[d]) { slopes[d] = gradient[d]->evaluateInterval(ranges); } }
+		for (size_t d = 0; d < names.size(); ++d) { ranges[names[d]] = { point[d], point[d] }; }
+		Interval meanValue = expression->evaluateInterval(ranges);
+		for (size_t d = 0; d < names.size(); ++d)
+		{
+			if (!gradient[d]) { continue; }
+			Interval offset = outward(candidate.ranges[d].lower - point[d], candidate.ranges[d].upper - point[d]);
+			meanValue = intervalAdd(meanValue, intervalMultiply(slopes[d], offset));
+		}
+		if (!isEmpty(meanValue)) { range = { std::max(range.lower, meanValue.lower), std::min(range.upper, meanValue.upper) }; }
+		candidate.bound = sign > 0 ? range.lower : -range.upper;
+
+		for (size_t i = 0; i < vars.size(); ++i) { if (dimensionOf[i] >= 0) { vars[i] = point[dimensionOf[i]]; } }
+		double value = sign * program.evaluate(vars.data());
+		if (value < best)
+		{
+			best = value;
+			bestPoint = point;
+		}
+		return candidate.bound <= best;
+	};
+
+	if (examine(root)) { queue.push_back(root); }
+	bool converged = false;
+	while (!queue.empty())
+	{
+		std::pop_heap(queue.begin(), queue.end(), boundAbove);
+		SearchBox current = queue.back();
+		queue.pop_back();
+		if (current.bound > best) { continue; }
+		if (best - current.bound <= tolerance)
+		{
+			queue.push_back(current);
+			converged = true;
+			break;
+		}
+		if (boxes + 2 > maxBoxes)
+		{
+			queue.push_back(current);
+			break;
+		}
+
+		size_t widest = names.size();
+		for (size_t d = 0; d < names.size(); ++d)
+		{
+			if (!gradient[d]) { continue; }
+			if (widest == names.size() || current.ranges[d].upper - current.ranges[d].lower > current.ranges[widest].upper - current.ranges[widest].lower) { widest = d; }
+		}
+		if (widest == names.size())
+		{
+			// The expression does not depend on the box, so its bound cannot be improved on
+			unsplit = std::min(unsplit, current.bound);
+			continue;
+		}
+		double middle = (current.ranges[widest].lower + current.ranges[widest].upper) / 2;
+		if (middle <= current.ranges[widest].lower || middle >= current.ranges[widest].upper)
+		{
+			// Too narrow to split any further, so its bound stays part of the answer
+			unsplit = std::min(unsplit, current.bound);
+			continue;
+		}
+
+		SearchBox halves[2] = { current, current };
+		halves[0].ranges[widest].upper = middle;
+		halves[1].ranges[widest].lower = middle;
+		for (SearchBox& half : halves)
+		{
+			if (examine(half))
+			{
+				queue.push_back(half);
+				std::push_heap(queue.begin(), queue.end(), boundAbove);
+			}
+		}
+	}
+
+	double bound = std::min(best, unsplit);
+	for (const SearchBox& remaining : queue) { bound = std::min(bound, remaining.bound); }
+	if (queue.empty() && unsplit >= best - tolerance) { converged = true; }
+
+	ExtremumResult result = { sign * best, sign * bound, std::map<char, double>(), boxes, converged && std::isfinite(best) };
+	for (size_t d = 0; d < bestPoint.size(); ++d) { result.point[names[d]] = bestPoint[d]; }
+	return result;
+}
+
+ExtremumResult NumericalMethods::findMinimum(Expression *expression, const std::map<char, Interval>& box, double tolerance, size_t maxBoxes)
+{
+	return branchAndBound(expression, box, tolerance, maxBoxes, 1);
+}
+
+ExtremumResult NumericalMethods::findMaximum(Expression *expression, const std::map<char, Interval>& box, double tolerance, size_t maxBoxes)
+{
+	return branchAndBound(expression, box, tolerance, maxBoxes, -1);
+}
+
+static NativeProgram* compileDerivative(Expression* expression, char var)
+{
+	std::unique_ptr<Expression> derivative(expression->partialDerivative(var));
+	std::unique_ptr<Expression> simplified(derivative->simplify());
+	return simplified->compileNative();
+}
+
+RootFinder::RootFinder(Expression *expression, char var) : var(var)
+{
+	std::unique_ptr<Expression> first(expression->partialDerivative(var));
+	std::unique_ptr<Expression> simplifiedFirst(first->simplify());
+	value.reset(expression->compileNative());
+	slope.reset(simplifiedFirst->compileNative());
+	curvature.reset(compileDerivative(simplifiedFirst.get(), var));
+}
+
+// Evaluates a program at one point per lane, reading the lane's own values of the other variables
+void RootFinder::evaluate(const NativeProgram& program, const std::map<char, const double*>& parameters, const std::vector<size_t>& lanes,
+	const std::vector<double>& x, std::vector<double>& out) const
+{
+	const std::string& variables = program.program().variables();
+	std::vector<std::vector<double>> columns(variables.size());
+	std::vector<const double*> vars(variables.size());
+	for (size_t j = 0; j < variables.size(); ++j)
+	{
+		if (variables[j] == var)
+		{
+			vars[j] = x.data();
+			continue;
+		}
+
+		std::map<char, const double*>::const_iterator parameter = parameters.find(variables[j]);
+		if (parameter == parameters.end()) { throw "Unbound variable"; }
+		columns[j].resize(lanes.size());
+		for (size_t i = 0; i < lanes.size(); ++i) { columns[j][i] = parameter->second[lanes[i]]; }
+		vars[j] = columns[j].data();
+	}
+
+	out.resize(lanes.size());
+	program.evaluateBatch(vars.data(), out.data(), lanes.size());
+}
+
+// Newton or Halley iteration from each starting point. A lane stops once its step is within the tolerance,
+// relative to 1 + |x|, or fails as soon as the step is not finite
+void RootFinder::solve(const std::map<char, const double*>& parameters, const double* initial, RootResult* results, size_t n,
+	RootMethod method, double tolerance, unsigned int maxIterations) const
+{
+	if (method != RootMethod::Newton && method != RootMethod::Halley) { throw "Bracket required"; }
+
+	std::vector<size_t> lanes;
+	std::vector<double> x;
+	for (size_t i = 0; i < n; ++i)
+	{
+		results[i] = { initial[i], 0, 0, false };
+		lanes.push_back(i);
+		x.push_back(initial[i]);
+	}
+
+	std::vector<double> f, df, d2f;
+	for (unsigned int iteration = 0; iteration < maxIterations && !lanes.empty(); ++iteration)
+	{
+		evaluate(*value, parameters, lanes, x, f);
+		evaluate(*slope, parameters, lanes, x, df);
+		if (method == RootMethod::Halley) { evaluate(*curvature, parameters, lanes, x, d2f); }
+
+		std::vector<size_t> active;
+		std::vector<double> next;
+		for (size_t i = 0; i < lanes.size(); ++i)
+		{
+			RootResult& result = results[lanes[i]];
+			++result.iterations;
+			if (f[i] == 0)
+			{
+				result.converged = true;
+				continue;
+			}
+
+			double step = method == RootMethod::Newton ? f[i] / df[i] : 2 * f[i] * df[i] / (2 * df[i] * df[i] - f[i] * d2f[i]);
+			if (!std::isfinite(step)) { continue; }
+
+			result.root = x[i] - step;
+			if (std::fabs(step) <= tolerance * (1 + std::fabs(result.root))) { result.converged = true; }
+			else
+			{
+				active.push_back(lanes[i]);
+				next.push_back(result.root);
+			}
+		}
+		lanes.swap(active);
+		x.swap(next);
+	}
+
+	std::vector<size_t> all(n);
+	std::vector<double> roots(n);
+	for (size_t i = 0; i < n; ++i)
+	{
+		all[i] = i;
+		roots[i] = results[i].root;
+	}
+	evaluate(*value, parameters, all, roots, f);
+	for (size_t i = 0; i < n; ++i) { results[i].residual = f[i]; }
+}
+
+// Per-lane state of a bracketed search. Brent's method keeps b as the best estimate, a as the previous one and c
+// on the other side of the root from b, with d and e the last two steps
+struct BracketLane
+{
+	double a, b, c;
+	double fa, fb, fc;
+	double d, e;
+};
+
+// Returns true once the lane has converged; otherwise leaves the next point to evaluate in b
+static bool advanceBrent(BracketLane& lane, double tolerance)
+{
+	if ((lane.fb > 0) == (lane.fc > 0))
+	{
+		lane.c = lane.a;
+		lane.fc = lane.fa;
+		lane.d = lane.e = lane.b - lane.a;
+	}
+	if (std::fabs(lane.fc) < std::fabs(lane.fb))
+	{
+		lane.a = lane.b; lane.b = lane.c; lane.c = lane.a;
+		lane.fa = lane.fb; lane.fb = lane.fc; lane.fc = lane.fa;
+	}
+
+	double tolerance1 = 2 * std::numeric_limits<double>::epsilon() * std::fabs(lane.b) + 0.5 * tolerance * (1 + std::fabs(lane.b));
+	double middle = 0.5 * (lane.c - lane.b);
+	if (std::fabs(middle) <= tolerance1 || lane.fb == 0) { return true; }
+
+	if (std::fabs(lane.e) >= tolerance1 && std::fabs(lane.fa) > std::fabs(lane.fb))
+	{
+		double s = lane.fb / lane.fa;
+		double p, q;
+		if (lane.a == lane.c)
+		{
+			p = 2 * middle * s;
+			q = 1 - s;
+		}
+		else
+		{
+			double r = lane.fb / lane.fc;
+			q = lane.fa / lane.fc;
+			p = s * (2 * middle * q * (q - r) - (lane.b - lane.a) * (r - 1));
+			q = (q - 1) * (r - 1) * (s - 1);
+		}
+		if (p > 0) { q = -q; }
+		p = std::fabs(p);
+		if (2 * p < std::min(3 * middle * q - std::fabs(tolerance1 * q), std::fabs(lane.e * q)))
+		{
+			lane.e = lane.d;
+			lane.d = p / q;
+		}
+		else { lane.d = lane.e = middle; }
+	}
+	else { lane.d = lane.e = middle; }
+
+	lane.a = lane.b;
+	lane.fa = lane.fb;
+	lane.b += std::fabs(lane.d) > tolerance1 ? lane.d : std::copysign(tolerance1, middle);
+	return false;
+}
+
+// Each lane needs f(lower) and f(upper) of opposite signs; a lane without a sign change fails at once. Newton
+// and Halley run safeguarded: they start from the midpoint, keep the bracket up to date and bisect whenever a
+// step would leave it
+void RootFinder::solveBracketed(const std::map<char, const double*>& parameters, const double* lower, const double* upper, RootResult* results,
+	size_t n, RootMethod method, double tolerance, unsigned int maxIterations) const
+{
+	std::vector<size_t> ends(2 * n);
+	std::vector<double> endPoints(2 * n);
+	for (size_t i = 0; i < n; ++i)
+	{
+		ends[2 * i] = ends[2 * i + 1] = i;
+		endPoints[2 * i] = lower[i];
+		endPoints[2 * i + 1] = upper[i];
+	}
+	std::vector<double> f;
+	evaluate(*value, parameters, ends, endPoints, f);
+
+	std::vector<BracketLane> state(n);
+	std::vector<size_t> lanes;
+	std::vector<double> x;
+	for (size_t i = 0; i < n; ++i)
+	{
+		double fLower = f[2 * i];
+		double fUpper = f[2 * i + 1];
+		results[i] = { lower[i], fLower, 0, false };
+		if (fLower == 0 || fUpper == 0)
+		{
+			results[i] = fLower == 0 ? RootResult{ lower[i], 0, 0, true } : RootResult{ upper[i], 0, 0, true };
+			continue;
+		}
+		if ((fLower > 0) == (fUpper > 0)) { continue; }
+
+		BracketLane& lane = state[i];
+		lane = { lower[i], upper[i], upper[i], fLower, fUpper, fUpper, upper[i] - lower[i], upper[i] - lower[i] };
+		if (method == RootMethod::Brent)
+		{
+			if (advanceBrent(lane, tolerance))
+			{
+				results[i] = { lane.b, lane.fb, 0, true };
+				continue;
+			}
+			x.push_back(lane.b);
+		}
+		else { x.push_back(0.5 * (lower[i] + upper[i])); }
+		lanes.push_back(i);
+	}
+
+	std::vector<double> df, d2f;
+	for (unsigned int iteration = 0; iteration < maxIterations && !lanes.empty(); ++iteration)
+	{
+		evaluate(*value, parameters, lanes, x, f);
+		if (method == RootMethod::Newton || method == RootMethod::Halley) { evaluate(*slope, parameters, lanes, x, df); }
+		if (method == RootMethod::Halley) { evaluate(*curvature, parameters, lanes, x, d2f); }
+
+		std::vector<size_t> active;
+		std::vector<double> next;
+		for (size_t i = 0; i < lanes.size(); ++i)
+		{
+			BracketLane& lane = state[lanes[i]];
+			RootResult& result = results[lanes[i]];
+			++result.iterations;
+			result.root = x[i];
+			result.residual = f[i];
+
+			double point;
+			if (method == RootMethod::Brent)
+			{
+				lane.fb = f[i];
+				if (advanceBrent(lane, tolerance))
+				{
+					result.root = lane.b;
+					result.residual = lane.fb;
+					result.converged = true;
+					continue;
+				}
+				point = lane.b;
+			}
+			else
+			{
+				// a and b hold the bracket, with fa and fb the values at its ends
+				if (f[i] == 0)
+				{
+					result.converged = true;
+					continue;
+				}
+				if ((f[i] > 0) == (lane.fa > 0))
+				{
+					lane.a = x[i];
+					lane.fa = f[i];
+				}
+				else
+				{
+					lane.b = x[i];
+					lane.fb = f[i];
+				}
+
+				double step = method == RootMethod::Bisection ? 0 :
+					method == RootMethod::Newton ? f[i] / df[i] : 2 * f[i] * df[i] / (2 * df[i] * df[i] - f[i] * d2f[i]);
+				point = x[i] - step;
+				double scale = tolerance * (1 + std::fabs(x[i]));
+				if (method != RootMethod::Bisection && std::fabs(step) <= scale)
+				{
+					// Near the root rounding can push the last step just outside the bracket, so accept it as is
+					result.root = point;
+					result.converged = true;
+					continue;
+				}
+				if (method == RootMethod::Bisection || !std::isfinite(point) || point <= std::min(lane.a, lane.b) || point >= std::max(lane.a, lane.b))
+				{
+					point = 0.5 * (lane.a + lane.b);
+				}
+				if (std::fabs(lane.b - lane.a) <= 2 * scale)
+				{
+					result.root = point;
+					result.converged = true;
+					continue;
+				}
+			}
+			active.push_back(lanes[i]);
+			next.push_back(point);
+		}
+		lanes.swap(active);
+		x.swap(next);
+	}
+
+	if (method == RootMethod::Brent) { return; }
+	std::vector<size_t> converged;
+	std::vector<double> roots;
+	for (size_t i = 0; i < n; ++i)
+	{
+		if (results[i].converged && results[i].residual != 0)
+		{
+			converged.push_back(i);
+			roots.push_back(results[i].root);
+		}
+	}
+	evaluate(*value, parameters, converged, roots, f);
+	for (size_t i = 0; i < converged.size(); ++i) { results[converged[i]].residual = f[i]; }
+}
+
+// One slot of the streaming pipeline: a chunk of each input column in program slot order, and its results.
+// Columns point either into the chunk's own storage or into windows of mapped files, unmapped on reuse
+struct StreamChunk
+{
+	size_t rows = 0;
+	std::vector<const double*> vars;
+	std::vector<std::vector<double>> columns;
+	std::vector<double> out;
+	std::vector<std::pair<void*, size_t>> mappings;
+
+	~StreamChunk() { release(); }
+
+	void release()
+	{
+#ifdef QMATH_MMAP
+		for (const std::pair<void*, size_t>& mapping : mappings) { munmap(mapping.first, mapping.second); }
+#endif
+		mappings.clear();
+	}
+};
+
+// Passes chunks from one pipeline stage to the next in order. Once closed, pop drains what is left, then fails
+class ChunkQueue
+{
+public:
+	void push(StreamChunk* chunk)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		chunks.push_back(chunk);
+		ready.notify_one();
+	}
+
+	bool pop(StreamChunk*& chunk)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		ready.wait(lock, [this]() { return closed || !chunks.empty(); });
+		if (chunks.empty()) { return false; }
+		chunk = chunks.front();
+		chunks.pop_front();
+		return true;
+	}
+
+	void close()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		closed = true;
+		ready.notify_all();
+	}
+
+private:
+	std::mutex mutex;
+	std::condition_variable ready;
+	std::deque<StreamChunk*> chunks;
+	bool closed = false;
+};
+
+// Runs reading, evaluation and writing as three stages over a fixed pool of chunks. read fills a chunk and returns
+// false at the end of the input; the first exception from any stage stops the others and is rethrown here
+template<typename Read, typename Write>
+static StreamResult streamChunks(const NativeProgram& program, size_t chunkRows, Read read, Write write)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	size_t variableCount = program.program().variables().size();
+	std::vector<std::unique_ptr<StreamChunk>> pool;
+	ChunkQueue empty, loaded, evaluated;
+	for (size_t i = 0; i < StreamEvaluator::slotCount; ++i)
+	{
+		pool.emplace_back(new StreamChunk());
+		pool.back()->vars.resize(variableCount);
+		pool.back()->columns.resize(variableCount);
+		pool.back()->out.resize(chunkRows);
+		empty.push(pool.back().get());
+	}
+
+	std::exception_ptr failure;
+	std::mutex failureMutex;
+	std::atomic<bool> stopped(false);
+	auto fail = [&]()
+	{
+		{
+			std::lock_guard<std::mutex> lock(failureMutex);
+			if (!failure) { failure = std::current_exception(); }
+		}
+		stopped = true;
+		empty.close();
+		loaded.close();
+		evaluated.close();
+	};
+
+	std::thread reader([&]()
+	{
+		try
+		{
+			StreamChunk* chunk;
+			while (!stopped && empty.pop(chunk) && read(*chunk)) { loaded.push(chunk); }
+		}
+		catch (...) { fail(); }
+		loaded.close();
+	});
+	std::thread writer([&]()
+	{
+		try
+		{
+			StreamChunk* chunk;
+			while (!stopped && evaluated.pop(chunk))
+			{
+				write(*chunk);
+				empty.push(chunk);
+			}
+		}
+		catch (...) { fail(); }
+	});
+
+	StreamResult result = { 0, 0, 0 };
+	try
+	{
+		StreamChunk* chunk;
+		while (!stopped && loaded.pop(chunk))
+		{
+			program.evaluateBatch(chunk->vars.data(), chunk->out.data(), chunk->rows);
+			result.rows += chunk->rows;
+			++result.chunks;
+			evaluated.push(chunk);
+		}
+	}
+	catch (...) { fail(); }
+	evaluated.close();
+	reader.join();
+	writer.join();
+
+	if (failure) { std::rethrow_exception(failure); }
+	result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	return result;
+}
+
+// A file of doubles read a window of rows at a time: mapped and paged in by the reading thread where the platform
+// allows, copied into the chunk otherwise
+class BinaryColumn
+{
+public:
+	BinaryColumn(const std::string& path)
+	{
+#ifdef QMATH_MMAP
+		descriptor = open(path.c_str(), O_RDONLY);
+		if (descriptor < 0) { throw "Could not open file"; }
+		struct stat status;
+		if (fstat(descriptor, &status) != 0 || status.st_size % sizeof(double) != 0)
+		{
+			close(descriptor);
+			throw "Invalid column data";
+		}
+		bytes = (size_t)status.st_size;
+#else
+		file.open(path, std::ios::binary | std::ios::ate);
+		if (!file) { throw "Could not open file"; }
+		bytes = (size_t)file.tellg();
+		if (bytes % sizeof(double) != 0) { throw "Invalid column data"; }
+#endif
+	}
+
+	~BinaryColumn()
+	{
+#ifdef QMATH_MMAP
+		close(descriptor);
+#endif
+	}
+
+	size_t rows() const { return bytes / sizeof(double); }
+
+	const double* window(size_t first, size_t count, StreamChunk& chunk, size_t slot)
+	{
+		size_t offset = first * sizeof(double);
+#ifdef QMATH_MMAP
+		static const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+		size_t aligned = offset - offset % page;
+		size_t size = offset + count * sizeof(double) - aligned;
+#ifdef MAP_POPULATE
+		void* memory = mmap(nullptr, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, descriptor, (off_t)aligned);
+#else
+		void* memory = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, descriptor, (off_t)aligned);
+		if (memory != MAP_FAILED) { madvise(memory, size, MADV_WILLNEED); }
+#endif
+		if (memory == MAP_FAILED) { throw "Could not read file"; }
+		chunk.mappings.emplace_back(memory, size);
+		return (const double*)((const char*)memory + (offset - aligned));
+#else
+		std::vector<double>& column = chunk.columns[slot];
+		column.resize(count);
+		file.seekg(offset);
+		if (!file.read((char*)column.data(), count * sizeof(double))) { throw "Could not read file"; }
+		return column.data();
+#endif
+	}
+
+private:
+	BinaryColumn(const BinaryColumn&);
+	BinaryColumn& operator= (const BinaryColumn&);
+
+#ifdef QMATH_MMAP
+	int descriptor;
+#else
+	std::ifstream file;
+#endif
+	size_t bytes;
+};
+
+// Reads a text file a line at a time through a fixed buffer, which grows only to hold a longer line
+class LineReader
+{
+public:
+	LineReader(const std::string& path) : file(path, std::ios::binary), buffer(1 << 20)
+	{
+		if (!file) { throw "Could not open file"; }
+	}
+
+	bool next(const char*& begin, const char*& end)
+	{
+		while (true)
+		{
+			const char* first = buffer.data() + position;
+			const char* newline = (const char*)std::memchr(first, '\n', filled - position);
+			if (newline)
+			{
+				begin = first;
+				end = newline;
+				position = newline + 1 - buffer.data();
+				break;
+			}
+			if (exhausted)
+			{
+				if (position == filled) { return false; }
+				begin = first;
+				end = buffer.data() + filled;
+				position = filled;
+				break;
+			}
+			fill();
+		}
+
+		if (end != begin && end[-1] == '\r') { --end; }
+		return true;
+	}
+
+private:
+	void fill()
+	{
+		std::memmove(buffer.data(), buffer.data() + position, filled - position);
+		filled -= position;
+		position = 0;
+		if (filled == buffer.size()) { buffer.resize(buffer.size() * 2); }
+
+		file.read(buffer.data() + filled, buffer.size() - filled);
+		filled += (size_t)file.gcount();
+		if (!file)
+		{
+			if (file.bad()) { throw "Could not read file"; }
+			exhausted = true;
+		}
+	}
+
+	std::ifstream file;
+	std::vector<char> buffer;
+	size_t position = 0;
+	size_t filled = 0;
+	bool exhausted = false;
+};
+
+// Splits a CSV line into its fields, leaving out the quotes around quoted ones
+static void splitFields(const char* begin, const char* end, char delimiter, std::vector<std::pair<const char*, const char*>>& fields)
+{
+	fields.clear();
+	const char* p = begin;
+	while (true)
+	{
+		const char* fieldBegin = p;
+		const char* fieldEnd = nullptr;
+		if (p != end && *p == '"')
+		{
+			fieldBegin = ++p;
+			while (p != end)
+			{
+				if (*p != '"') { ++p; }
+				else if (p + 1 != end && p[1] == '"') { p += 2; }
+				else { break; }
+			}
+			fieldEnd = p;
+			if (p != end) { ++p; }
+		}
+
+		const char* delimiterAt = (const char*)std::memchr(p, delimiter, end - p);
+		p = delimiterAt ? delimiterAt : end;
+		fields.emplace_back(fieldBegin, fieldEnd ? fieldEnd : p);
+		if (p == end) { return; }
+		++p;
+	}
+}
+
+// Reads a decimal field. Up to 19 significant digits scaled by a power of ten that a double holds exactly take one
+// correctly rounded multiply or divide; anything else, including exponents out of that range, goes to strtod
+static bool parseField(const char* begin, const char* end, double& value)
+{
+	static const double powers[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+		1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+	while (begin != end && (*begin == ' ' || *begin == '\t')) { ++begin; }
+	while (end != begin && (end[-1] == ' ' || end[-1] == '\t')) { --end; }
+	if (begin == end)
+	{
+		value = std::numeric_limits<double>::quiet_NaN();
+		return true;
+	}
+
+	const char* p = begin;
+	bool negative = *p == '-';
+	if (*p == '-' || *p == '+') { ++p; }
+
+	unsigned long long mantissa = 0;
+	int significant = 0;
+	int exponent = 0;
+	bool digits = false;
+	bool exact = true;
+	for (bool fraction = false; p != end; ++p)
+	{
+		if (*p == '.' && !fraction)
+		{
+			fraction = true;
+			continue;
+		}
+		if (*p < '0' || *p > '9') { break; }
+
+		digits = true;
+		if (significant == 19)
+		{
+			exact = false;
+			break;
+		}
+		mantissa = mantissa * 10 + (*p - '0');
+		if (mantissa) { ++significant; }
+		if (fraction) { --exponent; }
+	}
+
+	if (exact && digits && p != end && (*p == 'e' || *p == 'E'))
+	{
+		++p;
+		bool negativeExponent = p != end && *p == '-';
+		if (p != end && (*p == '-' || *p == '+')) { ++p; }
+		int scale = 0;
+		const char* scaleBegin = p;
+		for (; p != end && *p >= '0' && *p <= '9' && scale < 1000; ++p) { scale = scale * 10 + (*p - '0'); }
+		if (p == scaleBegin) { return false; }
+		exponent += negativeExponent ? -scale : scale;
+	}
+
+	if (exact && digits && p == end && mantissa <= (1ull << 53) && exponent >= -22 && exponent <= 22)
+	{
+		value = exponent < 0 ? mantissa / powers[-exponent] : mantissa * powers[exponent];
+		if (negative) { value = -value; }
+		return true;
+	}
+
+	std::string field(begin, end);
+	char* parsed;
+	value = std::strtod(field.c_str(), &parsed);
+	return parsed == field.c_str() + field.size();
+}
+
+StreamEvaluator::StreamEvaluator(Expression *expression, size_t chunkRows, Precision precision)
+	: compiled(expression->compileNative(precision)), rowsPerChunk(std::max<size_t>(chunkRows, 1))
+{
+}
+
+StreamResult StreamEvaluator::evaluateBinary(const std::map<char, std::string>& columns, const std::string& outputPath) const
+{
+	std::vector<std::unique_ptr<BinaryColumn>> inputs;
+	for (char var : compiled->program().variables())
+	{
+		std::map<char, std::string>::const_iterator column = columns.find(var);
+		if (column == columns.end()) { throw "Unbound variable"; }
+		inputs.emplace_back(new BinaryColumn(column->second));
+		if (inputs.back()->rows() != inputs.front()->rows()) { throw "Column lengths differ"; }
+	}
+
+	std::ofstream output(outputPath, std::ios::binary | std::ios::trunc);
+	if (!output) { throw "Could not write file"; }
+
+	size_t total = inputs.empty() ? 0 : inputs.front()->rows();
+	size_t next = 0;
+	StreamResult result = streamChunks(*compiled, rowsPerChunk, [&](StreamChunk& chunk) -> bool
+	{
+		chunk.release();
+		chunk.rows = std::min(rowsPerChunk, total - next);
+		for (size_t j = 0; j < inputs.size() && chunk.rows; ++j) { chunk.vars[j] = inputs[j]->window(next, chunk.rows, chunk, j); }
+		next += chunk.rows;
+		return chunk.rows != 0;
+	}, [&](const StreamChunk& chunk)
+	{
+		if (!output.write((const char*)chunk.out.data(), chunk.rows * sizeof(double))) { throw "Could not write file"; }
+	});
+
+	if (!output.flush()) { throw "Could not write file"; }
+	return result;
+}
+
+StreamResult StreamEvaluator::evaluateCsv(const std::string& inputPath, const std::map<char, std::string>& columns, const std::string& outputPath,
+	const std::string& outputName, char delimiter) const
+{
+	LineReader lines(inputPath);
+	const char* begin;
+	const char* end;
+	if (!lines.next(begin, end)) { throw "Invalid CSV data"; }
+	if (end - begin >= 3 && std::memcmp(begin, "\xEF\xBB\xBF", 3) == 0) { begin += 3; }
+
+	// Pairs of field index and program slot, so a field bound to several variables is read into each
+	std::vector<std::pair<const char*, const char*>> fields;
+	std::vector<std::pair<size_t, size_t>> targets;
+	splitFields(begin, end, delimiter, fields);
+	const std::string& variables = compiled->program().variables();
+	for (size_t j = 0; j < variables.size(); ++j)
+	{
+		std::map<char, std::string>::const_iterator column = columns.find(variables[j]);
+		if (column == columns.end()) { throw "Unbound variable"; }
+
+		size_t field = 0;
+		while (field < fields.size() && std::string(fields[field].first, fields[field].second) != column->second) { ++field; }
+		if (field == fields.size()) { throw "Unknown column"; }
+		targets.emplace_back(field, j);
+	}
+
+	std::ofstream output(outputPath, std::ios::binary | std::ios::trunc);
+	if (!(output << outputName << '\n')) { throw "Could not write file"; }
+
+	std::string text;
+	StreamResult result = streamChunks(*compiled, rowsPerChunk, [&](StreamChunk& chunk) -> bool
+	{
+		for (size_t j = 0; j < chunk.columns.size(); ++j)
+		{
+			chunk.columns[j].resize(rowsPerChunk);
+			chunk.vars[j] = chunk.columns[j].data();
+		}
+
+		chunk.rows = 0;
+		while (chunk.rows < rowsPerChunk && lines.next(begin, end))
+		{
+			if (begin == end) { continue; }
+			splitFields(begin, end, delimiter, fields);
+			for (const std::pair<size_t, size_t>& target : targets)
+			{
+				if (target.first >= fields.size()) { throw "Invalid CSV data"; }
+				const std::pair<const char*, const char*>& field = fields[target.first];
+				if (!parseField(field.first, field.second, chunk.columns[target.second][chunk.rows])) { throw "Invalid CSV data"; }
+			}
+			++chunk.rows;
+		}
+		return chunk.rows != 0;
+	}, [&](const StreamChunk& chunk)
+	{
+		char number[32];
+		text.clear();
+		for (size_t i = 0; i < chunk.rows; ++i) { text.append(number, std::snprintf(number, sizeof(number), "%.17g\n", chunk.out[i])); }
+		if (!output.write(text.data(), text.size())) { throw "Could not write file"; }
+	});
+
+	if (!output.flush()) { throw "Could not write file"; }
+	return result;
+}
+
+size_t StreamEvaluator::chunkRows() const { return rowsPerChunk; }
+
+const NativeProgram& StreamEvaluator::program() const { return *compiled; }
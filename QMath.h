@@ -1,58 +1,422 @@
 #pragma once
 #include <string>
 #include <map>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <unordered_set>
+#include <typeinfo>
+#include <memory>
+#include <mutex>
+#include <atomic>
 #include <cmath>
+#include <stdexcept>
 
 namespace QMath
 {
     bool isNumber(const std::string& numString);
 
+	class ParseError : public std::runtime_error
+	{
+	public:
+		ParseError(const std::string& message, size_t position);
+
+		size_t position() const;
+
+	private:
+		size_t errorPosition;
+	};
+
+	class Bindings
+	{
+	public:
+		Bindings(const std::string& variables);
+		Bindings(const std::map<char, double>& varMap);
+
+		void set(char var, double value);
+		int slot(char var) const { return slots[(unsigned char)var]; }
+		double value(int slot) const { return values[slot]; }
+		const double* data() const;
+		const std::string& variables() const;
+
+	private:
+		std::string variableNames;
+		std::vector<double> values;
+		short slots[256];
+	};
+
+	class Expression;
+
+	struct Dual
+	{
+		double value;
+		double derivative;
+	};
+
+	// Closed range of values. NaN ends mark an empty interval, where the expression is undefined throughout
+	struct Interval
+	{
+		double lower;
+		double upper;
+	};
+
+	// Accuracy of the transcendental functions in compiled programs. Exact calls the C library; Fast uses our own
+	// branch-free approximations, which batches evaluate several points at a time and single points take where they
+	// beat the library (sin, cos, tan, their inverses, sinh and tanh). Measured maximum errors in fast mode, in units
+	// in the last place: exp, sin, cos, acos 1; ln, tanh, asin 2; log10, log, tan, sinh, cosh 3. Powers of e go through
+	// exp; other powers are taken as exp(y ln x), whose error grows with |y ln x| by about 1.5 ulp per unit
+	enum class Precision
+	{
+		Exact,
+		Fast
+	};
+
+	class Program
+	{
+	public:
+		enum class Opcode : unsigned char
+		{
+			Load,
+			Constant,
+			Add,
+			Subtract,
+			Multiply,
+			Divide,
+			Exponent,
+			Sin,
+			Cos,
+			Tan,
+			Sinh,
+			Cosh,
+			Tanh,
+			Arcsin,
+			Arccos,
+			Ln,
+			Log10,
+			Log,
+			Sqrt,
+			Exp
+		};
+
+		struct Instruction
+		{
+			Opcode opcode;
+			unsigned int left;
+			unsigned int right;
+		};
+
+		double evaluate(const double* vars) const;
+		double evaluate(const Bindings& bindings) const;
+		void evaluateBatch(const double* const* vars, double* out, size_t n) const;
+		Dual evaluateWithDerivative(const double* vars, int slot) const;
+		Dual evaluateWithDerivative(const Bindings& bindings, char var) const;
+		void evaluateWithDerivativeBatch(const double* const* vars, int slot, double* out, double* derivatives, size_t n) const;
+		double gradient(const double* vars, double* out) const;
+		double gradient(const Bindings& bindings, double* out) const;
+		const std::string& variables() const;
+		int variableSlot(char var) const;
+		size_t size() const;
+		size_t nodeCount() const;
+		size_t eliminatedCount() const;
+		const Instruction& operator[] (size_t index) const;
+		double constant(unsigned int index) const;
+		Precision precision() const;
+		void setPrecision(Precision precision);
+
+		static bool isBinary(Opcode opcode);
+
+		unsigned int emit(Opcode opcode, unsigned int left = 0, unsigned int right = 0);
+		unsigned int emitConstant(double value);
+		unsigned int emitVariable(char var);
+		unsigned int emitExpression(const Expression* expression);
+		void assignSlots();
+
+	private:
+		struct InstructionEqual
+		{
+			bool operator()(const Instruction& a, const Instruction& b) const;
+		};
+
+		struct InstructionHash
+		{
+			size_t operator()(const Instruction& instruction) const;
+		};
+
+		bool emitPolynomial(const Expression* expression, unsigned int& index);
+		unsigned int emitPolynomial(const std::vector<double>& coefficients, unsigned int x);
+		void execute(const double* vars, double* registers) const;
+		Dual executeDual(const double* vars, int slot, double* values, double* tangents, char* active) const;
+		void gather(const Bindings& bindings, double* vars) const;
+
+		std::vector<Instruction> instructions;
+		std::vector<double> constants;
+		std::string variableNames;
+		std::unordered_map<Instruction, unsigned int, InstructionHash, InstructionEqual> valueNumbers;
+		std::unordered_map<const Expression*, unsigned int> emitted;
+		size_t nodes = 0;
+		Precision mathPrecision = Precision::Exact;
+	};
+
+	// Machine code generated from a program on x86-64 System V targets: SSE2 for single points, and AVX over four
+	// points at a time in batches free of libm calls. Where no code can be generated, the interpreter runs instead
+	class NativeProgram
+	{
+	public:
+		typedef double (*Function)(const double* vars);
+		typedef void (*BatchFunction)(const double* const* vars, double* out, size_t n);
+
+		NativeProgram(const Program& program);
+		~NativeProgram();
+
+		double evaluate(const double* vars) const;
+		double evaluate(const Bindings& bindings) const;
+		void evaluateBatch(const double* const* vars, double* out, size_t n) const;
+		Function function() const;
+		BatchFunction batchFunction() const;
+		bool isNative() const;
+		const Program& program() const;
+
+	private:
+		NativeProgram(const NativeProgram&);
+		NativeProgram& operator= (const NativeProgram&);
+
+		Program interpreted;
+		void* code = nullptr;
+		size_t codeSize = 0;
+		Function scalar = nullptr;
+		BatchFunction batch = nullptr;
+	};
+
+	// An expression tree encoded as one record per node in postfix order: a kind byte, then the node's payload
+	// (a number's value, a variable's name and substituted value, an operator's operand count, a differential's
+	// order or a log's base). Evaluation runs over the records with a value stack, so an encoded tree can be
+	// evaluated where it lies, such as in a mapped file, without building any nodes
+	class SerializedExpression
+	{
+	public:
+		enum class Kind : unsigned char
+		{
+			Number,
+			Variable,
+			SubstitutedVariable,
+			Constant,
+			Add,
+			Subtract,
+			Multiply,
+			Divide,
+			Exponent,
+			Differential,
+			Log,
+			Sin,
+			Cos,
+			Tan,
+			Sinh,
+			Cosh,
+			Tanh,
+			Arcsin,
+			Arccos
+		};
+
+		enum class LogBase : unsigned char
+		{
+			General,
+			Natural,
+			Decimal
+		};
+
+		SerializedExpression(const void* data, size_t size);
+
+		double evaluate() const;
+		double evaluate(const Bindings& bindings) const;
+		Expression* materialise() const;
+		const unsigned char* data() const;
+		size_t size() const;
+		size_t nodeCount() const;
+
+		static void encodeKind(std::string& out, Kind kind);
+		static void encodeValue(std::string& out, double value);
+		static void encodeCount(std::string& out, size_t count);
+
+	private:
+		double execute(const Bindings* bindings) const;
+
+		const unsigned char* records;
+		size_t length;
+		size_t nodes = 0;
+		size_t depth = 0;
+	};
+
+	// Versioned container of encoded expressions: a header holding the format version and expression count, a
+	// table of offsets, then each expression's records. Files are mapped into memory where the platform allows
+	// and their expressions are read in place. The format is in the host's byte order, which the header records
+	class ExpressionFile
+	{
+	public:
+		static const unsigned short formatVersion = 1;
+
+		ExpressionFile(const std::string& path);
+		ExpressionFile(const void* data, size_t size);
+		~ExpressionFile();
+
+		size_t size() const;
+		SerializedExpression operator[] (size_t index) const;
+
+		static std::string encode(const std::vector<Expression*>& expressions);
+		static void write(const std::string& path, const std::vector<Expression*>& expressions);
+
+	private:
+		ExpressionFile(const ExpressionFile&);
+		ExpressionFile& operator= (const ExpressionFile&);
+
+		void readHeader();
+
+		const unsigned char* base = nullptr;
+		size_t length = 0;
+		void* mapping = nullptr;
+		std::vector<unsigned char> buffer;
+		std::vector<SerializedExpression> entries;
+	};
+
+	class ExpressionArena
+	{
+	public:
+		class Scope
+		{
+		public:
+			Scope(ExpressionArena& arena);
+			~Scope();
+
+		private:
+			ExpressionArena* previous;
+		};
+
+		// Sends allocations back to the heap while it lives, for owners such as caches that keep nodes beyond
+		// the arena in scope
+		class Suspension
+		{
+		public:
+			Suspension();
+			~Suspension();
+
+		private:
+			ExpressionArena* previous;
+		};
+
+		ExpressionArena(size_t blockSize = 64 * 1024);
+		~ExpressionArena();
+
+		void reset();
+		size_t nodeCount() const;
+		size_t blockCount() const;
+
+		static void* allocate(size_t size);
+		static void deallocate(void* pointer, size_t size);
+		static bool isPooled(const void* pointer);
+
+	private:
+		static const size_t headerSize = 16;
+		static const size_t sizeClassCount = 16;
+
+		ExpressionArena(const ExpressionArena&);
+		ExpressionArena& operator= (const ExpressionArena&);
+
+		void* allocateNode(size_t size);
+		void releaseNode(void* pointer, size_t size);
+		void* allocateLarge(size_t size);
+		void releaseLarge(void* pointer);
+
+		std::vector<char*> blocks;
+		size_t blockSize;
+		size_t blockIndex;
+		char* cursor;
+		char* end;
+		void* freeLists[sizeClassCount];
+		std::vector<char*> largeBlocks;
+		size_t nodes;
+	};
+
+	// Lets containers inside nodes draw from the same arena as the nodes, so reset() reclaims them too
+	template<typename T>
+	struct ArenaAllocator
+	{
+		typedef T value_type;
+
+		ArenaAllocator() {}
+		template<typename U> ArenaAllocator(const ArenaAllocator<U>&) {}
+
+		T* allocate(size_t n) { return (T*)ExpressionArena::allocate(n * sizeof(T)); }
+		void deallocate(T* pointer, size_t n) { ExpressionArena::deallocate(pointer, n * sizeof(T)); }
+
+		bool operator== (const ArenaAllocator&) const { return true; }
+		bool operator!= (const ArenaAllocator&) const { return false; }
+	};
+
 	class Expression
 	{
 
 	public:
 		virtual ~Expression();
 
+		static void* operator new(size_t size);
+		static void operator delete(void* pointer, size_t size);
+
 		bool operator!= (const Expression &b);
 		virtual bool operator== (const Expression &b) = 0;
 		virtual std::string toString(bool showParentheses = false) = 0;
 		virtual Expression* copyTree() = 0;
 		virtual double evaluate() const = 0;
+		virtual double evaluate(const Bindings& bindings) const = 0;
+		virtual Interval evaluateInterval(const std::map<char, Interval>& ranges) const = 0;
 		virtual Expression* simplify();
 		virtual Expression* differentiate(char diffOperator = 'x') = 0;
+		Expression* partialDerivative(char diffOperator = 'x');
 		virtual bool isConstant() = 0;
 		virtual bool isAtomic();
 		virtual void substitute(const std::map<char, double>& varMap) = 0;
 		virtual unsigned char precedence() = 0;
-		virtual bool isCommutative();
+		virtual bool isCommutative() const;
+		virtual unsigned int emit(Program& program) const = 0;
+		virtual void encode(std::string& out) const = 0;
 
 		double evaluate(const std::map<char, double>& varMap);
 		double evaluate(char var, double value);
+		void evaluateBatch(const double* values, double* out, size_t n, char var = 'x') const;
+		void evaluateBatch(const std::map<char, const double*>& columns, double* out, size_t n) const;
 		void substitute(char var, double value);
+		double gradient(const Bindings& bindings, double* out) const;
+		Dual evaluateWithDerivative(char var, double value) const;
+		Dual evaluateWithDerivative(const Bindings& bindings, char var = 'x') const;
+		void evaluateWithDerivative(const double* values, double* out, double* derivatives, size_t n, char var = 'x') const;
+		Program* compile(Precision precision = Precision::Exact) const;
+		NativeProgram* compileNative(Precision precision = Precision::Exact) const;
+		size_t hash() const;
+		bool polynomialCoefficients(char var, std::vector<double>& coefficients) const;
+		bool rationalCoefficients(char var, std::vector<double>& numerator, std::vector<double>& denominator) const;
+		std::string serialize() const;
         
         static Expression* parse(const std::string& input, bool validateAndRectify = true);
+		static Expression* deserialize(const std::string& data);
+
+	protected:
+		friend class Simplifier;
+		friend class Program;
+
+		static Expression* derivativeOf(Expression* expression, char diffOperator);
+		static bool polynomialOf(const Expression* expression, char& var, bool expand, std::vector<double>& numerator, std::vector<double>& denominator);
+		static Expression* copyOf(Expression* expression);
+		static void discard(Expression* expression);
+
+		virtual size_t computeHash() const = 0;
+		virtual bool polynomialForm(char& var, bool expand, std::vector<double>& numerator, std::vector<double>& denominator) const;
+		void invalidateHash();
 
 	private:
-        struct ExpressionData
-        {
-        public:
-            enum Type
-            {
-                Operator = 0,
-                Function = 1
-            };
-            
-            std::string name;
-            Type type;
-            
-            ExpressionData(std::string name, Type type);
-        };
+        class Parser;
         
-        static Expression* parseBaseCase(const std::string& input);
-        static Expression* parseOperator(const std::string& inputLeft, const std::string& inputRight, const ExpressionData& operatorData);
-        static Expression* parseFunction(const std::string& inputRight, const ExpressionData& operatorData);
-        static std::string cleanseParseInput(std::string input);
-        static unsigned char determineScopeDepth(const std::string& input, int expansionCenter);
+        static Expression* parseOperator(char name, Expression* leftOperand, Expression* rightOperand);
+        static Expression* parseFunction(const std::string& name, Expression* operand);
+
+		mutable std::atomic<size_t> structuralHash{0};
 	};
 
 	class Operator : public Expression
@@ -70,31 +434,78 @@ namespace QMath
 		void determineParentheses(bool& left, bool& right);
 		void toStringOperands(std::string& left, std::string& right);
 
-		template<typename T>
-		static Expression* factoriseLinear(Expression *left, Expression *right);
-
-		template<typename T1, typename T2>
-		static Expression* accumulateExponentIndicies(Expression *left, Expression *right);
-
 		Expression* getLeftOperand();
 		Expression* getRightOperand();
 
 	protected:
+		friend class ExpressionInterner;
+		friend class Simplifier;
+
+		unsigned int emitOperands(Program& program, Program::Opcode opcode) const;
+		void encodeOperands(std::string& out, SerializedExpression::Kind kind) const;
+		size_t computeHash() const;
+
 		Expression *leftOperand;
 		Expression *rightOperand;
 	};
 
-	class Add : public Operator
+	// Commutative, associative operator over any number of operands. Nested operands of the same kind are
+	// flattened into it and the operands are kept sorted by compare(), so equal expressions share one layout
+	class NaryOperator : public Expression
 	{
 	public:
-		using Operator::Operator;
+		typedef std::vector<Expression*, ArenaAllocator<Expression*>> Operands;
+
+		~NaryOperator();
+
+		bool operator== (const Expression &b);
+		bool isConstant();
+		void substitute(const std::map<char, double>& varMap);
+
+		const Operands& getOperands();
+
+		static int compare(Expression* a, Expression* b);
+
+	protected:
+		friend class ExpressionInterner;
+		friend class Simplifier;
+
+		void insert(Expression* operand);
+		void canonicalise();
+		Expression* unwrap(double identity);
+		unsigned int emitOperands(Program& program, Program::Opcode opcode) const;
+		void encodeOperands(std::string& out, SerializedExpression::Kind kind) const;
+		size_t computeHash() const;
+
+		Operands operands;
+	};
+
+	class Add : public NaryOperator
+	{
+	public:
+		Add(Expression *left, Expression *right);
+		Add(double left, Expression *right);
+		Add(Expression *left, double right);
+		Add(double left, double right);
+		Add(const std::vector<Expression*>& operands);
+
+		static Expression* make(Expression *left, Expression *right);
+		static Expression* make(const std::vector<Expression*>& operands);
 
 		std::string toString(bool showParentheses = false);
 		Add* copyTree();
 		double evaluate() const;
-		Add* differentiate(char diffOperator);
-		Expression* simplify();
+		double evaluate(const Bindings& bindings) const;
+		Interval evaluateInterval(const std::map<char, Interval>& ranges) const;
+		unsigned int emit(Program& program) const;
+		void encode(std::string& out) const;
+		Expression* differentiate(char diffOperator);
 		unsigned char precedence();
+
+	private:
+		Add();
+
+		bool polynomialForm(char& var, bool expand, std::vector<double>& numerator, std::vector<double>& denominator) const;
 	};
 
 	class Subtract : public Operator
@@ -102,27 +513,50 @@ namespace QMath
 	public:
 		using Operator::Operator;
 
+		static Expression* make(Expression *left, Expression *right);
+
 		std::string toString(bool showParentheses = false);
 		Subtract* copyTree();
 		double evaluate() const;
-		Subtract* differentiate(char diffOperator);
-		Expression* simplify();
+		double evaluate(const Bindings& bindings) const;
+		Interval evaluateInterval(const std::map<char, Interval>& ranges) const;
+		unsigned int emit(Program& program) const;
+		void encode(std::string& out) const;
+		Expression* differentiate(char diffOperator);
 		unsigned char precedence();
-		bool isCommutative();
+		bool isCommutative() const;
+
+	private:
+		bool polynomialForm(char& var, bool expand, std::vector<double>& numerator, std::vector<double>& denominator) const;
 	};
 
-	class Multiply : public Operator
+	class Multiply : public NaryOperator
 	{
 	public:
-		using Operator::Operator;
+		Multiply(Expression *left, Expression *right);
+		Multiply(double left, Expression *right);
+		Multiply(Expression *left, double right);
+		Multiply(double left, double right);
+		Multiply(const std::vector<Expression*>& operands);
+
+		static Expression* make(Expression *left, Expression *right);
+		static Expression* make(const std::vector<Expression*>& operands);
 
 		std::string toString(bool showParentheses = false);
 		Multiply* copyTree();
 		double evaluate() const;
-		Add* differentiate(char diffOperator);
-		Expression* simplify();
+		double evaluate(const Bindings& bindings) const;
+		Interval evaluateInterval(const std::map<char, Interval>& ranges) const;
+		unsigned int emit(Program& program) const;
+		void encode(std::string& out) const;
+		Expression* differentiate(char diffOperator);
 		unsigned char precedence();
         bool isAtomic();
+
+	private:
+		Multiply();
+
+		bool polynomialForm(char& var, bool expand, std::vector<double>& numerator, std::vector<double>& denominator) const;
 	};
 
 	class Divide : public Operator
@@ -130,13 +564,21 @@ namespace QMath
 	public:
 		using Operator::Operator;
 
+		static Expression* make(Expression *left, Expression *right);
+
 		std::string toString(bool showParentheses = false);
 		Divide* copyTree();
 		double evaluate() const;
-		Divide* differentiate(char diffOperator);
-		Expression* simplify();
+		double evaluate(const Bindings& bindings) const;
+		Interval evaluateInterval(const std::map<char, Interval>& ranges) const;
+		unsigned int emit(Program& program) const;
+		void encode(std::string& out) const;
+		Expression* differentiate(char diffOperator);
 		unsigned char precedence();
-		bool isCommutative();
+		bool isCommutative() const;
+
+	private:
+		bool polynomialForm(char& var, bool expand, std::vector<double>& numerator, std::vector<double>& denominator) const;
 	};
 
 	class Exponent : public Operator
@@ -144,13 +586,21 @@ namespace QMath
 	public:
 		using Operator::Operator;
 
+		static Expression* make(Expression *left, Expression *right);
+
 		std::string toString(bool showParentheses = false);
 		Exponent* copyTree();
 		double evaluate() const;
-		Multiply* differentiate(char diffOperator);
-		Expression* simplify();
+		double evaluate(const Bindings& bindings) const;
+		Interval evaluateInterval(const std::map<char, Interval>& ranges) const;
+		unsigned int emit(Program& program) const;
+		void encode(std::string& out) const;
+		Expression* differentiate(char diffOperator);
 		unsigned char precedence();
-		bool isCommutative();
+		bool isCommutative() const;
+
+	private:
+		bool polynomialForm(char& var, bool expand, std::vector<double>& numerator, std::vector<double>& denominator) const;
 	};
     
     class Differential : public Operator
@@ -162,9 +612,14 @@ namespace QMath
         std::string toString(bool showParentheses = false);
         Differential* copyTree();
         double evaluate() const;
+        double evaluate(const Bindings& bindings) const;
+        Interval evaluateInterval(const std::map<char, Interval>& ranges) const;
+        unsigned int emit(Program& program) const;
+        void encode(std::string& out) const;
         Expression* differentiate(char diffOperator);
         unsigned char precedence();
-        bool isCommutative();
+        bool isCommutative() const;
+        unsigned char getOrder();
         
     private:
         unsigned char order = 1;
@@ -178,14 +633,22 @@ namespace QMath
         std::string toString(bool showParentheses = false);
         Log* copyTree();
         double evaluate() const;
+        double evaluate(const Bindings& bindings) const;
+        Interval evaluateInterval(const std::map<char, Interval>& ranges) const;
+        unsigned int emit(Program& program) const;
+        void encode(std::string& out) const;
         Expression* differentiate(char diffOperator);
         unsigned char precedence();
-        bool isCommutative();
-        Expression* simplify();
+        bool isCommutative() const;
         
     private:
-        bool isNatural;
-        bool is10;
+        friend class Simplifier;
+        friend class ExpressionInterner;
+
+        void classifyBase();
+
+        bool isNatural = false;
+        bool is10 = false;
         unsigned char order = 1;
     };
 
@@ -199,6 +662,10 @@ namespace QMath
 		std::string toString(bool showParentheses = false);
 		Number* copyTree();
 		double evaluate() const;
+		double evaluate(const Bindings& bindings) const;
+		Interval evaluateInterval(const std::map<char, Interval>& ranges) const;
+		unsigned int emit(Program& program) const;
+		void encode(std::string& out) const;
 		bool isConstant();
 		Number* differentiate(char diffOperator);
 		bool isAtomic();
@@ -206,6 +673,9 @@ namespace QMath
 		unsigned char precedence();
 
 	private:
+		size_t computeHash() const;
+		bool polynomialForm(char& var, bool expand, std::vector<double>& numerator, std::vector<double>& denominator) const;
+
 		double value;
 	};
 
@@ -219,6 +689,10 @@ namespace QMath
 		std::string toString(bool showParentheses = false);
 		Variable* copyTree();
 		double evaluate() const;
+		double evaluate(const Bindings& bindings) const;
+		Interval evaluateInterval(const std::map<char, Interval>& ranges) const;
+		unsigned int emit(Program& program) const;
+		void encode(std::string& out) const;
 		bool isConstant();
 		Expression* differentiate(char diffOperator);
 		char charID();
@@ -227,6 +701,9 @@ namespace QMath
 		unsigned char precedence();
 
 	protected:
+		size_t computeHash() const;
+		bool polynomialForm(char& var, bool expand, std::vector<double>& numerator, std::vector<double>& denominator) const;
+
 		char var;
 		double value;
 	};
@@ -239,6 +716,13 @@ namespace QMath
         
 		Number* differentiate(char diffOperator);
         Constant* copyTree();
+        double evaluate(const Bindings& bindings) const;
+        Interval evaluateInterval(const std::map<char, Interval>& ranges) const;
+        unsigned int emit(Program& program) const;
+        void encode(std::string& out) const;
+
+	private:
+		bool polynomialForm(char& var, bool expand, std::vector<double>& numerator, std::vector<double>& denominator) const;
 	};
 
 	class Func : public Expression
@@ -252,8 +736,16 @@ namespace QMath
 		bool isConstant();
 		void substitute(const std::map<char, double>& varMap);
 		unsigned char precedence();
+		Expression* getOperand();
 
 	protected:
+		friend class ExpressionInterner;
+		friend class Simplifier;
+
+		unsigned int emitOperand(Program& program, Program::Opcode opcode) const;
+		void encodeOperand(std::string& out, SerializedExpression::Kind kind) const;
+		size_t computeHash() const;
+
 		Expression *operand;
 	};
 
@@ -265,8 +757,11 @@ namespace QMath
 		std::string toString(bool showParentheses = false);
 		Sin* copyTree();
 		double evaluate() const;
-		Multiply* differentiate(char diffOperator);
-		Sin* simplify();
+		double evaluate(const Bindings& bindings) const;
+		Interval evaluateInterval(const std::map<char, Interval>& ranges) const;
+		unsigned int emit(Program& program) const;
+		void encode(std::string& out) const;
+		Expression* differentiate(char diffOperator);
 	};
 
 	class Cos : public Func
@@ -277,8 +772,11 @@ namespace QMath
 		std::string toString(bool showParentheses = false);
 		Cos* copyTree();
 		double evaluate() const;
-		Multiply* differentiate(char diffOperator);
-		Cos* simplify();
+		double evaluate(const Bindings& bindings) const;
+		Interval evaluateInterval(const std::map<char, Interval>& ranges) const;
+		unsigned int emit(Program& program) const;
+		void encode(std::string& out) const;
+		Expression* differentiate(char diffOperator);
 	};
     
     class Tan : public Func
@@ -289,8 +787,11 @@ namespace QMath
         std::string toString(bool showParentheses = false);
         Tan* copyTree();
         double evaluate() const;
-        Multiply* differentiate(char diffOperator);
-        Tan* simplify();
+        double evaluate(const Bindings& bindings) const;
+        Interval evaluateInterval(const std::map<char, Interval>& ranges) const;
+        unsigned int emit(Program& program) const;
+        void encode(std::string& out) const;
+        Expression* differentiate(char diffOperator);
     };
 
 	class Sinh : public Func
@@ -301,8 +802,11 @@ namespace QMath
 		std::string toString(bool showParentheses = false);
 		Sinh* copyTree();
 		double evaluate() const;
-		Multiply* differentiate(char diffOperator);
-		Sinh* simplify();
+		double evaluate(const Bindings& bindings) const;
+		Interval evaluateInterval(const std::map<char, Interval>& ranges) const;
+		unsigned int emit(Program& program) const;
+		void encode(std::string& out) const;
+		Expression* differentiate(char diffOperator);
 	};
 
 	class Cosh : public Func
@@ -313,8 +817,11 @@ namespace QMath
 		std::string toString(bool showParentheses = false);
 		Cosh* copyTree();
 		double evaluate() const;
-		Multiply* differentiate(char diffOperator);
-		Cosh* simplify();
+		double evaluate(const Bindings& bindings) const;
+		Interval evaluateInterval(const std::map<char, Interval>& ranges) const;
+		unsigned int emit(Program& program) const;
+		void encode(std::string& out) const;
+		Expression* differentiate(char diffOperator);
 	};
 
 	class Tanh : public Func
@@ -325,8 +832,11 @@ namespace QMath
 		std::string toString(bool showParentheses = false);
 		Tanh* copyTree();
 		double evaluate() const;
-		Multiply* differentiate(char diffOperator);
-		Tanh* simplify();
+		double evaluate(const Bindings& bindings) const;
+		Interval evaluateInterval(const std::map<char, Interval>& ranges) const;
+		unsigned int emit(Program& program) const;
+		void encode(std::string& out) const;
+		Expression* differentiate(char diffOperator);
 	};
 
 	class Arcsin : public Func
@@ -337,8 +847,11 @@ namespace QMath
 		std::string toString(bool showParentheses = false);
 		Arcsin* copyTree();
 		double evaluate() const;
-		Divide* differentiate(char diffOperator);
-		Arcsin* simplify();
+		double evaluate(const Bindings& bindings) const;
+		Interval evaluateInterval(const std::map<char, Interval>& ranges) const;
+		unsigned int emit(Program& program) const;
+		void encode(std::string& out) const;
+		Expression* differentiate(char diffOperator);
 	};
 
 	class Arccos : public Func
@@ -349,13 +862,293 @@ namespace QMath
 		std::string toString(bool showParentheses = false);
 		Arccos* copyTree();
 		double evaluate() const;
-		Divide* differentiate(char diffOperator);
-		Arccos* simplify();
+		double evaluate(const Bindings& bindings) const;
+		Interval evaluateInterval(const std::map<char, Interval>& ranges) const;
+		unsigned int emit(Program& program) const;
+		void encode(std::string& out) const;
+		Expression* differentiate(char diffOperator);
+	};
+
+	class Simplifier
+	{
+	public:
+		struct Statistic
+		{
+			const char* rule;
+			size_t hits;
+		};
+
+		Simplifier(unsigned int maxPasses = 16);
+
+		Expression* simplify(Expression* expression);
+		std::vector<Statistic> statistics() const;
+		unsigned int passes() const;
+
+	private:
+		struct Rule
+		{
+			const char* name;
+			const std::type_info* type;
+			Expression* (Simplifier::*apply)(Expression* node);
+		};
+
+		static const Rule rules[];
+		static const size_t ruleCount;
+
+		Expression* rewrite(Expression* node);
+		Expression* reduce(Expression* node);
+
+		Expression* foldConstant(Expression* node);
+		Expression* combineLiterals(Expression* node);
+		Expression* removeIdentity(Expression* node);
+		Expression* addCollect(Expression* node);
+		Expression* addFactorise(Expression* node);
+		Expression* subtractZero(Expression* node);
+		Expression* subtractSame(Expression* node);
+		Expression* factoriseLinear(Expression* node);
+		Expression* multiplyZero(Expression* node);
+		Expression* multiplyCollect(Expression* node);
+		Expression* divideZero(Expression* node);
+		Expression* divideOne(Expression* node);
+		Expression* divideSame(Expression* node);
+		Expression* exponentBase(Expression* node);
+		Expression* exponentIndex(Expression* node);
+		Expression* exponentNested(Expression* node);
+		Expression* exponentLog(Expression* node);
+		Expression* logSame(Expression* node);
+		Expression* logExponent(Expression* node);
+		Expression* accumulateExponentIndicies(Expression* node);
+
+		std::vector<size_t> hits;
+		unsigned int maxPasses;
+		unsigned int passCount = 0;
+		bool changed = false;
+	};
+
+	class ExpressionInterner
+	{
+	public:
+		ExpressionInterner();
+		~ExpressionInterner();
+
+		Expression* intern(Expression* expression);
+		Expression* differentiate(Expression* expression, char diffOperator = 'x', unsigned int order = 1);
+		double evaluate(Expression* expression, const Bindings& bindings);
+		bool contains(const Expression* expression) const;
+		size_t size() const;
+		size_t eliminatedCount() const;
+
+	private:
+		struct Key
+		{
+			const std::type_info* type;
+			unsigned long long payload;
+			char var;
+			const Expression* left;
+			const Expression* right;
+			std::vector<const Expression*> operands;
+
+			bool operator== (const Key& b) const;
+		};
+
+		struct KeyHash
+		{
+			size_t operator()(const Key& key) const;
+		};
+
+		friend class Expression;
+
+		ExpressionInterner(const ExpressionInterner&);
+		ExpressionInterner& operator= (const ExpressionInterner&);
+
+		Key makeKey(Expression* expression);
+		void release(Expression* expression);
+		Expression* rehome(Expression* expression);
+
+		std::unordered_map<Key, Expression*, KeyHash> nodes;
+		std::unordered_set<const Expression*> owned;
+		std::unordered_map<const Expression*, std::unique_ptr<Program>> programs;
+		std::map<std::pair<const Expression*, char>, Expression*> derivatives;
+		size_t eliminated = 0;
+	};
+
+	class ExpressionCache
+	{
+	public:
+		struct Entry
+		{
+			std::shared_ptr<const Expression> expression;
+			std::shared_ptr<const Program> program;
+		};
+
+		struct Statistics
+		{
+			size_t hits;
+			size_t misses;
+			size_t evictions;
+			size_t entries;
+			size_t bytes;
+		};
+
+		ExpressionCache(size_t maxEntries, size_t maxBytes = 0, size_t shardCount = 16);
+
+		Entry get(const std::string& input);
+		Statistics statistics() const;
+		void clear();
+
+		static std::string normalize(const std::string& input);
+
+	private:
+		struct Node
+		{
+			std::string key;
+			Entry entry;
+			size_t size;
+		};
+
+		struct Shard
+		{
+			std::mutex mutex;
+			std::list<Node> entries;
+			std::unordered_map<std::string, std::list<Node>::iterator> index;
+			size_t bytes = 0;
+			size_t hits = 0;
+			size_t misses = 0;
+			size_t evictions = 0;
+		};
+
+		static size_t estimateSize(const std::string& key, const Entry& entry);
+
+		std::vector<std::unique_ptr<Shard>> shards;
+		size_t maxShardEntries;
+		size_t maxShardBytes;
+	};
+
+	struct IntegrationResult
+	{
+		double value;
+		double error;
+		size_t evaluations;
+		bool converged;
+	};
+
+	enum class SamplingMethod
+	{
+		Random,
+		Halton,
+		Sobol,
+		Stratified
+	};
+
+	struct MonteCarloResult
+	{
+		double value;
+		double error;
+		size_t samples;
+		double samplesPerSecond;
+	};
+
+	// Global extremum over a box: value is the best found, attained at point, and bound is a guaranteed bound
+	// on the true extremum from the other side, so the two enclose it
+	struct ExtremumResult
+	{
+		double value;
+		double bound;
+		std::map<char, double> point;
+		size_t boxes;
+		bool converged;
+	};
+
+	class NumericalMethods
+	{
+	public:
+		static double integrateTrapezium(Expression *expression, double a, double b, int n, char var = 'x', unsigned int threads = 0);
+		static IntegrationResult integrateGaussKronrod(Expression *expression, double a, double b, double absoluteTolerance = 1e-10,
+			double relativeTolerance = 1e-10, char var = 'x', size_t maxIntervals = 2000);
+		static IntegrationResult integrateRomberg(Expression *expression, double a, double b, double absoluteTolerance = 1e-10,
+			double relativeTolerance = 1e-10, char var = 'x', unsigned int maxLevels = 24);
+		static MonteCarloResult integrateMonteCarlo(Expression *expression, const std::map<char, std::pair<double, double>>& bounds,
+			size_t samples, SamplingMethod method = SamplingMethod::Random, unsigned long long seed = 0, unsigned int threads = 0);
+		static ExtremumResult findMinimum(Expression *expression, const std::map<char, Interval>& box, double tolerance = 1e-8, size_t maxBoxes = 100000);
+		static ExtremumResult findMaximum(Expression *expression, const std::map<char, Interval>& box, double tolerance = 1e-8, size_t maxBoxes = 100000);
+	};
+
+	enum class RootMethod
+	{
+		Newton,
+		Halley,
+		Brent,
+		Bisection
+	};
+
+	struct RootResult
+	{
+		double root;
+		double residual;
+		unsigned int iterations;
+		bool converged;
+	};
+
+	// Solves f(x) = 0 for many problems at once, each with its own values of the other variables. The partial
+	// derivatives are taken and compiled once; every iteration then evaluates all unconverged problems as one batch
+	class RootFinder
+	{
+	public:
+		RootFinder(Expression *expression, char var = 'x');
+
+		void solve(const std::map<char, const double*>& parameters, const double* initial, RootResult* results, size_t n,
+			RootMethod method = RootMethod::Newton, double tolerance = 1e-12, unsigned int maxIterations = 50) const;
+		void solveBracketed(const std::map<char, const double*>& parameters, const double* lower, const double* upper, RootResult* results,
+			size_t n, RootMethod method = RootMethod::Brent, double tolerance = 1e-12, unsigned int maxIterations = 100) const;
+
+	private:
+		void evaluate(const NativeProgram& program, const std::map<char, const double*>& parameters, const std::vector<size_t>& lanes,
+			const std::vector<double>& x, std::vector<double>& out) const;
+
+		char var;
+		std::unique_ptr<NativeProgram> value;
+		std::unique_ptr<NativeProgram> slope;
+		std::unique_ptr<NativeProgram> curvature;
+	};
+
+	struct StreamResult
+	{
+		size_t rows;
+		size_t chunks;
+		double seconds;
 	};
 
-	static class NumericalMethods
+	// Evaluates an expression over every row of a columnar dataset too large to load. A reader thread fills chunks
+	// of the input columns, the calling thread evaluates each chunk as one batch and a writer thread appends the
+	// results, so I/O overlaps compute and no more than slotCount chunks are held at once, whatever the file size.
+	// Binary columns are files of doubles in the host's byte order, mapped a chunk at a time, and their results are
+	// written the same way. CSV input needs a header row naming its columns; quoted fields may not span lines, and
+	// empty fields read as NaN. Its results are written as a one-column CSV file
+	class StreamEvaluator
 	{
 	public:
-		static double integrateTrapezium(Expression *expression, double a, double b, int n, char var = 'x');
+		static const size_t slotCount = 3;
+
+		StreamEvaluator(Expression *expression, size_t chunkRows = 65536, Precision precision = Precision::Exact);
+
+		StreamResult evaluateBinary(const std::map<char, std::string>& columns, const std::string& outputPath) const;
+		StreamResult evaluateCsv(const std::string& inputPath, const std::map<char, std::string>& columns, const std::string& outputPath,
+			const std::string& outputName = "result", char delimiter = ',') const;
+		size_t chunkRows() const;
+		const NativeProgram& program() const;
+
+	private:
+		std::unique_ptr<NativeProgram> compiled;
+		size_t rowsPerChunk;
+	};
+}
+
+namespace std
+{
+	// Structural hash, so expressions can key unordered containers through a hasher over pointers or references
+	template<>
+	struct hash<QMath::Expression>
+	{
+		size_t operator()(const QMath::Expression& expression) const { return expression.hash(); }
 	};
 }
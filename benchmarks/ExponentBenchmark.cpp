@@ -0,0 +1,110 @@
+// Times Exponent nodes with constant indices, which are strength-reduced to squaring and square roots, against
+// the same expressions with the index read from a variable, which still go through pow. x^2.7 takes pow either
+// way, so its row shows the cost of reading the index from a variable rather than of pow. Build and run from the
+// repository root with
+//   g++ -std=c++11 -O2 -pthread -I. benchmarks/ExponentBenchmark.cpp QMath.cpp -o ExponentBenchmark && ./ExponentBenchmark
+#include "QMath.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <vector>
+
+using namespace QMath;
+
+static const size_t pointCount = 1 << 20;
+static const int repeats = 5;
+
+struct Timing
+{
+	double tree;
+	double interpreted;
+	double native;
+	std::vector<double> values;
+};
+
+// Best of several runs, in milliseconds per million points
+template<typename Run>
+static double best(Run run)
+{
+	double fastest = 1e300;
+	for (int i = 0; i < repeats; ++i)
+	{
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		run();
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		fastest = std::min(fastest, seconds * 1e9 / pointCount);
+	}
+	return fastest;
+}
+
+static Timing measure(const std::string& input, const std::vector<double>& x, double index)
+{
+	std::unique_ptr<Expression> expression(Expression::parse(input));
+	std::unique_ptr<Program> program(expression->compile());
+	std::unique_ptr<NativeProgram> native(expression->compileNative());
+	std::vector<double> k(x.size(), index);
+	std::vector<double> out(x.size());
+
+	std::vector<const double*> vars;
+	for (char var : program->variables()) { vars.push_back(var == 'k' ? k.data() : x.data()); }
+
+	Timing timing;
+	Bindings bindings(program->variables());
+	if (bindings.slot('k') >= 0) { bindings.set('k', index); }
+	timing.tree = best([&]()
+	{
+		for (size_t i = 0; i < x.size(); ++i)
+		{
+			bindings.set('x', x[i]);
+			out[i] = expression->evaluate(bindings);
+		}
+	});
+	timing.interpreted = best([&]() { program->evaluateBatch(vars.data(), out.data(), x.size()); });
+	timing.native = best([&]() { native->evaluateBatch(vars.data(), out.data(), x.size()); });
+
+	timing.values.swap(out);
+	return timing;
+}
+
+int main()
+{
+	struct Case
+	{
+		const char* name;
+		const char* reduced;
+		const char* general;
+		double index;
+	};
+
+	static const Case cases[] = {
+		{ "x^2", "x^2", "x^k", 2 },
+		{ "sqrt(x)", "sqrt(x)", "x^k", 0.5 },
+		{ "invsqrt(x)", "invsqrt(x)", "x^k", -0.5 },
+		{ "sec(x)", "sec(x)", "cos(x)^k", -1 },
+		{ "x^3.5", "x^3.5", "x^k", 3.5 },
+		{ "x^17", "x^17", "x^k", 17 },
+		{ "x^2.7", "x^2.7", "x^k", 2.7 }
+	};
+
+	std::vector<double> x(pointCount);
+	for (size_t i = 0; i < pointCount; ++i) { x[i] = 0.5 + 1.5 * i / pointCount; }
+
+	std::printf("ms per million points, pow -> constant index\n\n");
+	std::printf("%-12s %-18s %-18s %-18s %s\n", "", "tree", "interpreter batch", "native batch", "max relative difference");
+	for (const Case& test : cases)
+	{
+		Timing general = measure(test.general, x, test.index);
+		Timing reduced = measure(test.reduced, x, test.index);
+		double difference = 0;
+		for (size_t i = 0; i < pointCount; ++i)
+		{
+			difference = std::max(difference, std::fabs(reduced.values[i] - general.values[i]) / std::fabs(general.values[i]));
+		}
+		std::printf("%-12s %6.1f -> %-8.1f %6.1f -> %-8.1f %6.1f -> %-8.1f %.2g\n", test.name, general.tree, reduced.tree,
+			general.interpreted, reduced.interpreted, general.native, reduced.native, difference);
+	}
+	return 0;
+}
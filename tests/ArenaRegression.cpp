@@ -0,0 +1,65 @@
+// Regression checks for owners that keep nodes beyond an ExpressionArena in scope. Build and run from the
+// repository root, ideally with -fsanitize=address, with
+//   g++ -std=c++11 -pthread -I. tests/ArenaRegression.cpp QMath.cpp -o ArenaRegression && ./ArenaRegression
+#include "QMath.h"
+#include <cmath>
+#include <cstdio>
+#include <map>
+#include <memory>
+
+using namespace QMath;
+
+static int failures = 0;
+
+static void check(const char* name, bool passed)
+{
+	if (!passed)
+	{
+		std::printf("FAIL %s\n", name);
+		++failures;
+	}
+}
+
+int main()
+{
+	std::map<char, double> varMap = { { 'x', 0.75 }, { 'y', 2 } };
+	Bindings bindings(varMap);
+
+	// A cache entry created inside a scope must survive the arena
+	ExpressionCache cache(16);
+	{
+		ExpressionArena arena;
+		ExpressionArena::Scope scope(arena);
+		cache.get("x^2 + sin(y)");
+	}
+	{
+		ExpressionArena arena;
+		ExpressionArena::Scope scope(arena);
+		ExpressionCache::Entry entry = cache.get("x^2 + sin(y)");
+		check("cache entry", entry.expression->evaluate(bindings) == 0.75 * 0.75 + std::sin(2.0));
+	}
+
+	// Nodes interned from an arena tree, and derivatives taken inside a scope, must too
+	ExpressionInterner interner;
+	Expression* interned;
+	Expression* derivative;
+	{
+		ExpressionArena arena;
+		ExpressionArena::Scope scope(arena);
+		interned = interner.intern(Expression::parse("log(x * y) + y*x"));
+		derivative = interner.differentiate(Expression::parse("x^3 + ln(x)"), 'x');
+		check("arena used", arena.blockCount() > 0);
+		check("nothing left in the arena", arena.nodeCount() == 0);
+	}
+	{
+		ExpressionArena arena;
+		ExpressionArena::Scope scope(arena);
+		Expression* again = interner.intern(Expression::parse("log(x * y) + y*x"));
+		check("interned node shared", again == interned);
+		check("interned value", std::fabs(interner.evaluate(interned, bindings) - (std::log10(1.5) + 1.5)) < 1e-15);
+		check("derivative value", std::fabs(interner.evaluate(derivative, bindings) - (3 * 0.75 * 0.75 + 1 / 0.75)) < 1e-12);
+	}
+
+	std::printf(failures ? "%d failures\n" : "All arena checks passed\n", failures);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,54 @@
+// Regression checks for the adaptive integrators. Build and run from the repository root with
+//   g++ -std=c++11 -pthread -I. tests/IntegrationRegression.cpp QMath.cpp -o IntegrationRegression && ./IntegrationRegression
+#include "QMath.h"
+#include <cmath>
+#include <cstdio>
+#include <limits>
+#include <memory>
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+using namespace QMath;
+
+static int failures = 0;
+
+static void check(const char* name, bool passed)
+{
+	if (!passed)
+	{
+		std::printf("FAIL %s\n", name);
+		++failures;
+	}
+}
+
+// Integrands that are NaN or infinite somewhere in the range must end without converging rather than loop
+static void checkNonFinite(const char* input, double a, double b)
+{
+	std::unique_ptr<Expression> expression(Expression::parse(input));
+	IntegrationResult kronrod = NumericalMethods::integrateGaussKronrod(expression.get(), a, b);
+	IntegrationResult romberg = NumericalMethods::integrateRomberg(expression.get(), a, b);
+	std::printf("%-10s [%g, %g]  Gauss-Kronrod %g (%zu evaluations), Romberg %g (%zu evaluations)\n", input, a, b,
+		kronrod.value, kronrod.evaluations, romberg.value, romberg.evaluations);
+	check(input, !kronrod.converged && !romberg.converged);
+}
+
+int main()
+{
+	const double infinity = std::numeric_limits<double>::infinity();
+
+	checkNonFinite("x^0.5", -1, 1);
+	checkNonFinite("ln(x)", -1, 1);
+	checkNonFinite("1/x", -1, 1);
+	checkNonFinite("1/(1+x)", 0, infinity);
+
+	// Still converges where it should
+	std::unique_ptr<Expression> gaussian(Expression::parse("e^(0-x^2)"));
+	IntegrationResult kronrod = NumericalMethods::integrateGaussKronrod(gaussian.get(), -infinity, infinity);
+	IntegrationResult romberg = NumericalMethods::integrateRomberg(gaussian.get(), -infinity, infinity, 1e-8, 1e-8);
+	check("Gauss-Kronrod e^(-x^2)", kronrod.converged && std::fabs(kronrod.value - std::sqrt(M_PI)) < 1e-9);
+	check("Romberg e^(-x^2)", romberg.converged && std::fabs(romberg.value - std::sqrt(M_PI)) < 1e-6);
+
+	std::printf(failures ? "%d failures\n" : "All integration checks passed\n", failures);
+	return failures ? 1 : 0;
+}
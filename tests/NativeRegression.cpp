@@ -0,0 +1,142 @@
+// Differential checks of native code against the interpreter: each expression is compiled both ways and evaluated
+// over the same points, one at a time and in batches, in both precisions. The two run the same instructions through
+// the same functions, so results must agree to the bit. Build and run from the repository root with
+//   g++ -std=c++11 -pthread -I. tests/NativeRegression.cpp QMath.cpp -o NativeRegression && ./NativeRegression
+#include "QMath.h"
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace QMath;
+
+static int failures = 0;
+static std::mt19937 generator(20240611);
+
+// An odd count leaves a tail after the four-wide vector loop
+static const size_t pointCount = 1001;
+
+static bool same(double a, double b) { return std::memcmp(&a, &b, sizeof(double)) == 0 || (std::isnan(a) && std::isnan(b)); }
+
+static bool uses(const Program& program, Program::Opcode opcode)
+{
+	for (size_t i = 0; i < program.size(); ++i)
+	{
+		if (program[i].opcode == opcode) { return true; }
+	}
+	return false;
+}
+
+static void compare(const std::string& input, Precision precision, const std::vector<double>& x, const std::vector<double>& y)
+{
+	std::unique_ptr<Expression> expression(Expression::parse(input));
+	std::unique_ptr<Program> program(expression->compile(precision));
+	std::unique_ptr<NativeProgram> native(expression->compileNative(precision));
+
+	std::vector<const double*> vars;
+	for (char var : program->variables()) { vars.push_back(var == 'x' ? x.data() : y.data()); }
+	std::vector<double> interpreted(pointCount);
+	std::vector<double> compiled(pointCount);
+	program->evaluateBatch(vars.data(), interpreted.data(), pointCount);
+	native->evaluateBatch(vars.data(), compiled.data(), pointCount);
+
+	const char* mode = precision == Precision::Fast ? "fast" : "exact";
+	for (size_t i = 0; i < pointCount; ++i)
+	{
+		double point[2];
+		for (size_t j = 0; j < vars.size(); ++j) { point[j] = vars[j][i]; }
+		double single = native->evaluate(point);
+		if (!same(compiled[i], interpreted[i]) || !same(single, program->evaluate(point)))
+		{
+			std::printf("FAIL %s (%s) at x = %.17g, y = %.17g: native %.17g and %.17g, interpreter %.17g and %.17g\n", input.c_str(), mode,
+				x[i], y[i], compiled[i], single, interpreted[i], program->evaluate(point));
+			++failures;
+			return;
+		}
+	}
+}
+
+// Checks that the expression compiles without a pow call, so the comparison covers the rewritten form
+static void checkReduced(const char* input)
+{
+	std::unique_ptr<Expression> expression(Expression::parse(input));
+	std::unique_ptr<Program> program(expression->compile());
+	if (uses(*program, Program::Opcode::Exponent))
+	{
+		std::printf("FAIL %s still takes pow\n", input);
+		++failures;
+	}
+}
+
+static int uniform(int n) { return std::uniform_int_distribution<int>(0, n - 1)(generator); }
+
+static std::string randomExpression(int depth)
+{
+	static const char* const numbers[] = { "2", "0.5", "3.25", "1.5", "7" };
+	static const char* const functions[] = { "sin", "cos", "tan", "sinh", "cosh", "tanh", "arcsin", "arccos", "ln", "log", "sqrt" };
+	static const char* const indices[] = { "2", "3", "4", "7", "17", "0.5", "2.5", "-1", "-2", "-0.5", "-3.5", "2.7" };
+
+	switch (depth > 0 ? uniform(10) : uniform(2))
+	{
+		case 0: return uniform(2) ? "x" : "y";
+		case 1: return numbers[uniform(5)];
+		case 2: return "(" + randomExpression(depth - 1) + " + " + randomExpression(depth - 1) + ")";
+		case 3: return "(" + randomExpression(depth - 1) + " - " + randomExpression(depth - 1) + ")";
+		case 4: return "(" + randomExpression(depth - 1) + " * " + randomExpression(depth - 1) + ")";
+		case 5: return "(" + randomExpression(depth - 1) + " / " + randomExpression(depth - 1) + ")";
+		case 6: return "(" + randomExpression(depth - 1) + ")^" + indices[uniform(12)];
+		case 7: return "e^(" + randomExpression(depth - 1) + ")";
+		case 8: return std::string(functions[uniform(11)]) + "(" + randomExpression(depth - 1) + ")";
+		default:
+		{
+			// A polynomial in one variable, which compiles by Horner's rule or Estrin's scheme
+			std::string var = uniform(2) ? "x" : "y";
+			std::string result = numbers[uniform(5)];
+			for (int degree = 1, top = 2 + uniform(8); degree <= top; ++degree)
+			{
+				if (degree < top && uniform(3) == 0) { continue; }
+				result += (uniform(2) ? " + " : " - ") + std::string(numbers[uniform(5)]) + var + "^" + std::to_string(degree);
+			}
+			return "(" + result + ")";
+		}
+	}
+}
+
+int main()
+{
+	std::vector<double> x(pointCount);
+	std::vector<double> y(pointCount);
+	for (size_t i = 0; i < pointCount; ++i)
+	{
+		x[i] = -3 + 6.0 * i / (pointCount - 1);
+		y[i] = 0.05 + 4.0 * i / (pointCount - 1);
+	}
+
+	static const char* const cases[] = {
+		// Polynomials by Horner's rule, then Estrin's scheme
+		"3x^2 + 2x + 1", "x^3 - x", "x^5 - 3x^3 + x - 2", "(x^6 + 2x^4 - x) / 3", "x^9 + x^8 + 2x^2 + 7", "2y^4 - y",
+		// Powers by squaring, square roots and reciprocals
+		"x^2", "x^17", "x^-3", "y^0.5", "y^-0.5", "y^3.5", "(x + y)^-2", "sin(x)^4",
+		// Powers through pow and exp
+		"y^2.7", "y^x", "e^x", "e^(x * y)"
+	};
+	for (const char* input : cases)
+	{
+		compare(input, Precision::Exact, x, y);
+		compare(input, Precision::Fast, x, y);
+	}
+	for (int i = 0; i < 14; ++i) { checkReduced(cases[i]); }
+
+	for (int i = 0; i < 300; ++i)
+	{
+		std::string input = randomExpression(4);
+		compare(input, Precision::Exact, x, y);
+		compare(input, Precision::Fast, x, y);
+	}
+
+	std::printf(failures ? "%d failures\n" : "All native checks passed\n", failures);
+	return failures ? 1 : 0;
+}
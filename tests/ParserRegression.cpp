@@ -0,0 +1,64 @@
+// Regression checks for Expression::parse. Build and run from the repository root with
+//   g++ -std=c++11 -pthread -I. tests/ParserRegression.cpp QMath.cpp -o ParserRegression && ./ParserRegression
+#include "QMath.h"
+#include <cmath>
+#include <cstdio>
+#include <map>
+#include <memory>
+#ifndef M_E
+#define M_E 2.7182818284590452353602874
+#endif
+
+using namespace QMath;
+
+static int failures = 0;
+
+static void check(const char* input, double expected)
+{
+	std::map<char, double> varMap = { { 'x', 1.25 }, { 'y', -0.5 } };
+	std::unique_ptr<Expression> expression(Expression::parse(input));
+	double value = expression->evaluate(Bindings(varMap));
+	if (std::fabs(value - expected) > 1e-12 * std::max(1.0, std::fabs(expected)))
+	{
+		std::printf("FAIL %s: %s = %.17g, expected %.17g\n", input, expression->toString().c_str(), value, expected);
+		++failures;
+	}
+}
+
+int main()
+{
+	const double x = 1.25;
+	const double y = -0.5;
+
+	// Signed exponents stay in the literal
+	check("1e-5", 1e-5);
+	check("1.5e+2", 150);
+	check("2.5E-4", 2.5e-4);
+	check("1e-5+2", 1e-5 + 2);
+	check("x*1e-3", x * 1e-3);
+	check("x-1e-2", x - 1e-2);
+	check("2e-5x", 2e-5 * x);
+	check("sin(1e-3)", std::sin(1e-3));
+
+	// Without a digit after the sign, e is Euler's number
+	check("e-5", M_E - 5);
+	check("2e-x", 2 * M_E - x);
+	check("xe-5", x * M_E - 5);
+
+	// Implicit multiplication
+	check("2x", 2 * x);
+	check("x(y+1)", x * (y + 1));
+	check("2(x)(y)", 2 * x * y);
+	check("3xy", 3 * x * y);
+
+	// Unary minus
+	check("-x", -x);
+	check("-2^2", -4);
+	check("-(x+1)", -(x + 1));
+	check("4-(-2)", 6);
+	check("-3x", -3 * x);
+	check("x^-1", 1 / x);
+
+	std::printf(failures ? "%d failures\n" : "All parser checks passed\n", failures);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,57 @@
+// Regression checks for powers with constant indices, which trees evaluate by squaring rather than pow. Build and
+// run from the repository root with
+//   g++ -std=c++11 -pthread -I. tests/PowerRegression.cpp QMath.cpp -o PowerRegression && ./PowerRegression
+#include "QMath.h"
+#include <cmath>
+#include <cstdio>
+#include <limits>
+#include <map>
+#include <memory>
+#include <string>
+
+using namespace QMath;
+
+static int failures = 0;
+
+// Squaring may differ from pow by a few ulp; near and below the normal range only the leading digits are kept
+static void check(double x, const char* index)
+{
+	std::string input = std::string("x^") + index;
+	std::map<char, double> varMap = { { 'x', x } };
+	std::unique_ptr<Expression> expression(Expression::parse(input));
+	double value = expression->evaluate(Bindings(varMap));
+	double expected = std::pow(x, std::stod(index));
+	bool passed = std::isnan(expected) ? std::isnan(value) : value == expected || std::fabs(value - expected) <= 1e-13 * std::fabs(expected);
+	if (!passed)
+	{
+		std::printf("FAIL %s at x = %g: %.17g, expected %.17g\n", input.c_str(), x, value, expected);
+		++failures;
+	}
+}
+
+int main()
+{
+	const double infinity = std::numeric_limits<double>::infinity();
+
+	// Reciprocals whose positive power overflows, or whose quotient is subnormal
+	check(1e10, "-32");
+	check(-1e10, "-31");
+	check(1e10, "-31.5");
+	check(1e20, "-16");
+	check(1e-10, "-31");
+	check(3e-160, "-2");
+
+	// Ordinary values and the special cases
+	check(2.5, "-3");
+	check(2.5, "-0.5");
+	check(2.5, "17");
+	check(-2.5, "3");
+	check(0.0, "-2");
+	check(-0.0, "-3");
+	check(-0.0, "-0.5");
+	check(infinity, "-2");
+	check(-infinity, "-3");
+
+	std::printf(failures ? "%d failures\n" : "All power checks passed\n", failures);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,170 @@
+// Regression checks for Simplifier: every rule on an expression it rewrites, then random expressions, each
+// evaluated before and after simplification at several points. Build and run from the repository root with
+//   g++ -std=c++11 -pthread -I. tests/SimplifierRegression.cpp QMath.cpp -o SimplifierRegression && ./SimplifierRegression
+#include "QMath.h"
+#include <algorithm>
+#include <cfenv>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+using namespace QMath;
+
+static int failures = 0;
+static std::set<std::string> fired;
+static std::mt19937 generator(20240611);
+
+static const std::map<char, double> points[] = {
+	{ { 'w', 0.3 }, { 'x', 1.25 }, { 'y', 0.75 }, { 'z', 2.5 } },
+	{ { 'w', 1.7 }, { 'x', 0.4 }, { 'y', 3.1 }, { 'z', 0.9 } },
+	{ { 'w', 2.2 }, { 'x', 2.75 }, { 'y', 0.15 }, { 'z', 1.3 } }
+};
+
+static bool close(double a, double b) { return std::fabs(a - b) <= 1e-9 * std::max(1.0, std::max(std::fabs(a), std::fabs(b))); }
+
+static size_t hits(const Simplifier& simplifier, const char* rule)
+{
+	for (const Simplifier::Statistic& statistic : simplifier.statistics())
+	{
+		if (std::strcmp(statistic.rule, rule) == 0) { return statistic.hits; }
+	}
+	return 0;
+}
+
+// Notes whether the value passed through an infinity on its way: 1 / e^(e^x) rounds to 0 where its simplified
+// form e^(-e^x) need not, and neither is wrong
+static double evaluate(const Expression* expression, const Bindings& bindings, bool& singular)
+{
+	std::feclearexcept(FE_ALL_EXCEPT);
+	double value = expression->evaluate(bindings);
+	singular |= std::fetestexcept(FE_OVERFLOW | FE_DIVBYZERO) != 0;
+	return value;
+}
+
+// Simplifies input and compares its value before and after wherever the original is defined; a simplified form
+// may be defined where the original is not, as x/x is at 0, but not the reverse. Returns the simplified form
+static std::string compare(const std::string& input, Simplifier& simplifier)
+{
+	std::unique_ptr<Expression> original(Expression::parse(input));
+	std::feclearexcept(FE_ALL_EXCEPT);
+	std::unique_ptr<Expression> simplified(simplifier.simplify(original->copyTree()));
+	bool folded = std::fetestexcept(FE_OVERFLOW | FE_DIVBYZERO) != 0;
+	for (const Simplifier::Statistic& statistic : simplifier.statistics())
+	{
+		if (statistic.hits) { fired.insert(statistic.rule); }
+	}
+
+	std::string result = simplified->toString();
+	for (const std::map<char, double>& varMap : points)
+	{
+		Bindings bindings(varMap);
+		bool singular = folded;
+		double before = evaluate(original.get(), bindings, singular);
+		double after = evaluate(simplified.get(), bindings, singular);
+		if (std::isfinite(before) && !singular && !close(after, before))
+		{
+			std::printf("FAIL %s: %s = %.17g, expected %.17g at x = %g\n", input.c_str(), result.c_str(), after, before, varMap.at('x'));
+			++failures;
+			break;
+		}
+	}
+	return result;
+}
+
+// Expects the named rule to fire and, where given, the result to print as expected
+static void check(const char* input, const char* rule, const char* expected = nullptr)
+{
+	Simplifier simplifier;
+	std::string result = compare(input, simplifier);
+	if (hits(simplifier, rule) == 0 || (expected && result != expected))
+	{
+		std::printf("FAIL %s: %s (%s %s), expected %s\n", input, result.c_str(), rule, hits(simplifier, rule) ? "fired" : "did not fire",
+			expected ? expected : "");
+		++failures;
+	}
+}
+
+static int uniform(int n) { return std::uniform_int_distribution<int>(0, n - 1)(generator); }
+
+// Draws leaves from a small pool, so that like terms, shared factors and repeated bases turn up often. Functions
+// are limited to well-conditioned ones: sin of e^300 differs entirely between two roundings of its argument
+static std::string randomExpression(int depth)
+{
+	static const char* const leaves[] = { "x", "y", "z", "w", "0", "1", "2", "3.5", "e", "x", "y" };
+	static const char* const functions[] = { "tanh", "ln", "log", "sqrt" };
+	static const char* const operators[] = { " + ", " - ", " * ", " / " };
+	static const char* const indices[] = { "0", "1", "2", "3", "-1", "0.5" };
+
+	switch (depth > 0 ? uniform(8) : 0)
+	{
+		case 0: return leaves[uniform(11)];
+		case 1: return "(" + randomExpression(depth - 1) + ")^" + indices[uniform(6)];
+		case 2: return std::string(functions[uniform(4)]) + "(" + randomExpression(depth - 1) + ")";
+		case 3: return uniform(2) ? "e^(" + randomExpression(depth - 1) + ")" : "ln(e^(" + randomExpression(depth - 1) + "))";
+		default: return "(" + randomExpression(depth - 1) + operators[uniform(4)] + randomExpression(depth - 1) + ")";
+	}
+}
+
+int main()
+{
+	// One expression per rule in the table
+	check("sin(2) * 3", "fold-constant");
+	check("2 + x + 3", "add-constants", "5 + x");
+	check("x + 0", "add-zero", "x");
+	check("2x + 3x", "add-collect", "5x");
+	check("x*y + x*z", "add-factorise", "x * (y + z)");
+	check("x - 0", "subtract-zero", "x");
+	check("0 - x", "subtract-zero");
+	check("sin(x) - sin(x)", "subtract-same", "0");
+	check("x*y - x*z", "subtract-factorise", "x * (y - z)");
+	check("0 * x * y", "multiply-zero", "0");
+	check("2 * x * 3", "multiply-constants", "6x");
+	check("1 * x * y", "multiply-one", "xy");
+	check("x * x^2 * y", "multiply-collect");
+	check("0 / x", "divide-zero", "0");
+	check("x / 1", "divide-one", "x");
+	check("sin(x) / sin(x)", "divide-same", "1");
+	check("x^3 / x", "divide-indices", "x^2");
+	check("1^x", "exponent-base", "1");
+	check("0^x", "exponent-base", "0");
+	check("x^1", "exponent-index", "x");
+	check("x^0", "exponent-index", "1");
+	check("(x^2)^3", "exponent-nested", "x^6");
+	check("((0 - z)^3)^0.5", "exponent-nested");
+	check("((0 - z)^2)^0.5", "subtract-zero");
+	check("e^ln(x)", "exponent-log", "x");
+	check("ln(e)", "log-same", "1");
+	check("ln(e^x)", "log-exponent", "x");
+
+	// Factors shared by several terms of a sum
+	check("x*y + x*z + w", "add-factorise", "w + x * (y + z)");
+	check("x + x*y", "add-factorise", "x * (1 + y)");
+	check("2*x*y + 3*x*z", "add-factorise", "x * (2y + 3z)");
+	check("sin(x)*y + 2*sin(x)", "add-factorise", "sin(x) * (2 + y)");
+	check("w*x*y + w*x*z + w*y", "add-factorise", "w * (xz + y * (1 + x))");
+
+	for (size_t i = 0; i < Simplifier().statistics().size(); ++i)
+	{
+		const char* rule = Simplifier().statistics()[i].rule;
+		if (!fired.count(rule))
+		{
+			std::printf("FAIL no check exercises %s\n", rule);
+			++failures;
+		}
+	}
+
+	for (int i = 0; i < 2000; ++i)
+	{
+		Simplifier simplifier;
+		compare(randomExpression(4), simplifier);
+	}
+
+	std::printf(failures ? "%d failures\n" : "All simplifier checks passed\n", failures);
+	return failures ? 1 : 0;
+}